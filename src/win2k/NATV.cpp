@@ -8,17 +8,15 @@
 *******************************************************************/
 
 #include "common.h"
-#include "natv.h"
 #include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
 
-/* --- typedefs ----------------------------------------------- */
-
-/* MIDI */
-
-extern SYNTH_DATA DeviceData[SYNTH_DATA_SIZE];
-extern int MidiPosition;
-extern BYTE * gBankMem;
-extern PUCHAR g_PortBase;
+/* --- tables ------------------------------------------------- */
 
 /* transformation of linear velocity value to
         logarithmic attenuation */
@@ -28,49 +26,15 @@ BYTE gbVelocityAtten[32] = {
         7, 6, 5, 5, 4, 4, 3, 3,
         2, 2, 1, 1, 1, 0, 0, 0 };
 
-BYTE pmask_MidiPitchBend[4] = {
+static const BYTE pmask_MidiPitchBend[4] = {
         0x10, 0x20, 0x40, 0x80 };
 
-BYTE    pan_mask[NUMCHANNELS];
-BYTE    gbVelLevel[NUMCHANNELS];
-
-/* channel volumes */
-BYTE    gbChanAtten[NUMCHANNELS];       /* attenuation of each channel, in .75 db steps */
-short   giBend[NUMCHANNELS];    /* bend for each channel */
-
-BYTE    hold_table[NUMCHANNELS];
-BYTE    gbChanVolume[NUMCHANNELS];
-BYTE    program_table[NUMCHANNELS];
-BYTE    gbChanExpr[NUMCHANNELS];
-BYTE    gbChanBendRange[NUMCHANNELS];
-BYTE    note_offs[NUMCHANNELS];
-voiceStruct voice_table[NUM2VOICES];
-USHORT  gwTimer;
-DWORD   voice1, voice2;
-
-USHORT NATV_table1[64] = {
-    1024, 1025, 1026, 1027, 1028, 1029, 1030, 1030, 1031, 1032,
-    1033, 1034, 1035, 1036, 1037, 1038, 1039, 1040, 1041, 1042,
-    1043, 1044, 1045, 1045, 1046, 1047, 1048, 1049, 1050, 1051,
-    1052, 1053, 1054, 1055, 1056, 1057, 1058, 1059, 1060, 1061,
-    1062, 1063, 1064, 1065, 1065, 1066, 1067, 1068, 1069, 1070,
-    1071, 1072, 1073, 1074, 1075, 1076, 1077, 1078, 1079, 1080,
-    1081, 1082, 1083, 1084,
-};
-USHORT NATV_table2[49] = {
-    256,  271,  287,  304,  323,  342,  362,  384,  406,  431,
-    456,  483,  512,  542,  575,  609,  645,  683,  724,  767,
-    813,  861,  912,  967,  1024, 1085, 1149, 1218, 1290, 1367,
-    1448, 1534, 1625, 1722, 1825, 1933, 2048, 2170, 2299, 2435,
-    2580, 2734, 2896, 3069, 3251, 3444, 3649, 3866, 4096,
-};
-
-int td_adjust_setup_operator[12] = {
+static const int td_adjust_setup_operator[12] = {
     256, 242, 228, 215, 203, 192,
     181, 171, 161, 152, 144, 136
 };
 
-SHORT fnum[12] = {
+static const SHORT fnum[12] = {
     514, 544, 577, 611,  /* G , G#, A , A# */
     647, 686, 727, 770,  /* B , C , C#, D  */
     816, 864, 916, 970   /* D#, E , F,  F# */
@@ -83,13 +47,16 @@ MidiAllNotesOff - switch off all active voices.
 inputs - none
 returns - none
 */
-VOID MidiAllNotesOff(void)
+VOID CEsfmEngine::MidiAllNotesOff(void)
 {
     BYTE i;
 
+    fmbegin();
+    apply_pending(m_dwBendPending | m_dwVolPending);
     for (i = 0; i < NUM2VOICES; i++) {
-        note_off (voice_table[i].bChannel, voice_table[i].bNote);
+        note_off (m_Voice[i].bChannel, m_Voice[i].bNote);
     }
+    fmflush();
 }
 
 /*****************************************************************
@@ -106,9 +73,13 @@ returns
 WORD NEAR PASCAL MidiCalcFAndB (DWORD dwPitch, BYTE bBlock)
 {
     // D1(("MidiCalcFAndB"));
-    /* bBlock is like an exponential to dwPitch (or FNumber) */
-    for (; dwPitch >= 0x400; dwPitch >>= 1, bBlock++)
-        ;
+    ULONG   msb;
+
+    /* bBlock is like an exponential to dwPitch (or FNumber), shift
+       the FNumber down to 10 bits and add that to the block */
+    _BitScanReverse(&msb, dwPitch | 0x200);
+    dwPitch >>= msb - 9;
+    bBlock += (BYTE)(msb - 9);
 
     if (bBlock > 0x07)
         bBlock = 0x07;  /* we cant do anything about this */
@@ -126,10 +97,7 @@ WORD NEAR PASCAL MidiCalcFAndB (DWORD dwPitch, BYTE bBlock)
 //
 //  Parameters:
 //     BYTE bChannel
-//        channel
-//
-//     short iBend
-//        values from -32768 to 32767, being -2 to +2 half steps
+//        channel, its bend and bend range are in m_Chan[]
 //
 //  Return Value:
 //     Nothing.
@@ -137,34 +105,37 @@ WORD NEAR PASCAL MidiCalcFAndB (DWORD dwPitch, BYTE bBlock)
 //
 //------------------------------------------------------------------------
 
-VOID NEAR PASCAL MidiPitchBend
+VOID CEsfmEngine::MidiPitchBend
 (
-    BYTE            bChannel,
-    USHORT          iBend
+    BYTE            bChannel
 )
 {
-   UINT i, j;
+   ULONG i;
+   UINT j;
    SHORT bnd;
+   DWORD dwMask;
+   USHORT mult;
 
    // D1( "\nMidiPitchBend" ) ;
 
-   // Remember the current bend..
+   mult = MidiChan_BendMult( &m_Chan[ bChannel ] ) ;
 
-   giBend[ bChannel ] = iBend ;
+   // Every note playing on the channel gets its
+   // pitch bent, unless the bend does not change
+   // its FNumber and block
 
-   // Loop through all the notes looking for the right
-   // channel.  Anything with the right channel gets its
-   // pitch bent...
-
-   for (i = 0; i < NUM2VOICES; i++)
-      if (voice_table[ i ].bChannel == bChannel && (voice_table[ i ].flags1 & VOICEFLAG_SETUP))
+   dwMask = m_dwChanVoices[ bChannel ];
+   while (_BitScanForward(&i, dwMask))
       {
+         dwMask &= dwMask - 1;
          for (j = 0 ; j < OPS_PER_CHAN; j++ )
          {
-             if ((pmask_MidiPitchBend[j] & voice_table[ i ].bPatch)) continue;
-             bnd = NATV_CalcBend( voice_table[ i ].detune[ j ], iBend, gbChanBendRange[bChannel] ) ;
-             bnd = MidiCalcFAndB( bnd, (voice_table[ i ].reg5[ j ] >> 2) & 7) ;
-             fmwrite( (WORD)(32 * i + 8 * j + 5), HIBYTE(bnd) | (voice_table[ i ].reg5[ j ] & 0xE0) );
+             if ((pmask_MidiPitchBend[j] & m_Voice[ i ].bPatch)) continue;
+             bnd = (SHORT)((m_Voice[ i ].detune[ j ] * mult + 512) >> 10) ;
+             bnd = MidiCalcFAndB( bnd, (m_Voice[ i ].reg5[ j ] >> 2) & 7) ;
+             if ((WORD)bnd == m_Voice[ i ].wFnumBlock[ j ]) continue;
+             m_Voice[ i ].wFnumBlock[ j ] = (WORD)bnd;
+             fmwrite( (WORD)(32 * i + 8 * j + 5), HIBYTE(bnd) | (m_Voice[ i ].reg5[ j ] & 0xE0) );
              fmwrite( (WORD)(32 * i + 8 * j + 4), bnd & 0xFF);
          }
       }
@@ -186,224 +157,617 @@ inputs
 returns
         none
 */
-VOID PASCAL MidiMessage (DWORD dwData)
+VOID CEsfmEngine::MidiMessage (DWORD dwData)
 {
     BYTE    bChannel, data2, data1;
-    int     i;
+    ULONG   i;
+    DWORD   dwMask;
+    MIDICHAN *pChan;
+    FMBANKMAP *pMap;
 
     // D1("\nMidiMessage");
+    m_Stats.dwMessages++;
+    fmbegin();
+
     bChannel = (BYTE) dwData & (BYTE)0x0f;
     data2 = (BYTE) (dwData >> 16) & (BYTE)0x7f;
     data1 = (BYTE) ((WORD) dwData >> 8) & (BYTE)0x7f;
+    pChan = &m_Chan[bChannel];
 
-    switch ((BYTE)dwData & 0xf0) {
-        case 0x90:
-#ifdef DEBUG
-            {
-                    char szTemp[4], szDebug[ 80 ];
-                    char ;
-                    szTemp[0] = "0123456789abcdef"[data1 >> 4];
-                    szTemp[1] = "0123456789abcdef"[data1 & 0x0f];
-                    szTemp[2] = ' ';
-                    szTemp[3] = 0;
-                    if ((bChannel == 9) && data2) D1(szTemp);
-                    
-                    wsprintf( szDebug, "bChannel = %d, data1 = %d",
-                            bChannel, data1 ) ;
-                    D1( szDebug ) ;
-            }
-#endif
+    if (m_fBatch)
+    {
+        /* In a batch bends and volume changes only update the channel,
+           the voices get the last value at the end of the batch.  Any
+           other message for the channel sees its voices up to date. */
+        if (((BYTE)dwData & 0xf0) == 0xe0)
+        {
+            if (m_dwBendPending & (1UL << bChannel))
+                m_Stats.dwBendsCoalesced++;
+            m_dwBendPending |= 1UL << bChannel;
+            MidiChan_Message(pChan, dwData);
+            fmflush();
+            return;
+        }
+        if (((BYTE)dwData & 0xf0) == 0xb0 && (data1 == 7 || data1 == 11))
+        {
+            if (m_dwVolPending & (1UL << bChannel))
+                m_Stats.dwVolumesCoalesced++;
+            m_dwVolPending |= 1UL << bChannel;
+            MidiChan_Message(pChan, dwData);
+            fmflush();
+            return;
+        }
+        apply_pending((m_dwBendPending | m_dwVolPending) & (1UL << bChannel));
+    }
+
+    switch (MidiChan_Message(pChan, dwData)) {
+        case MIDIEV_NOTEON:
+                note_on(bChannel, data1, data2);
+                break;
+
+        case MIDIEV_NOTEOFF:
+                note_off( bChannel, data1 );
+                break;
+
+        case MIDIEV_VOLUME:
+                NATV_CalcNewVolume(bChannel);
+                break;
 
-                /* turn key on, or key off if volume == 0 */
-                if (data2)
+        case MIDIEV_PAN:
+                /* change the pan level */
+                if ( pChan->bPan <= 80 )
                 {
-                    note_on(bChannel, data1, data2);
-                    break;
+                    if ( pChan->bPan >= 48 )
+                        m_bPanMask[bChannel] = 0x30;
+                    else
+                        m_bPanMask[bChannel] = 0x10;
                 }
+                else
+                {
+                    m_bPanMask[bChannel] = 0x20;
+                }
+                break;
 
-                /* else, continue through and turn key off */
-        case 0x80:
-                /* turn key off */
-                note_off( bChannel, data1 );
+        case MIDIEV_SUSTAIN:
+                if (!(pChan->bHold & MIDICHAN_SUSTAIN))
+                    hold_release(bChannel);
                 break;
 
-        case 0xb0:
-                // D1("\nChangeControl");
-                /* change control */
-                switch (data1) {
-                        case 6:
-                                if ( (hold_table[bChannel] & 6) == 6 )
-                                    gbChanBendRange[bChannel] = data2;
-                                break;
-                        case 7:
-                                gbChanAtten[bChannel] = gbVelocityAtten[data2 >> 1];
-                                gbChanVolume[bChannel] = data2;
-                                NATV_CalcNewVolume(bChannel);
-                                break;
-                        case 8:
-                        case 10:
-                                /* change the pan level */
-                                if ( data2 <= 80 )
-                                {
-                                    if ( data2 >= 48 )
-                                        pan_mask[bChannel] = 0x30;
-                                    else
-                                        pan_mask[bChannel] = 0x10;
-                                }
-                                else
-                                {
-                                    pan_mask[bChannel] = 0x20;
-                                }
-                                break;
-                        case 11:
-                                /* change expression */
-                                gbChanExpr[bChannel] = data2;
-                                NATV_CalcNewVolume(bChannel);
-                                break;
-                        case 64:
-                                /* sustain */
-                                hold_controller(bChannel, data2);
-                                break;
-                        case 100:
-                                if ( data2 == 0 )
-                                {
-                                    hold_table[bChannel] |= 2;
-                                    break;
-                                }
-                        case 98:
-                                hold_table[bChannel] &= ~2;
-                                break;
-                        case 101:
-                                if ( data2 == 0 )
-                                {
-                                    hold_table[bChannel] |= 4;
-                                    break;
-                                }
-                        case 99:
-                                hold_table[bChannel] &= ~4;
-                                break;
-                        case 120:
-                        case 124:
-                        case 125:
-                                for (i = 0; i < NUM2VOICES; i++)
-                                {
-                                    if ((voice_table[i].flags1 & VOICEFLAG_SETUP) && voice_table[i].bChannel == bChannel)
-                                        voice_off(i);
-                                }
-                                break;
-                        case 121:
-                                /* reset all controllers */
-                                if (hold_table[bChannel] & 1)
-                                {
-                                    for (i = 0; i < NUM2VOICES; i++)
-                                    {
-                                        if ((voice_table[i].flags1 & VOICEFLAG_SETUP) && voice_table[i].bChannel == bChannel && (voice_table[i].flags1 & VOICEFLAG_HOLD))
-                                            voice_off(i);
-                                    }
-                                }
-                                hold_table[bChannel] &= ~1u;
-                                gbChanVolume[bChannel] = 100;
-                                gbChanExpr[bChannel] = 127;
-                                giBend[bChannel] = 0x2000;
-                                pan_mask[bChannel] = 0x30;
-                                gbChanBendRange[bChannel] = 2;
-                                break;
-                        case 123:
-                        case 126:
-                        case 127:
-                                /* All notes off */
-                                for (i = 0; i < NUM2VOICES; i++)
-                                {
-                                    if ((voice_table[i].flags1 & VOICEFLAG_SETUP) && voice_table[i].bChannel == bChannel && (voice_table[i].flags1 & VOICEFLAG_HOLD) == 0)
-                                        voice_off(i);
-                                }
-                                break;
-                        };
+        case MIDIEV_SOUNDOFF:
+                dwMask = m_dwChanVoices[bChannel];
+                while (_BitScanForward(&i, dwMask))
+                {
+                    dwMask &= dwMask - 1;
+                    voice_off(i);
+                }
+                break;
+
+        case MIDIEV_RESETCTRL:
+                /* the voices pick up the new values with their next change */
+                hold_release(bChannel);
+                m_bPanMask[bChannel] = 0x30;
                 break;
 
-        case 0xc0:
-                program_table[bChannel] = data1;
+        case MIDIEV_NOTESOFF:
+                dwMask = m_dwChanVoices[bChannel] & ~m_dwChanHeld[bChannel];
+                while (_BitScanForward(&i, dwMask))
+                {
+                    dwMask &= dwMask - 1;
+                    voice_off(i);
+                }
                 break;
 
-        case 0xe0:
-                // D1("\nBend");
-                /* pitch bend */
-                MidiPitchBend (bChannel, data1 | (data2 << 7));
+        case MIDIEV_PROGRAM:
+                m_bBank[bChannel] = (BYTE)FmBank_Find(m_pBank,
+                        FMBANK_NUMBER(pChan->bBankMsb, pChan->bBankLsb));
+                // fetch the patch now, so it is there for the first note
+                pMap = m_pBank->pMap[m_bBank[bChannel]];
+                if ( bChannel != 9 && FMBANK_MODE(pMap, data1) == FMBANK_LAZY )
+                    FmBank_Want(m_pBank, pMap, data1);
+                break;
 
+        case MIDIEV_BEND:
+                MidiPitchBend(bChannel);
                 break;
     };
 
+    fmflush();
     return;
 }
 
 
+/**************************************************************
+MidiBatchBegin - Start a batch of messages, i.e. one buffer from
+        the client.  Until MidiBatchEnd() only the last pitch bend,
+        volume and expression per channel goes out to the voices,
+        if coalescing is on.
+*/
+VOID CEsfmEngine::MidiBatchBegin (void)
+{
+    m_fBatch = m_fCoalesce;
+}
+
+/**************************************************************
+MidiBatchEnd - End a batch, send the values held back.
+*/
+VOID CEsfmEngine::MidiBatchEnd (void)
+{
+    m_fBatch = FALSE;
+    if (m_dwBendPending | m_dwVolPending)
+    {
+        fmbegin();
+        apply_pending(m_dwBendPending | m_dwVolPending);
+        fmflush();
+    }
+}
+
+/**************************************************************
+apply_pending - Bring the voices of the given channels up to date
+        with their bend and volume.
+
+inputs
+        DWORD   dwChannels - bit n for channel n
+*/
+VOID CEsfmEngine::apply_pending (DWORD dwChannels)
+{
+    ULONG   i;
+
+    while (_BitScanForward(&i, dwChannels))
+    {
+        dwChannels &= dwChannels - 1;
+        if (m_dwBendPending & (1UL << i))
+        {
+            m_dwBendPending &= ~(1UL << i);
+            MidiPitchBend((BYTE)i);
+        }
+        if (m_dwVolPending & (1UL << i))
+        {
+            m_dwVolPending &= ~(1UL << i);
+            NATV_CalcNewVolume((BYTE)i);
+        }
+    }
+}
+
+/**************************************************************
+MidiReset - GM/GS/XG reset: silence the chip and bring all
+        channels back to their power on state.
+*/
+VOID CEsfmEngine::MidiReset (void)
+{
+    m_dwBendPending = m_dwVolPending = 0;
+    fmsilence();
+    fmreset();
+    RtlZeroMemory(m_bBank, sizeof(m_bBank));
+    RtlZeroMemory(m_bVelLevel, sizeof(m_bVelLevel));
+    RtlZeroMemory(m_bNoteOffs, sizeof(m_bNoteOffs));
+}
+
+/**************************************************************
+MidiPatch - replace one voice of a patch in the default bank.  Voice 0
+        also sets the number of voices of the patch, and adds it to the
+        bank if it was not there.  Voices already playing keep their
+        sound, the next note on picks up the new data.
+
+inputs
+        int     patch - 0-127 melodic, 128-255 drums
+        int     voice - 0 or 1
+        const BYTE *pVoice - FMBANK_VOICESIZE bytes of voice data
+returns
+        none
+*/
+VOID CEsfmEngine::MidiPatch (int patch, int voice, const BYTE *pVoice)
+{
+    if (!FmBank_SetVoice(m_pBank, 0, patch, voice, pVoice))
+        _DbgPrintF(DEBUGLVL_TERSE, ("Patch %d does not fit into the pool", patch));
+}
+
+/**************************************************************
+MidiSysEx - This handles a complete SysEx message.  Understood are
+        GM System On, GS Reset and XG System On, which reset the synth,
+        and the ESFM patch upload, see SYSEX_PATCH in natv.h.
+        Everything else is ignored.
+
+inputs
+        const BYTE *pData - the message, from 0xF0 to 0xF7
+        ULONG   ulLength - its length
+returns
+        none
+*/
+VOID CEsfmEngine::MidiSysEx (const BYTE *pData, ULONG ulLength)
+{
+    static const BYTE BCODE GsReset[] = { 0xF0, 0x41, 0x00, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7 };
+    static const BYTE BCODE XgOn[] = { 0xF0, 0x43, 0x10, 0x4C, 0x00, 0x00, 0x7E, 0x00, 0xF7 };
+    BYTE    bVoice[FMBANK_VOICESIZE];
+    ULONG   i;
+
+    // F0 7E <device> 09 01 F7
+    if ( ulLength == 6 && pData[1] == 0x7E && pData[3] == 0x09 && pData[4] == 0x01 )
+    {
+        MidiReset();
+        return;
+    }
+
+    // the device ID sits in byte 2 of GS, in its low nibble for XG
+    if ( ulLength == sizeof(GsReset) &&
+         RtlCompareMemory(pData, GsReset, 2) == 2 &&
+         RtlCompareMemory(pData + 3, GsReset + 3, sizeof(GsReset) - 3) == sizeof(GsReset) - 3 )
+    {
+        MidiReset();
+        return;
+    }
+    if ( ulLength == sizeof(XgOn) &&
+         RtlCompareMemory(pData, XgOn, 2) == 2 && (pData[2] & 0xF0) == 0x10 &&
+         RtlCompareMemory(pData + 3, XgOn + 3, sizeof(XgOn) - 3) == sizeof(XgOn) - 3 )
+    {
+        MidiReset();
+        return;
+    }
+
+    // F0 7D 45 01 <bank> <program> <voice> <nibbles> F7
+    if ( ulLength == SYSEX_PATCHSIZE && pData[1] == 0x7D &&
+         pData[2] == SYSEX_ESFM && pData[3] == SYSEX_PATCH &&
+         pData[4] <= 1 && pData[6] <= 1 )
+    {
+        for (i = 0; i < FMBANK_VOICESIZE; i++)
+        {
+            if ( (pData[7 + 2 * i] | pData[8 + 2 * i]) & 0xF0 )
+                return;
+            bVoice[i] = (BYTE)((pData[7 + 2 * i] << 4) | pData[8 + 2 * i]);
+        }
+        MidiPatch(pData[4] * 128 + pData[5], pData[6], bVoice);
+    }
+}
+
+
+
+/**************************************************************
+ * fmout - Puts a byte out to the FM chip.
+ *
+ * Writes of a value the register already holds (according to the
+ * shadow) are skipped.  The chip keeps the high address byte latched
+ * across writes, so it is only sent when it changes, unless built with
+ * FM_NOLATCH.  If a sink is
+ * set, the write goes there instead of to the ports.
+ *
+ * inputs
+ *      WORD    wAddress - 0x00 to 0x2ff
+ *      BYTE    bValue - value written
+ * returns
+ *      none
+ */
+VOID CEsfmEngine::fmout (WORD wAddress, BYTE bValue)
+{
+  if (wAddress < FM_NUMREGS)
+  {
+    BYTE bMask = (BYTE)(1 << (wAddress & 7));
+
+    if ((m_bShadowValid[wAddress >> 3] & bMask) && m_bShadow[wAddress] == bValue)
+    {
+      m_Stats.dwShadowHits++;
+      return;
+    }
+    m_bShadow[wAddress] = bValue;
+    m_bShadowValid[wAddress >> 3] |= bMask;
+  }
+  m_Stats.dwShadowMisses++;
+#ifdef FM_TRACE
+  FmTrace_Write(wAddress, bValue);
+#endif
+
+  if (m_pfnSink)
+  {
+    m_pfnSink(m_pSinkContext, wAddress, bValue);
+    return;
+  }
+
+  fmport(2, LOBYTE(wAddress));
+#ifdef FM_NOLATCH
+  fmport(3, HIBYTE(wAddress));
+#else
+  if (HIBYTE(wAddress) != m_wLatchHigh)
+  {
+    fmport(3, HIBYTE(wAddress));
+    m_wLatchHigh = HIBYTE(wAddress);
+  }
+  else
+  {
+    m_Stats.dwLatchSkips++;
+  }
+#endif
+  fmport(1, bValue);
+}
+
+/**************************************************************
+ * fmport - Writes one of the FM ports, once the chip has settled
+ * from the previous write.
+ */
+VOID CEsfmEngine::fmport (int iPort, BYTE bValue)
+{
+  FmPace_Wait(&m_Pace);
+  WRITE_PORT_UCHAR(m_PortBase + iPort, bValue);
+  FmPace_Done(&m_Pace);
+  m_Stats.dwPortWrites++;
+}
 
 /**************************************************************
  * fmwrite - Sends a byte to the FM chip.
  *
+ * Between fmbegin() and fmflush() the write is only queued.
+ *
  * inputs
- *      WORD    wAddress - 0x00 to 0x1ff
+ *      WORD    wAddress - 0x00 to 0x2ff
  *      BYTE    bValue - value written
  * returns
  *      none
  */
-VOID FAR PASCAL fmwrite (WORD wAddress, BYTE bValue)
+VOID CEsfmEngine::fmwrite (WORD wAddress, BYTE bValue)
+{
+  if (!m_fQueueing)
+  {
+    fmout(wAddress, bValue);
+    return;
+  }
+
+  if (m_iQueueLen == FM_QUEUESIZE)
+  {
+    fmflush();
+    m_fQueueing = TRUE;
+  }
+
+  fmqueue(wAddress, bValue);
+}
+
+/**************************************************************
+ * fmqueue - Appends a write to the queue, the caller has made
+ * sure there is room for it.
+ */
+VOID CEsfmEngine::fmqueue (WORD wAddress, BYTE bValue)
 {
-  WRITE_PORT_UCHAR(g_PortBase + 2, LOBYTE(wAddress));
-  KeStallExecutionProcessor(10);
-  WRITE_PORT_UCHAR(g_PortBase + 3, HIBYTE(wAddress));
-  KeStallExecutionProcessor(10);
-  WRITE_PORT_UCHAR(g_PortBase + 1, bValue);
-  KeStallExecutionProcessor(10);
+  int iSlot;
+
+  /* A later write to the same register since the last key on/off
+     supersedes the queued one, nothing reads the register in between.
+     Except a write of 0 to register 7: it mutes the operator while its
+     other registers are rewritten, so it has to reach the chip */
+  if (wAddress < FM_QUEUEBARRIER)
+  {
+    iSlot = m_wQueueSlot[wAddress];
+    if (iSlot >= m_iQueueBarrier && iSlot < m_iQueueLen &&
+        m_Queue[iSlot].wAddress == wAddress &&
+        ((wAddress & 7) != 7 || m_Queue[iSlot].bValue != 0))
+    {
+      m_Queue[iSlot].wAddress = FM_QUEUEDEAD;
+      m_Stats.dwCoalesced++;
+    }
+    m_wQueueSlot[wAddress] = (WORD)m_iQueueLen;
+  }
+
+  m_Queue[m_iQueueLen].wAddress = wAddress;
+  m_Queue[m_iQueueLen].bValue = bValue;
+  m_iQueueLen++;
+
+  if (wAddress >= FM_QUEUEBARRIER)
+    m_iQueueBarrier = m_iQueueLen;
 }
 
+/**************************************************************
+ * fmtemplate - Writes the registers of a voice set up from a patch
+ * template.  Every operator is silenced through register 7 first,
+ * then registers 0 to 7 are written.
+ *
+ * inputs
+ *      WORD    wBase - register 0 of the voice
+ *      const BYTE *pRegs - FMBANK_TMPLSIZE register values
+ * returns
+ *      none
+ */
+VOID CEsfmEngine::fmtemplate (WORD wBase, const BYTE *pRegs)
+{
+  int op, k;
+
+  if (!m_fQueueing)
+  {
+    for (op = 0; op < OPS_PER_CHAN; op++, wBase += 8, pRegs += 8)
+    {
+      fmout((WORD)(wBase + 7), 0);
+      for (k = 0; k < 8; k++)
+        fmout((WORD)(wBase + k), pRegs[k]);
+    }
+    return;
+  }
+
+  /* Keep the whole voice in one batch.  fmqueue() never drops the mute,
+     so the operator stays silent while it is rewritten */
+  if (m_iQueueLen > FM_QUEUESIZE - FMBANK_TMPLSIZE - OPS_PER_CHAN)
+  {
+    fmflush();
+    m_fQueueing = TRUE;
+  }
+  for (op = 0; op < OPS_PER_CHAN; op++, wBase += 8, pRegs += 8)
+  {
+    fmqueue((WORD)(wBase + 7), 0);
+    for (k = 0; k < 8; k++)
+      fmqueue((WORD)(wBase + k), pRegs[k]);
+  }
+}
+
+/**************************************************************
+ * fmbegin - Start collecting fmwrite() calls into the write queue.
+ */
+VOID CEsfmEngine::fmbegin ()
+{
+  m_iQueueLen = 0;
+  m_iQueueBarrier = 0;
+  m_fQueueing = TRUE;
+}
+
+/**************************************************************
+ * fmflush - Send out everything in the write queue in one burst.
+ */
+VOID CEsfmEngine::fmflush ()
+{
+  int i;
+
+  for (i = 0; i < m_iQueueLen; i++)
+  {
+    if (m_Queue[i].wAddress != FM_QUEUEDEAD)
+      fmout(m_Queue[i].wAddress, m_Queue[i].bValue);
+  }
+
+  m_iQueueLen = 0;
+  m_iQueueBarrier = 0;
+  m_fQueueing = FALSE;
+}
+
+
+/*
+ * Init - attach the engine to a chip and a patch bank.
+ */
+void CEsfmEngine::Init(PUCHAR PortBase, FMBANK *pBank)
+{
+    int i;
+
+    m_PortBase = PortBase;
+    m_pBank = pBank;
+    m_pfnSink = NULL;
+    m_pSinkContext = NULL;
+    m_fQueueing = FALSE;
+    FmPace_Init(&m_Pace, FM_ESFM_DELAY);
+
+    // drums are stolen last, then the lower channels
+    for (i = 0; i < NUMCHANNELS; i++)
+        m_bStealRank[i] = (BYTE)(i == 9 ? 0 : i < 9 ? i + 1 : i);
+    m_fDemote2nd = TRUE;
+    m_fCoalesce = TRUE;
+    m_fBatch = FALSE;
+    m_dwBendPending = m_dwVolPending = 0;
+
+    RtlZeroMemory(m_Voice, sizeof(m_Voice));
+    RtlZeroMemory(m_bBank, sizeof(m_bBank));
+    RtlZeroMemory(m_bVelLevel, sizeof(m_bVelLevel));
+    RtlZeroMemory(m_bNoteOffs, sizeof(m_bNoteOffs));
+    RtlZeroMemory(&m_Stats, sizeof(m_Stats));
+    fmreset();
+    fminvalidate();
+}
+
+/*
+ * SetSink - send the register writes to pfnSink instead of the chip,
+ * or back to the chip if pfnSink is NULL.  The new target starts with
+ * unknown register contents, so the shadow is dropped.
+ */
+void CEsfmEngine::SetSink(PFNFMTRACESINK pfnSink, PVOID pContext)
+{
+    if (m_fQueueing)
+        fmflush();
+    m_pfnSink = pfnSink;
+    m_pSinkContext = pContext;
+    fminvalidate();
+}
+
+/*
+ * SetStealRank - set the rank of a channel for voice stealing, voices
+ * of channels with a higher rank are stolen first.
+ */
+void CEsfmEngine::SetStealRank(BYTE bChannel, BYTE bRank)
+{
+    if (bChannel >= NUMCHANNELS || bRank >= STEAL_RANKS)
+        return;
+    m_bStealRank[bChannel] = bRank;
+    steal_rebuild();
+}
+
+/*
+ * SetDemote2nd - whether the second voices of two voice patches are
+ * stolen before any other voice.
+ */
+void CEsfmEngine::SetDemote2nd(BOOL fDemote2nd)
+{
+    m_fDemote2nd = fDemote2nd;
+    steal_rebuild();
+}
+
+/*
+ * SetCoalesce - whether bends and volume changes within a batch are
+ * coalesced, see MidiBatchBegin().
+ */
+void CEsfmEngine::SetCoalesce(BOOL fCoalesce)
+{
+    m_fCoalesce = fCoalesce;
+}
 
 /*
- * fmreset - silence the board and set all voices off.
+ * fminvalidate - forget the register shadow and the address latch,
+ * i.e. after the chip has been reset behind our back.
  */
-void FAR PASCAL fmreset() 
+void CEsfmEngine::fminvalidate()
+{
+    RtlZeroMemory(m_bShadowValid, sizeof(m_bShadowValid));
+    m_wLatchHigh = FM_LATCHUNKNOWN;
+}
+
+/*
+ * fmreset - set the channels to their defaults and all voices off.
+ * Does not touch the chip, see fmsilence().
+ */
+void CEsfmEngine::fmreset()
 {
     int i;
     
     for (i=0; i<16; i++) 
     {
-        giBend[i]           = 0x2000;
-        gbChanBendRange[i]  = 0x02;
-        hold_table[i]       = 0x00;
-        gbChanExpr[i]       = 0x7F;
-        gbChanVolume[i]     = 0x64;
-        gbChanAtten[i]      = 0x04;
-        pan_mask[i]         = 0x30;
+        MidiChan_Reset(&m_Chan[i]);
+        m_bPanMask[i]         = 0x30;
     }
     
     for (i=0; i < 18; i++) 
     {
-        voice_table[i].wTime = 0;
-        voice_table[i].flags1 = 0;
+        m_Voice[i].wTime = 0;
+        m_Voice[i].flags1 = 0;
     }
+    RtlZeroMemory(m_dwNoteVoices, sizeof(m_dwNoteVoices));
+    RtlZeroMemory(m_dwChanVoices, sizeof(m_dwChanVoices));
+    RtlZeroMemory(m_dwChanHeld, sizeof(m_dwChanHeld));
+    m_dwActiveVoices = 0;
     
-    gwTimer = 0;
+    m_wTimer = 0;
+    steal_rebuild();
 }
 
-SHORT NATV_CalcBend(USHORT detune, USHORT iBend, USHORT iBendRange)
+/*
+ * fmsilence - cut off every voice on the chip: all operators to full
+ * attenuation and fastest release, then all keys off.  Goes out as a
+ * single burst, writes the shadow says are not needed are dropped.
+ */
+void CEsfmEngine::fmsilence()
 {
-    //!WARN iBend is int16 in OPL midi driver sample
-    if ( iBend == 0x2000 ) 
-        return detune;
-    else 
-	{
-        int v5;
-        if ( iBend >= 0x3F80 ) iBend = 0x4000;
-        v5 = ((iBendRange * (((int)iBend - 0x2000))) >> 5) + 0x1800;
-        return (detune * (USHORT)((NATV_table1[(v5>>2)&0x3F] * NATV_table2[v5>>8]) >> 10) + 512) >> 10;
+    int i, j;
+
+    fmbegin();
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            fmwrite((WORD)(i * 32 + j * 8 + 1), 0x3F);
+            fmwrite((WORD)(i * 32 + j * 8 + 3), 0x0F);
+        }
     }
+    for (i = 0x240; i <= 0x253; i++)
+        fmwrite((WORD)i, 0);
+    fmflush();
 }
 
-BYTE NATV_CalcVolume(BYTE reg1, BYTE bVelocity, BYTE bChannel)
+/*
+ * NATV_CalcVolumeAdd - attenuation the channel volume and expression
+ * add to an operator with the given velocity mode, 0xFF if the channel
+ * is muted.
+ */
+BYTE CEsfmEngine::NATV_CalcVolumeAdd(BYTE bVelocity, BYTE bChannel)
 {
     BYTE vol;
+    MIDICHAN *pChan = &m_Chan[bChannel];
 
-    if ( !gbChanVolume[bChannel] ) return 63;
+    if ( !pChan->bVolume ) return 0xFF;
 
     switch ( bVelocity )
     {
@@ -412,141 +776,189 @@ BYTE NATV_CalcVolume(BYTE reg1, BYTE bVelocity, BYTE bChannel)
         vol = 0;
         break;
     case 1:
-        vol = ((127 - gbChanExpr[bChannel]) >> 4 ) + ((127 - gbChanVolume[bChannel]) >> 4);
+        vol = ((127 - pChan->bExpr) >> 4 ) + ((127 - pChan->bVolume) >> 4);
         break;
     case 2:
-        vol = ((127 - gbChanExpr[bChannel]) >> 3) + ((127 - gbChanVolume[bChannel]) >> 3);
+        vol = ((127 - pChan->bExpr) >> 3) + ((127 - pChan->bVolume) >> 3);
         break;
     case 3:
-        vol = gbChanVolume[bChannel];
+        vol = pChan->bVolume;
         if ( vol < 64 )
             vol = ((63 - vol) >> 1) + 16;
         else
             vol = (127 - vol) >> 2;
-        if ( gbChanExpr[bChannel] < 64 )
+        if ( pChan->bExpr < 64 )
         {
-            vol += ((63 - gbChanExpr[bChannel]) >> 1) + 16;
+            vol += ((63 - pChan->bExpr) >> 1) + 16;
         }
         else
         {
-            vol += ((127 - gbChanExpr[bChannel]) >> 2);
+            vol += ((127 - pChan->bExpr) >> 2);
         }
         break;
     }
-    vol += (reg1 & 0x3F);          // ATTENUATION
+    return vol;
+}
+
+/*
+ * NATV_ApplyVolume - operator register 1 for the KSL and attenuation
+ * in reg1 plus the result of NATV_CalcVolumeAdd().
+ */
+__inline BYTE NATV_ApplyVolume(BYTE reg1, BYTE add)
+{
+    BYTE vol;
+
+    if ( add == 0xFF ) return 63;
+    vol = add + (reg1 & 0x3F);     // ATTENUATION
     if ( vol > 63 ) vol = 63;
     return vol | reg1 & 0xC0;      // KSL
 }
 
-void NATV_CalcNewVolume(BYTE bChannel)
+BYTE CEsfmEngine::NATV_CalcVolume(BYTE reg1, BYTE bVelocity, BYTE bChannel)
 {
-    WORD i, j;
+    return NATV_ApplyVolume(reg1, NATV_CalcVolumeAdd(bVelocity, bChannel));
+}
 
-    for (i=0; i < NUM2VOICES; i++)
+/*
+ * NATV_CalcNewVolume - update the operators of a channel (0xFF: of all
+ * channels) after its volume or expression changed.  Operators whose
+ * register 1 comes out the same as last written are not touched.
+ */
+void CEsfmEngine::NATV_CalcNewVolume(BYTE bChannel)
+{
+    ULONG i;
+    WORD j;
+    BYTE add[4], vol;
+    BYTE bAddChannel = 0xFF;
+    DWORD dwMask = (bChannel == 0xFF) ? m_dwActiveVoices : m_dwChanVoices[bChannel];
+
+    while (_BitScanForward(&i, dwMask))
     {
-        voiceStruct *voice = &voice_table[i];
-        if ((voice->flags1 & VOICEFLAG_SETUP) && (voice->bChannel == bChannel || bChannel == 0xFF)) 
+        voiceStruct *voice = &m_Voice[i];
+
+        dwMask &= dwMask - 1;
+        if (voice->bChannel != bAddChannel)
         {
-            for (j=0; j < OPS_PER_CHAN; j++)
-                fmwrite(i * 32 + j * 8 + 1, NATV_CalcVolume(voice->reg1[j], (voice->bVelocity >> (j*2)) & 3, voice->bChannel));
+            bAddChannel = voice->bChannel;
+            for (j=0; j < 4; j++)
+                add[j] = NATV_CalcVolumeAdd((BYTE)j, bAddChannel);
+        }
+        for (j=0; j < OPS_PER_CHAN; j++)
+        {
+            vol = NATV_ApplyVolume(voice->reg1[j], add[(voice->bVelocity >> (j*2)) & 3]);
+            if (vol == voice->bAtten[j]) continue;
+            voice->bAtten[j] = vol;
+            fmwrite((WORD)(i * 32 + j * 8 + 1), vol);
         }
     }   
 }
 
 
-void note_on(BYTE bChannel, BYTE bNote, BYTE bVelocity)
+void CEsfmEngine::note_on(BYTE bChannel, BYTE bNote, BYTE bVelocity)
 {
     int patch;
-    int offset;
-    BYTE flags_voice1;
-    int fixed_pitch;
+    int voice, voice2;
+    BYTE flags_voice1, flags_voice2, bMode;
+    FMBANKMAP *pMap;
 
     if ( bChannel == 9 )
         patch = bNote + 128;
     else
-        patch = program_table[bChannel];
-    offset = gBankMem[2 * patch] + ((int)gBankMem[2 * patch + 1] << 8);
-    if ( offset )
+        patch = m_Chan[bChannel].bProgram;
+    // patches missing from the selected bank, or still being fetched,
+    // come from the default one
+    pMap = m_pBank->pMap[m_bBank[bChannel]];
+    bMode = FMBANK_MODE(pMap, patch);
+    if ( bMode == FMBANK_LAZY )
+        FmBank_Want(m_pBank, pMap, patch);
+    if ( bMode >= FMBANK_LAZY )
     {
-        flags_voice1 = gBankMem[offset];
-        fixed_pitch = (flags_voice1 >> 1) & 3;
-        switch (fixed_pitch)
+        pMap = m_pBank->pMap[0];
+        bMode = FMBANK_MODE(pMap, patch);
+        if ( bMode == FMBANK_LAZY )
+            FmBank_Want(m_pBank, pMap, patch);
+    }
+    if ( bMode < FMBANK_LAZY )
+    {
+        voice = pMap->wVoice[patch][0];
+        voice2 = pMap->wVoice[patch][1];
+        flags_voice1 = m_pBank->bFlags[voice];
+        flags_voice2 = bMode ? m_pBank->bFlags[voice2] : 0;
+        switch (bMode)
         {
         case 0:
             find_voice(flags_voice1 & 1, 0, bChannel, bNote);
-            if ( voice1 == 255 ) voice1 = steal_voice(gBankMem[offset] & 1);
-            setup_voice(voice1, offset, bChannel, bNote, bVelocity);
-            voice_on(voice1);
+            if ( m_dwVoice1 == 255 ) m_dwVoice1 = steal_voice(flags_voice1 & 1);
+            setup_voice(m_dwVoice1, voice, bChannel, bNote, bVelocity);
+            voice_on(m_dwVoice1);
             break;
         case 1:
-            find_voice(flags_voice1 & 1, gBankMem[offset + 36] & 1, bChannel, bNote);
-            if (voice1 == 255) voice1 = steal_voice(gBankMem[offset] & 1);
-            setup_voice(voice1, offset, bChannel, bNote, bVelocity);
-            if (voice2 != 255)
+            find_voice(flags_voice1 & 1, flags_voice2 & 1, bChannel, bNote);
+            if (m_dwVoice1 == 255) m_dwVoice1 = steal_voice(flags_voice1 & 1);
+            setup_voice(m_dwVoice1, voice, bChannel, bNote, bVelocity);
+            if (m_dwVoice2 != 255)
             {
-                setup_voice(voice2, offset + 36, bChannel, bNote, bVelocity);
-                voice_table[voice2].flags1 |= VOICEFLAG_2NDVOICE;
-                voice_on(voice2);
+                setup_voice(m_dwVoice2, voice2, bChannel, bNote, bVelocity);
+                m_Voice[m_dwVoice2].flags1 |= VOICEFLAG_2NDVOICE;
+                steal_touch(m_dwVoice2);
+                voice_on(m_dwVoice2);
             }
-            voice_on(voice1);
+            voice_on(m_dwVoice1);
             break;
         case 2:
-            find_voice(flags_voice1 & 1, gBankMem[offset + 36] & 1, bChannel, bNote);
-            if ( voice1 == 255 )
-            voice1 = steal_voice(gBankMem[offset] & 1);
-            if ( voice2 == 255 )
-            voice2 = steal_voice(gBankMem[offset + 36] & 1);
-            setup_voice(voice1, offset, bChannel, bNote, bVelocity);
-            setup_voice(voice2, offset + 36, bChannel, bNote, bVelocity);
-            voice_on(voice1);
-            voice_on(voice2);
+            find_voice(flags_voice1 & 1, flags_voice2 & 1, bChannel, bNote);
+            if ( m_dwVoice1 == 255 )
+            m_dwVoice1 = steal_voice(flags_voice1 & 1);
+            if ( m_dwVoice2 == 255 )
+            m_dwVoice2 = steal_voice(flags_voice2 & 1);
+            setup_voice(m_dwVoice1, voice, bChannel, bNote, bVelocity);
+            setup_voice(m_dwVoice2, voice2, bChannel, bNote, bVelocity);
+            voice_on(m_dwVoice1);
+            voice_on(m_dwVoice2);
             break;
         }
-        gbVelLevel[bChannel] = bVelocity;
-        if (note_offs[bChannel] == 255) note_offs[bChannel]=0; else note_offs[bChannel]++;
+        m_bVelLevel[bChannel] = bVelocity;
+        if (m_bNoteOffs[bChannel] == 255) m_bNoteOffs[bChannel]=0; else m_bNoteOffs[bChannel]++;
     }
 }
 
-void note_off(BYTE bChannel, BYTE bNote)
+void CEsfmEngine::note_off(BYTE bChannel, BYTE bNote)
 {
-    int i;
+    ULONG i;
+    DWORD dwMask = m_dwNoteVoices[bChannel][bNote];
     
-    for (i=0; i<18; i++)
+    while (_BitScanForward(&i, dwMask))
     {
-		voiceStruct *voice = &voice_table[i];
-        if ((voice->flags1 & VOICEFLAG_SETUP) && voice->bChannel == bChannel && voice->bNote == bNote)
+        dwMask &= dwMask - 1;
+        if ( m_Chan[bChannel].bHold & MIDICHAN_SUSTAIN ) 
         {
-            if ( hold_table[bChannel] & 1 ) 
-            {
-                voice->flags1 |= VOICEFLAG_HOLD;
-            }
-            else
-            {
-                voice_off(i);
-            }
+            m_Voice[i].flags1 |= VOICEFLAG_HOLD;
+            m_dwChanHeld[bChannel] |= 1UL << i;
+        }
+        else
+        {
+            voice_off(i);
         }
     }
 }
 
-void hold_controller(BYTE bChannel, BYTE bVelocity)
+/*
+ * hold_release - the sustain pedal of a channel is up, release the
+ * voices it held.
+ */
+void CEsfmEngine::hold_release(BYTE bChannel)
 {
-    if ( bVelocity < 64 ) 
+    ULONG i;
+    DWORD dwMask = m_dwChanHeld[bChannel];
+
+    while (_BitScanForward(&i, dwMask))
     {
-        int i;
-        
-        hold_table[bChannel] &= ~1;
-        
-        for (i = 0; i< NUM2VOICES; i++)
-        {
-            if ((voice_table[i].flags1 & VOICEFLAG_HOLD) && voice_table[i].bChannel == bChannel)
-                voice_off(i);
-        }
-    } else {
-        hold_table[bChannel] |= 1;
+        dwMask &= dwMask - 1;
+        voice_off(i);
     }
 }
 
-void voice_on(int voiceNr)
+void CEsfmEngine::voice_on(int voiceNr)
 {
     if ( voiceNr >= 16 )
     {
@@ -567,7 +979,7 @@ void voice_on(int voiceNr)
     }
 }
 
-void voice_off(int voiceNr)
+void CEsfmEngine::voice_off(int voiceNr)
 {
     if ( voiceNr >= 16 )
     {
@@ -586,137 +998,236 @@ void voice_off(int voiceNr)
     {
         fmwrite((USHORT)voiceNr + 0x240, 0);
     }
-    voice_table[voiceNr].flags1 = VOICEFLAG_VOICEOFF;
-    voice_table[voiceNr].wTime = (USHORT)gwTimer;
-    gwTimer++;
+    voice_unlink(voiceNr);
+    m_Voice[voiceNr].flags1 = VOICEFLAG_VOICEOFF;
+    m_Voice[voiceNr].wTime = (USHORT)m_wTimer;
+    steal_touch(voiceNr);
+    m_wTimer++;
 }
 
-void find_voice(BOOL patch1617_allowed_voice1, BOOL patch1617_allowed_voice2, BYTE bChannel, BYTE bNote)
+/*
+ * voice_link - enter a voice that has just been set up into the index.
+ */
+void CEsfmEngine::voice_link(int voiceNr)
 {
-    int i;
+    voiceStruct *voice = &m_Voice[voiceNr];
+    DWORD dwBit = 1UL << voiceNr;
+
+    m_dwNoteVoices[voice->bChannel][voice->bNote] |= dwBit;
+    m_dwChanVoices[voice->bChannel] |= dwBit;
+    m_dwActiveVoices |= dwBit;
+}
+
+/*
+ * voice_unlink - remove a voice from the index, before it is turned
+ * off or set up again.
+ */
+void CEsfmEngine::voice_unlink(int voiceNr)
+{
+    voiceStruct *voice = &m_Voice[voiceNr];
+    DWORD dwBit = ~(1UL << voiceNr);
+
+    if (voice->flags1 & VOICEFLAG_SETUP)
+    {
+        m_dwNoteVoices[voice->bChannel][voice->bNote] &= dwBit;
+        m_dwChanVoices[voice->bChannel] &= dwBit;
+        m_dwChanHeld[voice->bChannel] &= dwBit;
+        m_dwActiveVoices &= dwBit;
+    }
+}
+
+void CEsfmEngine::find_voice(BOOL patch1617_allowed_voice1, BOOL patch1617_allowed_voice2, BYTE bChannel, BYTE bNote)
+{
+    ULONG i;
     USHORT td, timediff1=0, timediff2=0;
+    DWORD dwSame = m_dwNoteVoices[bChannel][bNote];
+    DWORD dwMask;
     
-    voice1 = voice2 = 255;
+    m_dwVoice1 = m_dwVoice2 = 255;
 
-    // Patch 0-15
-    for (i=0; i<16; i++)
+    // Patch 0-15: voices playing this note are turned off, free ones
+    // are candidates.  Go in voice order, voice_off() advances the timer.
+    dwMask = (~m_dwActiveVoices | dwSame) & 0xFFFF;
+    while (_BitScanForward(&i, dwMask))
     {
-        voiceStruct *voice = &voice_table[i];
-        if (voice->flags1 & VOICEFLAG_SETUP)
+        voiceStruct *voice = &m_Voice[i];
+
+        dwMask &= dwMask - 1;
+        if (dwSame & (1UL << i))
         {
-            if (voice->bChannel == bChannel && voice->bNote == bNote)
-                voice_off(i);
+            voice_off(i);
         }
         else
         {
-            td = gwTimer - voice->wTime;
+            td = m_wTimer - voice->wTime;
             if (td < timediff1)
             {
                 if (td >= timediff2)
                 {
                     timediff2 = td;
-                    voice2 = i;
+                    m_dwVoice2 = i;
                 }
             }
             else
             {
                 timediff2 = timediff1;
-                voice2 = voice1;
+                m_dwVoice2 = m_dwVoice1;
                 timediff1 = td;
-                voice1 = i;
+                m_dwVoice1 = i;
             }
         }
     }
     
     // Patch 16
-    if (voice_table[16].flags1 & VOICEFLAG_SETUP)
+    if (m_Voice[16].flags1 & VOICEFLAG_SETUP)
     {
-        if (voice_table[16].bChannel == bChannel && voice_table[16].bNote == bNote)
+        if (dwSame & (1UL << 16))
             voice_off(16);
     }
     else
     {
-        td = gwTimer - voice_table[16].wTime;
+        td = m_wTimer - m_Voice[16].wTime;
         if (patch1617_allowed_voice1 || td < timediff1)
         {
             if (!patch1617_allowed_voice2 && td >= timediff2)
             {
-                timediff2 = gwTimer - voice_table[16].wTime;
-                voice2 = 16;
+                timediff2 = m_wTimer - m_Voice[16].wTime;
+                m_dwVoice2 = 16;
             }
         }
         else
         {
             timediff2 = timediff1;
-            voice2 = voice1;
+            m_dwVoice2 = m_dwVoice1;
             timediff1 = td;
-            voice1 = 16;
+            m_dwVoice1 = 16;
         }
     }
 
     // Patch 17
-    if (voice_table[17].flags1 & VOICEFLAG_SETUP)
+    if (m_Voice[17].flags1 & VOICEFLAG_SETUP)
     {
-        if (voice_table[17].bChannel == bChannel && voice_table[17].bNote == bNote)
+        if (dwSame & (1UL << 17))
             voice_off(17);
     }
     else
     {
-        td = gwTimer - voice_table[17].wTime;
+        td = m_wTimer - m_Voice[17].wTime;
         if (patch1617_allowed_voice1 || td < timediff1)
         {
             if (!patch1617_allowed_voice2 && td >= timediff2)
-                voice2 = 17;
+                m_dwVoice2 = 17;
         }
         else
         {
-            if (voice1 != 16 || !patch1617_allowed_voice2)
-                voice2 = voice1;
-            voice1 = 17;
+            if (m_dwVoice1 != 16 || !patch1617_allowed_voice2)
+                m_dwVoice2 = m_dwVoice1;
+            m_dwVoice1 = 17;
         }
     }
 }
 
-int steal_voice(int patch1617_allowed)
+/*
+ * steal_voice - turn off the voice that hurts least and return it.
+ * That is the oldest voice of the highest steal level, which is the
+ * channel's rank, plus STEAL_RANKS for second voices if they are
+ * demoted.  Voices 16 and 17 only if the patch can use them.
+ */
+int CEsfmEngine::steal_voice(int patch1617_allowed)
 {
-    UINT i, last_voice=0, max_voices = (patch1617_allowed?18:16);
-    BYTE chn, chncmp = 0, bit3 = 0;
-	USHORT timediff = 0;
-    
-    for (i=0; i<max_voices; i++)
+    DWORD dwLevels = m_dwStealLevels;
+    ULONG ulLevel;
+    BYTE bVoice;
+
+    while (_BitScanReverse(&ulLevel, dwLevels))
     {
-        chn = voice_table[i].bChannel == 9?1:voice_table[i].bChannel+2;
-        if (bit3 == (voice_table[i].flags1 & VOICEFLAG_2NDVOICE))
+        dwLevels &= ~(1UL << ulLevel);
+        for (bVoice = m_StealList[ulLevel].bHead; bVoice != VOICE_NIL; bVoice = m_StealLink[bVoice].bNext)
         {
-            if (chn <= chncmp)
-            {
-                if (chn != chncmp || (gwTimer - voice_table[i].wTime) <= timediff)
-                    continue;
-            }
-            else
+            if (patch1617_allowed || bVoice < 16)
             {
-                chncmp = chn;
+                voice_off(bVoice);
+                return bVoice;
             }
         }
-        else if (!bit3)
-        {
-            bit3 = 8;
-            chncmp = chn;
-        }
-        else continue;
-        
-        timediff = gwTimer - voice_table[i].wTime;
-        last_voice = i;
     }
-    voice_off(last_voice);
-    return last_voice;
+    voice_off(0);
+    return 0;
+}
+
+/*
+ * steal_touch - move a voice to the tail of its steal list after its
+ * time, channel or flags have changed.
+ */
+void CEsfmEngine::steal_touch(int voiceNr)
+{
+    BYTE bVoice = (BYTE)voiceNr, bLevel, bBefore = VOICE_NIL, bPrev;
+
+    VoiceList_Remove(&m_StealList[m_bStealLevel[bVoice]], m_StealLink, bVoice);
+    if (m_StealList[m_bStealLevel[bVoice]].bHead == VOICE_NIL)
+        m_dwStealLevels &= ~(1UL << m_bStealLevel[bVoice]);
+
+    bLevel = m_bStealRank[m_Voice[bVoice].bChannel];
+    if (m_fDemote2nd && (m_Voice[bVoice].flags1 & VOICEFLAG_2NDVOICE))
+        bLevel += STEAL_RANKS;
+
+    // voices of the same age stay in voice order
+    bPrev = m_StealList[bLevel].bTail;
+    while (bPrev != VOICE_NIL && bPrev > bVoice && m_Voice[bPrev].wTime == m_Voice[bVoice].wTime)
+    {
+        bBefore = bPrev;
+        bPrev = m_StealLink[bPrev].bPrev;
+    }
+    VoiceList_Insert(&m_StealList[bLevel], m_StealLink, bVoice, bBefore);
+    m_bStealLevel[bVoice] = bLevel;
+    m_dwStealLevels |= 1UL << bLevel;
 }
 
-void  setup_operator(
-        int offset,
+/*
+ * steal_rebuild - sort all voices into the steal lists from scratch,
+ * after a reset or when the steal order has been changed.
+ */
+void CEsfmEngine::steal_rebuild()
+{
+    BYTE bOrder[NUM2VOICES], bLevel;
+    USHORT age;
+    int i, j;
+
+    // oldest first, voices of the same age in voice order
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        age = m_wTimer - m_Voice[i].wTime;
+        for (j = i; j > 0 && (USHORT)(m_wTimer - m_Voice[bOrder[j - 1]].wTime) < age; j--)
+            bOrder[j] = bOrder[j - 1];
+        bOrder[j] = (BYTE)i;
+    }
+
+    for (i = 0; i < STEAL_LEVELS; i++)
+        VoiceList_Init(&m_StealList[i]);
+    m_dwStealLevels = 0;
+
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        bLevel = m_bStealRank[m_Voice[bOrder[i]].bChannel];
+        if (m_fDemote2nd && (m_Voice[bOrder[i]].flags1 & VOICEFLAG_2NDVOICE))
+            bLevel += STEAL_RANKS;
+        VoiceList_Insert(&m_StealList[bLevel], m_StealLink, bOrder[i], VOICE_NIL);
+        m_bStealLevel[bOrder[i]] = bLevel;
+        m_dwStealLevels |= 1UL << bLevel;
+    }
+}
+
+/*
+ * setup_operator - work out the registers of an operator that depend on
+ * the note: attenuation from velocity and volume, FNumber and block from
+ * note and bend, and pan.  pRegs holds the operator's registers 0-7,
+ * copied from the patch template.
+ */
+void CEsfmEngine::setup_operator(
+        int op,
         int bNote,
         int bVelocity,
-        USHORT reg,
+        BYTE *pRegs,
         int fixed_pitch,
         int rel_velocity,
         int bChannel,
@@ -725,17 +1236,14 @@ void  setup_operator(
 {
     int note, transpose, block, notemod12, reg1, detune;
     USHORT fnum_block;
-    BYTE reg4, reg5, reg6, panmask;
+    BYTE panmask;
     
-    panmask = pan_mask[bChannel];
-    fmwrite(reg + 7, 0);
+    panmask = m_bPanMask[bChannel];
     
 	note = bNote;
     if (!fixed_pitch)
     {
-        transpose = ((((gBankMem[offset + 5]) << 2) & 0x7F) | (gBankMem[offset + 4] & 3));
-        if (gBankMem[offset + 5] & 0x10) // signed?
-            transpose |= ~0x7F;
+        transpose = m_pBank->cTranspose[op];
         note += transpose;
     }
     
@@ -746,8 +1254,6 @@ void  setup_operator(
     block = (note - 19) / 12;
     notemod12 = (note - 19) % 12;
     
-    fmwrite(reg + 0, gBankMem[offset]);
-    
     switch ( rel_velocity )
     {
     case 0:
@@ -767,63 +1273,60 @@ void  setup_operator(
             reg1 = (127 - bVelocity) >> 2;
         break;
     }
-    reg1 += (gBankMem[offset + 1] & 0x3F); // Attenuation
+    reg1 += (pRegs[1] & 0x3F); // Attenuation
     if (reg1 > 63) reg1 = 63;
-    reg1 += (gBankMem[offset + 1] & 0xC0); // KSL
-    voice_table[voicenr].reg1[oper] = (BYTE)reg1;
+    reg1 += (pRegs[1] & 0xC0); // KSL
+    m_Voice[voicenr].reg1[oper] = (BYTE)reg1;
     
-    fmwrite(reg + 1, NATV_CalcVolume((BYTE)reg1, (BYTE)rel_velocity, (BYTE)bChannel));
-    fmwrite(reg + 2, gBankMem[offset + 2]);
-    fmwrite(reg + 3, gBankMem[offset + 3]);
+    m_Voice[voicenr].bAtten[oper] = NATV_CalcVolume((BYTE)reg1, (BYTE)rel_velocity, (BYTE)bChannel);
+    pRegs[1] = m_Voice[voicenr].bAtten[oper];
     
-    if ( fixed_pitch )
-    {
-        reg4 = gBankMem[offset + 4];
-        reg5 = gBankMem[offset + 5];
-    }
-    else
+    // fixed pitch operators keep registers 4 and 5 of the template
+    if ( !fixed_pitch )
     {
-        detune = ((int)*((char*)&gBankMem[offset + 4])) & (~3);
+        detune = m_pBank->cDetune[op];
         if (detune)
         {
-            detune = ((detune >> 2) * td_adjust_setup_operator[notemod12]) >> 8;
+            detune = (detune * td_adjust_setup_operator[notemod12]) >> 8;
             if (block > 1)
                 detune >>= block - 1;
         }
         detune += fnum[notemod12];
-        voice_table[voicenr].reg5[oper] = (BYTE)((HIBYTE(detune) & 3) | (gBankMem[offset + 5] & 0xE0) | (block << 2)); // detune | delay | block
-        fnum_block = MidiCalcFAndB(NATV_CalcBend((USHORT)detune, giBend[bChannel], (USHORT)gbChanBendRange[bChannel]), (BYTE)block);
-        reg4 = LOBYTE(fnum_block);
-        reg5 = HIBYTE(fnum_block) | (voice_table[voicenr].reg5[oper] & 0xE0);
-        voice_table[voicenr].detune[oper] = (USHORT)detune;
+        m_Voice[voicenr].reg5[oper] = (BYTE)((HIBYTE(detune) & 3) | (pRegs[5] & 0xE0) | (block << 2)); // detune | delay | block
+        fnum_block = MidiCalcFAndB((SHORT)((detune * MidiChan_BendMult(&m_Chan[bChannel]) + 512) >> 10), (BYTE)block);
+        m_Voice[voicenr].wFnumBlock[oper] = fnum_block;
+        pRegs[4] = LOBYTE(fnum_block);
+        pRegs[5] = HIBYTE(fnum_block) | (m_Voice[voicenr].reg5[oper] & 0xE0);
+        m_Voice[voicenr].detune[oper] = (USHORT)detune;
     }
-    reg6 = gBankMem[offset + 6];
-    if ((reg6 & 0x30) && panmask != 0x30) reg6 = panmask | (reg6 & 0xCF);
-    fmwrite(reg + 4, reg4);
-    fmwrite(reg + 5, reg5);
-    fmwrite(reg + 6, reg6);
-    fmwrite(reg + 7, gBankMem[offset + 7]);
+    if ((pRegs[6] & 0x30) && panmask != 0x30) pRegs[6] = panmask | (pRegs[6] & 0xCF);
 }
 
-void  setup_voice(int voicenr, int offset, int bChannel, int bNote, int bVelocity)
+void CEsfmEngine::setup_voice(int voicenr, int voice, int bChannel, int bNote, int bVelocity)
 {
-    BYTE rel_vel, bPatch;
+    BYTE rel_vel, bPatch, regs[FMBANK_TMPLSIZE];
+    int op;
     
-    bPatch = gBankMem[offset];
-    rel_vel = gBankMem[offset + 3];
-    offset += 4;
-    setup_operator(offset     , bNote, bVelocity, 32 * (USHORT)voicenr + 0 , bPatch & 0x10, (rel_vel >> 0) & 3, bChannel, 0, voicenr);
-    setup_operator(offset + 8 , bNote, bVelocity, 32 * (USHORT)voicenr + 8 , bPatch & 0x20, (rel_vel >> 2) & 3, bChannel, 1, voicenr);
-    setup_operator(offset + 16, bNote, bVelocity, 32 * (USHORT)voicenr + 16, bPatch & 0x40, (rel_vel >> 4) & 3, bChannel, 2, voicenr);
-    setup_operator(offset + 24, bNote, bVelocity, 32 * (USHORT)voicenr + 24, bPatch & 0x80, (rel_vel >> 6) & 3, bChannel, 3, voicenr);
-
-    voice_table[voicenr].bPatch = bPatch;
-    voice_table[voicenr].bVelocity = rel_vel;
-    voice_table[voicenr].wTime = gwTimer;
-    voice_table[voicenr].bNote = (BYTE)bNote;
-    voice_table[voicenr].flags1 = VOICEFLAG_SETUP;
-    voice_table[voicenr].bChannel = (BYTE)bChannel;
+    voice_unlink(voicenr);
+    bPatch = m_pBank->bFlags[voice];
+    rel_vel = m_pBank->bRelVel[voice];
+    op = FMBANK_OP(voice, 0);
+    RtlCopyMemory(regs, m_pBank->bTmpl[voice], sizeof(regs));
+    setup_operator(op    , bNote, bVelocity, &regs[0] , bPatch & 0x10, (rel_vel >> 0) & 3, bChannel, 0, voicenr);
+    setup_operator(op + 1, bNote, bVelocity, &regs[8] , bPatch & 0x20, (rel_vel >> 2) & 3, bChannel, 1, voicenr);
+    setup_operator(op + 2, bNote, bVelocity, &regs[16], bPatch & 0x40, (rel_vel >> 4) & 3, bChannel, 2, voicenr);
+    setup_operator(op + 3, bNote, bVelocity, &regs[24], bPatch & 0x80, (rel_vel >> 6) & 3, bChannel, 3, voicenr);
+    fmtemplate((WORD)(32 * voicenr), regs);
+
+    m_Voice[voicenr].bPatch = bPatch;
+    m_Voice[voicenr].bVelocity = rel_vel;
+    m_Voice[voicenr].wTime = m_wTimer;
+    m_Voice[voicenr].bNote = (BYTE)bNote;
+    m_Voice[voicenr].flags1 = VOICEFLAG_SETUP;
+    m_Voice[voicenr].bChannel = (BYTE)bChannel;
+    voice_link(voicenr);
+    steal_touch(voicenr);
     
-    gwTimer++;
+    m_wTimer++;
 }
 
@@ -33,9 +33,6 @@
 #define SUCCEEDS(s) (s)
 #endif
 
-DEFINE_GUID(CLSID_MiniportDriverESFMSynth,
-0x7EAEB839, 0xFF5F, 0x11D0, 0xA5, 0x10, 0x00, 0x60, 0x97, 0xC7, 0x9D, 0x21);
-
 DEFINE_GUID(CLSID_MiniportDriverUartESS,
 0xF6A7ED80, 0xE68E, 0x11D1, 0x9B, 0x4B, 0x00, 0xC0, 0x9F, 0x00, 0x3C, 0x24);
 
@@ -1126,20 +1123,36 @@ StartDevice
             if (NT_SUCCESS(ntStatus))
             {
                 //
-                // Failure here is not fatal.
+                // Failure here is not fatal.  PortDMus gives the synth
+                // timestamped DirectMusic events and takes plain MIDI
+                // too, PortMidi is there for systems without it.
                 //
-                InstallSubdevice( DeviceObject,
-                                  Irp,
-                                  L"FMSynth",
-                                  CLSID_PortMidi,
-                                  CLSID_MiniportDriverESFMSynth,
-                                  CreateMiniportMidiESFM,
-                                  pAdapterCommon,
-                                  resourceListFmSynth,
-                                  GUID_NULL,
-                                  NULL,
-                                  &unknownFmSynth,
-                                  &unknownMiniportFmSynth);
+                if (!NT_SUCCESS(InstallSubdevice( DeviceObject,
+                                                  Irp,
+                                                  L"FMSynth",
+                                                  CLSID_PortDMus,
+                                                  CLSID_MiniportDriverESFMSynth,
+                                                  CreateMiniportMidiESFM,
+                                                  pAdapterCommon,
+                                                  resourceListFmSynth,
+                                                  GUID_NULL,
+                                                  NULL,
+                                                  &unknownFmSynth,
+                                                  &unknownMiniportFmSynth)))
+                {
+                    InstallSubdevice( DeviceObject,
+                                      Irp,
+                                      L"FMSynth",
+                                      CLSID_PortMidi,
+                                      CLSID_MiniportDriverESFMSynth,
+                                      CreateMiniportMidiESFM,
+                                      pAdapterCommon,
+                                      resourceListFmSynth,
+                                      GUID_NULL,
+                                      NULL,
+                                      &unknownFmSynth,
+                                      &unknownMiniportFmSynth);
+                }
             }
 
             // release the FM synth resource list
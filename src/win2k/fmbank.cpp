@@ -0,0 +1,508 @@
+/*****************************************************************************
+ * fmbank.cpp - ESFM patch bank loader
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ */
+
+#include "common.h"
+#include "driver.h"
+#include "fmbank.h"
+
+#define STR_MODULENAME "fmbank: "
+
+/*
+ * FmBank_Hash - hash of the bytes of a voice that are decoded, bytes 1
+ * and 2 of the header are not used.
+ */
+static DWORD FmBank_Hash(const BYTE *pVoice)
+{
+    DWORD dwHash = 2166136261UL;
+    int i;
+
+    dwHash = (dwHash ^ pVoice[0]) * 16777619UL;
+    for (i = 3; i < FMBANK_VOICESIZE; i++)
+        dwHash = (dwHash ^ pVoice[i]) * 16777619UL;
+    return dwHash;
+}
+
+/*
+ * FmBank_DecodeVoice - decode the FMBANK_VOICESIZE bytes of a voice into
+ * a pool voice.
+ */
+static VOID FmBank_DecodeVoice(FMBANK *pBank, int iVoice, const BYTE *pVoice)
+{
+    const BYTE *pOp;
+    int op, i, transpose;
+
+    pBank->bFlags[iVoice] = pVoice[0];
+    pBank->bRelVel[iVoice] = pVoice[3];
+    RtlCopyMemory(pBank->bTmpl[iVoice], pVoice + 4, FMBANK_TMPLSIZE);
+    for (op = 0; op < OPS_PER_CHAN; op++)
+    {
+        pOp = pVoice + 4 + 8 * op;
+        i = FMBANK_OP(iVoice, op);
+
+        // transpose, bits 0-1 from reg 4, bits 2-6 from reg 5, which
+        // also has the sign in bit 4
+        transpose = ((pOp[5] << 2) & 0x7F) | (pOp[4] & 3);
+        if (pOp[5] & 0x10)
+            transpose |= ~0x7F;
+        pBank->cTranspose[i] = (signed char)transpose;
+        pBank->cDetune[i] = (signed char)((signed char)pOp[4] >> 2);
+    }
+}
+
+/*
+ * FmBank_AddVoice - find the voice in the pool, or put it into a free
+ * pool voice, and take a reference on it.
+ *
+ * returns the pool voice, FMBANK_NOVOICE if the pool is full
+ */
+static WORD FmBank_AddVoice(FMBANK *pBank, const BYTE *pVoice)
+{
+    DWORD dwHash = FmBank_Hash(pVoice);
+    int i, iFree = FMBANK_NOVOICE;
+
+    for (i = 0; i < FMBANK_VOICES; i++)
+    {
+        if (!pBank->wRefs[i])
+        {
+            if (iFree == FMBANK_NOVOICE)
+                iFree = i;
+            continue;
+        }
+        if (pBank->dwHash[i] == dwHash &&
+            pBank->bFlags[i] == pVoice[0] && pBank->bRelVel[i] == pVoice[3] &&
+            RtlCompareMemory(pBank->bTmpl[i], pVoice + 4, FMBANK_TMPLSIZE) == FMBANK_TMPLSIZE)
+        {
+            pBank->wRefs[i]++;
+            return (WORD)i;
+        }
+    }
+
+    if (iFree == FMBANK_NOVOICE)
+        return FMBANK_NOVOICE;
+    FmBank_DecodeVoice(pBank, iFree, pVoice);
+    pBank->dwHash[iFree] = dwHash;
+    pBank->wRefs[iFree] = 1;
+    pBank->ulVoices++;
+    return (WORD)iFree;
+}
+
+/*
+ * FmBank_ReleaseVoice - drop a reference taken by FmBank_AddVoice().
+ */
+static VOID FmBank_ReleaseVoice(FMBANK *pBank, WORD wVoice)
+{
+    if (wVoice != FMBANK_NOVOICE && !--pBank->wRefs[wVoice])
+        pBank->ulVoices--;
+}
+
+/*
+ * FmBank_ReleaseMap - drop the references of all patches of a bank.
+ */
+static VOID FmBank_ReleaseMap(FMBANK *pBank, FMBANKMAP *pMap)
+{
+    int patch;
+
+    for (patch = 0; patch < NUMPATCHES; patch++)
+    {
+        FmBank_ReleaseVoice(pBank, pMap->wVoice[patch][0]);
+        FmBank_ReleaseVoice(pBank, pMap->wVoice[patch][1]);
+    }
+}
+
+/*
+ * FmBank_Index - index into pMap[] of a bank select number, -1 if
+ * there is no such bank.
+ */
+static int FmBank_Index(FMBANK *pBank, WORD wNumber)
+{
+    int iBank;
+
+    for (iBank = 0; iBank < (int)pBank->ulBanks; iBank++)
+        if (pBank->pMap[iBank]->wNumber == wNumber)
+            return iBank;
+    return -1;
+}
+
+/*
+ * FmBank_NewMap - allocate a bank without patches.
+ *
+ * returns NULL if there is no room for another bank
+ */
+static FMBANKMAP *FmBank_NewMap(FMBANK *pBank, WORD wNumber)
+{
+    FMBANKMAP *pMap;
+
+    if (pBank->ulBanks == FMBANK_MAXBANKS && FmBank_Index(pBank, wNumber) < 0)
+        return NULL;
+
+    pMap = (FMBANKMAP *)ExAllocatePool(NonPagedPool, sizeof(FMBANKMAP));
+    if (!pMap)
+        return NULL;
+    RtlZeroMemory(pMap, sizeof(*pMap));
+    pMap->wNumber = wNumber;
+    RtlFillMemory(pMap->bMode, sizeof(pMap->bMode), FMBANK_EMPTY);
+    RtlFillMemory(pMap->wVoice, sizeof(pMap->wVoice), 0xFF);
+    return pMap;
+}
+
+/*
+ * FmBank_AddMap - add a bank, or replace the bank with the same number.
+ */
+static VOID FmBank_AddMap(FMBANK *pBank, FMBANKMAP *pMap)
+{
+    FMBANKMAP *pOld;
+    int iBank = FmBank_Index(pBank, pMap->wNumber);
+
+    // the new bank has its references, so voices it shares with the
+    // one it replaces stay in the pool
+    if (iBank < 0)
+        pBank->pMap[pBank->ulBanks++] = pMap;
+    else
+    {
+        pOld = pBank->pMap[iBank];
+        pBank->pMap[iBank] = pMap;
+        FmBank_ReleaseMap(pBank, pOld);
+        ExFreePool(pOld);
+    }
+}
+
+/*
+ * FmBank_Init - empty pool, no banks.  pfnWant is called when a lazy
+ * patch is wanted, to get FmBank_Fetch() called.
+ */
+VOID FmBank_Init(FMBANK *pBank, PFNFMBANKWANT pfnWant, PVOID pContext)
+{
+    RtlZeroMemory(pBank, sizeof(*pBank));
+    KeInitializeSpinLock(&pBank->Lock);
+    pBank->pfnWant = pfnWant;
+    pBank->pWantContext = pContext;
+}
+
+/*
+ * FmBank_Free - free all banks.
+ */
+VOID FmBank_Free(FMBANK *pBank)
+{
+    ULONG i;
+
+    for (i = 0; i < pBank->ulBanks; i++)
+    {
+        FmBank_ReleaseMap(pBank, pBank->pMap[i]);
+        ExFreePool(pBank->pMap[i]);
+        pBank->pMap[i] = NULL;
+    }
+    pBank->ulBanks = 0;
+}
+
+/*
+ * FmBank_Load - check and decode a bank, and add it under a bank select
+ * number.  A bank already there with that number is replaced.  Patches
+ * whose offset is 0 or points outside of the data are left out, as are
+ * patches that do not fit into the pool any more.  Banks are only
+ * loaded or attached before an engine uses them.
+ *
+ * returns the number of patches loaded, 0 if the bank was not added
+ */
+ULONG FmBank_Load(FMBANK *pBank, WORD wNumber, const BYTE *pData, ULONG ulSize)
+{
+    FMBANKMAP *pMap;
+    ULONG patch, offset, voices, loaded = 0;
+
+    pMap = FmBank_NewMap(pBank, wNumber);
+    if (!pMap)
+        return 0;
+
+    for (patch = 0; ulSize >= 2 * NUMPATCHES && patch < NUMPATCHES; patch++)
+    {
+        offset = pData[2 * patch] + ((ULONG)pData[2 * patch + 1] << 8);
+        if (!offset)
+            continue;
+
+        voices = 1;
+        if (offset >= 2 * NUMPATCHES && offset + FMBANK_VOICESIZE <= ulSize &&
+            ((pData[offset] >> 1) & 3))
+            voices = 2;
+        if (offset < 2 * NUMPATCHES || offset + voices * FMBANK_VOICESIZE > ulSize)
+        {
+            _DbgPrintF(DEBUGLVL_TERSE, ("Patch %d at %d is outside of the bank", patch, offset));
+            continue;
+        }
+
+        pMap->wVoice[patch][0] = FmBank_AddVoice(pBank, pData + offset);
+        if (voices > 1)
+            pMap->wVoice[patch][1] = FmBank_AddVoice(pBank, pData + offset + FMBANK_VOICESIZE);
+        if (pMap->wVoice[patch][0] == FMBANK_NOVOICE ||
+            (voices > 1 && pMap->wVoice[patch][1] == FMBANK_NOVOICE))
+        {
+            _DbgPrintF(DEBUGLVL_TERSE, ("Patch %d does not fit into the pool", patch));
+            FmBank_ReleaseVoice(pBank, pMap->wVoice[patch][0]);
+            FmBank_ReleaseVoice(pBank, pMap->wVoice[patch][1]);
+            pMap->wVoice[patch][0] = pMap->wVoice[patch][1] = FMBANK_NOVOICE;
+            continue;
+        }
+
+        pMap->bMode[patch] = (pData[offset] >> 1) & 3;
+        loaded++;
+    }
+
+    if (!loaded)
+    {
+        ExFreePool(pMap);
+        return 0;
+    }
+
+    FmBank_AddMap(pBank, pMap);
+    return loaded;
+}
+
+/*
+ * FmBank_Attach - like FmBank_Load(), but only the offset table is read
+ * now, the patches are decoded by FmBank_Fetch() once they are wanted.
+ * pData has to stay valid until FmBank_Free().
+ *
+ * returns the number of patches found, 0 if the bank was not added
+ */
+ULONG FmBank_Attach(FMBANK *pBank, WORD wNumber, const BYTE *pData, ULONG ulSize)
+{
+    FMBANKMAP *pMap;
+    ULONG patch, offset, found = 0;
+
+    if (ulSize < 2 * NUMPATCHES)
+        return 0;
+    pMap = FmBank_NewMap(pBank, wNumber);
+    if (!pMap)
+        return 0;
+    pMap->pData = pData;
+    pMap->ulSize = ulSize;
+
+    for (patch = 0; patch < NUMPATCHES; patch++)
+    {
+        offset = pData[2 * patch] + ((ULONG)pData[2 * patch + 1] << 8);
+        if (!offset)
+            continue;
+        if (offset < 2 * NUMPATCHES || offset + FMBANK_VOICESIZE > ulSize)
+        {
+            _DbgPrintF(DEBUGLVL_TERSE, ("Patch %d at %d is outside of the bank", patch, offset));
+            continue;
+        }
+        pMap->bMode[patch] = FMBANK_LAZY;
+        found++;
+    }
+
+    if (!found)
+    {
+        ExFreePool(pMap);
+        return 0;
+    }
+
+    FmBank_AddMap(pBank, pMap);
+    return found;
+}
+
+/*
+ * FmBank_Want - ask for a FMBANK_LAZY patch to be decoded.  Any IRQL up
+ * to DISPATCH_LEVEL.
+ */
+VOID FmBank_Want(FMBANK *pBank, FMBANKMAP *pMap, int patch)
+{
+    LONG lBit = 1L << (patch % 32);
+
+    if (InterlockedOr(&pMap->lWanted[patch / 32], lBit) & lBit)
+        return;
+    if (!InterlockedExchange(&pBank->lWanted, 1) && pBank->pfnWant)
+        pBank->pfnWant(pBank->pWantContext);
+}
+
+/*
+ * FmBank_Fetch - decode the patches asked for with FmBank_Want().
+ * PASSIVE_LEVEL, the bank file views may be paged.  A patch that turns
+ * out to be broken, or does not fit into the pool, becomes FMBANK_EMPTY.
+ * A second voice uploaded before the patch was decoded is kept.
+ *
+ * returns the number of patches decoded
+ */
+ULONG FmBank_Fetch(FMBANK *pBank)
+{
+    BYTE bPatch[2 * FMBANK_VOICESIZE];
+    FMBANKMAP *pMap;
+    ULONG i, w, bit, patch, offset, voices, fetched = 0;
+    LONG lBits;
+    WORD wVoice[2];
+    BYTE bMode;
+    BOOL fUploaded;
+    KIRQL OldIrql;
+
+    InterlockedExchange(&pBank->lWanted, 0);
+    for (i = 0; i < pBank->ulBanks; i++)
+    {
+        pMap = pBank->pMap[i];
+        for (w = 0; w < NUMPATCHES / 32; w++)
+        {
+            lBits = InterlockedExchange(&pMap->lWanted[w], 0);
+            while (_BitScanForward(&bit, (ULONG)lBits))
+            {
+                lBits &= lBits - 1;
+                patch = w * 32 + bit;
+                if (pMap->bMode[patch] != FMBANK_LAZY)
+                    continue;
+
+                // copy the patch out of the view before taking the lock
+                offset = pMap->pData[2 * patch] + ((ULONG)pMap->pData[2 * patch + 1] << 8);
+                voices = (pMap->pData[offset] >> 1) & 3 ? 2 : 1;
+                bMode = FMBANK_EMPTY;
+                if (offset + voices * FMBANK_VOICESIZE <= pMap->ulSize)
+                {
+                    RtlCopyMemory(bPatch, pMap->pData + offset, voices * FMBANK_VOICESIZE);
+                    bMode = (bPatch[0] >> 1) & 3;
+                }
+
+                KeAcquireSpinLock(&pBank->Lock, &OldIrql);
+                // an upload may have replaced the patch meanwhile
+                if (pMap->bMode[patch] == FMBANK_LAZY)
+                {
+                    wVoice[0] = FMBANK_NOVOICE;
+                    wVoice[1] = pMap->wVoice[patch][1];
+                    fUploaded = wVoice[1] != FMBANK_NOVOICE;
+                    if (bMode != FMBANK_EMPTY)
+                    {
+                        wVoice[0] = FmBank_AddVoice(pBank, bPatch);
+                        if (voices > 1 && !fUploaded)
+                            wVoice[1] = FmBank_AddVoice(pBank, bPatch + FMBANK_VOICESIZE);
+                        if (wVoice[0] == FMBANK_NOVOICE || (voices > 1 && wVoice[1] == FMBANK_NOVOICE))
+                        {
+                            FmBank_ReleaseVoice(pBank, wVoice[0]);
+                            if (!fUploaded)
+                            {
+                                FmBank_ReleaseVoice(pBank, wVoice[1]);
+                                wVoice[1] = FMBANK_NOVOICE;
+                            }
+                            wVoice[0] = FMBANK_NOVOICE;
+                            bMode = FMBANK_EMPTY;
+                        }
+                    }
+                    pMap->wVoice[patch][0] = wVoice[0];
+                    pMap->wVoice[patch][1] = wVoice[1];
+                    KeMemoryBarrier();
+                    pMap->bMode[patch] = bMode;
+                    if (bMode != FMBANK_EMPTY)
+                        fetched++;
+                }
+                KeReleaseSpinLock(&pBank->Lock, OldIrql);
+                if (bMode == FMBANK_EMPTY)
+                    _DbgPrintF(DEBUGLVL_TERSE, ("Patch %d of bank %d cannot be decoded", patch, pMap->wNumber));
+            }
+        }
+    }
+    return fetched;
+}
+
+/*
+ * FmBank_Find - look up a bank by its bank select number.
+ *
+ * returns the index into pMap[], 0 (the default bank) if there is none
+ */
+int FmBank_Find(FMBANK *pBank, WORD wNumber)
+{
+    int iBank = FmBank_Index(pBank, wNumber);
+
+    return iBank < 0 ? 0 : iBank;
+}
+
+/*
+ * FmBank_SetVoice - replace one voice of a patch.  Voice 0 also sets the
+ * number of voices of the patch; a second voice that was never set
+ * starts out as a copy of the first.  Other banks with the same voice
+ * are not affected.  A FMBANK_LAZY patch stays lazy until its first
+ * voice is set, a second voice set before that is kept by
+ * FmBank_Fetch() when it decodes the rest of the patch.
+ *
+ * returns FALSE if the pool is full
+ */
+BOOL FmBank_SetVoice(FMBANK *pBank, int iBank, int patch, int voice, const BYTE *pVoice)
+{
+    FMBANKMAP *pMap = pBank->pMap[iBank];
+    WORD wVoice;
+    BOOL fFetch;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&pBank->Lock, &OldIrql);
+    wVoice = FmBank_AddVoice(pBank, pVoice);
+    if (wVoice == FMBANK_NOVOICE)
+    {
+        KeReleaseSpinLock(&pBank->Lock, OldIrql);
+        return FALSE;
+    }
+    FmBank_ReleaseVoice(pBank, pMap->wVoice[patch][voice]);
+    pMap->wVoice[patch][voice] = wVoice;
+
+    // the first voice of the bank file is still needed
+    fFetch = voice && pMap->bMode[patch] == FMBANK_LAZY;
+    if (!voice)
+    {
+        if (((pVoice[0] >> 1) & 3) && pMap->wVoice[patch][1] == FMBANK_NOVOICE)
+        {
+            pBank->wRefs[wVoice]++;
+            pMap->wVoice[patch][1] = wVoice;
+        }
+        KeMemoryBarrier();
+        pMap->bMode[patch] = (pVoice[0] >> 1) & 3;
+    }
+    KeReleaseSpinLock(&pBank->Lock, OldIrql);
+    if (fFetch)
+        FmBank_Want(pBank, pMap, patch);
+    return TRUE;
+}
+
+/*
+ * FmBank_Query - memory use of a bank.  A pool voice counts for the
+ * first bank that uses it, later banks only share it.
+ *
+ * returns FALSE if there is no such bank
+ */
+BOOL FmBank_Query(FMBANK *pBank, int iBank, FMBANKINFO *pInfo)
+{
+    DWORD dwEarlier[FMBANK_VOICES / 32], dwSeen[FMBANK_VOICES / 32];
+    FMBANKMAP *pMap;
+    WORD wVoice;
+    int i, patch, voice;
+
+    if (iBank < 0 || (ULONG)iBank >= pBank->ulBanks)
+        return FALSE;
+
+    RtlZeroMemory(dwEarlier, sizeof(dwEarlier));
+    RtlZeroMemory(dwSeen, sizeof(dwSeen));
+    for (i = 0; i < iBank; i++)
+    {
+        pMap = pBank->pMap[i];
+        for (patch = 0; patch < NUMPATCHES; patch++)
+            for (voice = 0; voice < 2; voice++)
+                if ((wVoice = pMap->wVoice[patch][voice]) != FMBANK_NOVOICE)
+                    dwEarlier[wVoice / 32] |= 1UL << (wVoice % 32);
+    }
+
+    pMap = pBank->pMap[iBank];
+    RtlZeroMemory(pInfo, sizeof(*pInfo));
+    pInfo->wNumber = pMap->wNumber;
+    for (patch = 0; patch < NUMPATCHES; patch++)
+    {
+        if (pMap->bMode[patch] != FMBANK_EMPTY)
+            pInfo->ulPatches++;
+        if (pMap->bMode[patch] == FMBANK_LAZY)
+            pInfo->ulLazy++;
+        for (voice = 0; voice < 2; voice++)
+        {
+            wVoice = pMap->wVoice[patch][voice];
+            if (wVoice == FMBANK_NOVOICE || (dwSeen[wVoice / 32] & (1UL << (wVoice % 32))))
+                continue;
+            dwSeen[wVoice / 32] |= 1UL << (wVoice % 32);
+            pInfo->ulVoices++;
+            if (dwEarlier[wVoice / 32] & (1UL << (wVoice % 32)))
+                pInfo->ulShared++;
+        }
+    }
+    pInfo->ulBytes = sizeof(FMBANKMAP) + (pInfo->ulVoices - pInfo->ulShared) * FMBANK_VOICEBYTES;
+    return TRUE;
+}
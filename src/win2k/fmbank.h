@@ -0,0 +1,110 @@
+/*****************************************************************************
+ * fmbank.h - decoded ESFM patch banks
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * A bank file starts with a table of NUMPATCHES little endian offsets,
+ * 0 for no patch.  A patch is one or two voices of FMBANK_VOICESIZE
+ * bytes each: a 4 byte header and 8 register bytes per operator.  Banks
+ * are checked and taken apart once, so a note on only has to index the
+ * FMBANK tables.  The registers of a voice are kept as a template in the
+ * order they are written; a note on copies it and fills in attenuation,
+ * FNumber/block and pan.
+ *
+ * Several banks can be loaded, each under a MIDI bank select number.
+ * Their voices go into one pool of FMBANK_VOICES, a voice that is in
+ * more than one bank (or more than once in a bank) is only stored once.
+ * A bank itself is just a FMBANKMAP from patch to pool voices.
+ *
+ * A bank can also be attached lazily, from a view of the bank file that
+ * may be paged.  Only the offset table is read then; its patches stay
+ * FMBANK_LAZY until a note on or program change asks for them with
+ * FmBank_Want(), which can be done at DISPATCH_LEVEL.  FmBank_Fetch()
+ * then decodes them at PASSIVE_LEVEL, on whatever thread pfnWant gets
+ * it called on.  The loader only needs the view and its size, so it
+ * works the same on a file mapped in user mode.
+ */
+
+#ifndef _FMBANK_H_
+#define _FMBANK_H_
+
+#define FMBANK_VOICESIZE        (36)
+#define FMBANK_VOICES           (512)                   /* voices in the pool */
+#define FMBANK_OPS              (FMBANK_VOICES * OPS_PER_CHAN)
+#define FMBANK_TMPLSIZE         (OPS_PER_CHAN * 8)      /* registers 0-7 of each operator */
+#define FMBANK_VOICEBYTES       (FMBANK_TMPLSIZE + 2 * OPS_PER_CHAN + 8)    /* pool bytes per voice */
+#define FMBANK_MAXBANKS         (16)
+#define FMBANK_MAXSIZE          (0x10000 + 2 * FMBANK_VOICESIZE)    /* largest bank file */
+#define FMBANK_EMPTY            (0xFF)          /* bMode of a patch not in the bank */
+#define FMBANK_LAZY             (0xFE)          /* bMode of a patch not decoded yet */
+#define FMBANK_NOVOICE          (0xFFFF)
+
+/* bank select number from CC0 (MSB) and CC32 (LSB) */
+#define FMBANK_NUMBER(msb, lsb)         ((WORD)(((msb) << 7) | (lsb)))
+
+/* index of an operator of a pool voice */
+#define FMBANK_OP(voice, op)            ((voice) * OPS_PER_CHAN + (op))
+
+/* bMode of a patch for the note on path, FmBank_Fetch() may be filling
+   it in; wVoice[] is valid once this is below FMBANK_LAZY */
+#define FMBANK_MODE(pMap, patch)        (*(volatile BYTE *)&(pMap)->bMode[patch])
+
+/* called once there are patches to fetch, see FmBank_Want() */
+typedef VOID (*PFNFMBANKWANT)(PVOID pContext);
+
+typedef struct _FMBANKMAP {
+        WORD    wNumber;                /* see FMBANK_NUMBER() */
+        /* per patch */
+        BYTE    bMode[NUMPATCHES];      /* 0 one voice, 1 second voice if free,
+                                           2 two voices, FMBANK_EMPTY */
+        WORD    wVoice[NUMPATCHES][2];  /* pool voices, FMBANK_NOVOICE */
+        /* attached bank file, for FMBANK_LAZY patches */
+        const BYTE *pData;
+        ULONG   ulSize;
+        LONG    lWanted[NUMPATCHES / 32];       /* bit per patch asked for */
+} FMBANKMAP;
+
+typedef struct _FMBANK {
+        /* per pool voice */
+        BYTE    bFlags[FMBANK_VOICES];  /* bit 0 may use voices 16/17, bits 1-2 mode,
+                                           bits 4-7 fixed pitch operators */
+        BYTE    bRelVel[FMBANK_VOICES]; /* velocity mode, 2 bits per operator */
+        BYTE    bTmpl[FMBANK_VOICES][FMBANK_TMPLSIZE];  /* register 4 and 5 are only
+                                           used for fixed pitch, else bits 5-7 of 5 */
+        WORD    wRefs[FMBANK_VOICES];   /* patches using the voice, 0 if free */
+        DWORD   dwHash[FMBANK_VOICES];
+        /* per operator, see FMBANK_OP() */
+        signed char cTranspose[FMBANK_OPS];     /* semitones */
+        signed char cDetune[FMBANK_OPS];
+
+        ULONG       ulVoices;                   /* pool voices in use */
+        ULONG       ulBanks;
+        FMBANKMAP * pMap[FMBANK_MAXBANKS];      /* NonPagedPool, pMap[0] is the default */
+
+        KSPIN_LOCK  Lock;                       /* pool and maps, against FmBank_Fetch() */
+        LONG        lWanted;                    /* some map has patches asked for */
+        PFNFMBANKWANT pfnWant;
+        PVOID       pWantContext;
+} FMBANK;
+
+/* memory use of a bank, see FmBank_Query() */
+typedef struct _FMBANKINFO {
+        WORD    wNumber;
+        ULONG   ulPatches;
+        ULONG   ulLazy;                 /* of these, patches not decoded yet */
+        ULONG   ulVoices;               /* pool voices used by the bank */
+        ULONG   ulShared;               /* of these, voices an earlier bank brought in */
+        ULONG   ulBytes;                /* the map and the voices not shared */
+} FMBANKINFO;
+
+VOID  FmBank_Init(FMBANK *pBank, PFNFMBANKWANT pfnWant, PVOID pContext);
+VOID  FmBank_Free(FMBANK *pBank);
+ULONG FmBank_Load(FMBANK *pBank, WORD wNumber, const BYTE *pData, ULONG ulSize);
+ULONG FmBank_Attach(FMBANK *pBank, WORD wNumber, const BYTE *pData, ULONG ulSize);
+VOID  FmBank_Want(FMBANK *pBank, FMBANKMAP *pMap, int patch);
+ULONG FmBank_Fetch(FMBANK *pBank);
+int   FmBank_Find(FMBANK *pBank, WORD wNumber);
+BOOL  FmBank_SetVoice(FMBANK *pBank, int iBank, int patch, int voice, const BYTE *pVoice);
+BOOL  FmBank_Query(FMBANK *pBank, int iBank, FMBANKINFO *pInfo);
+
+#endif
@@ -0,0 +1,93 @@
+/*****************************************************************************
+ * fmpace.h - FM chip access pacing
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * The FM chips need some time after each port write before they take
+ * the next one.  Instead of stalling for that time after every write,
+ * remember when the chip will be ready and only wait for what is left
+ * of it right before the next access.  Whatever the driver does in
+ * between (calculating the next note, volume, ...) runs while the chip
+ * settles.
+ *
+ * Reading the performance counter is a port access of its own where it
+ * is the ACPI PM timer or HPET, so it is read once per write only: the
+ * settle time of a write starts from what FmPace_Wait() read, plus what
+ * it stalled and FM_PACE_PORT for the write itself.
+ */
+
+#ifndef _FMPACE_H_
+#define _FMPACE_H_
+
+/* settle time after a port write, per backend */
+#define FM_ESFM_DELAY   (10)    /* ESFM in native mode */
+#define FM_OPL_DELAY    (23)    /* OPL2/OPL3 compatible, old OPL2 chips need that */
+#define FM_PACE_PORT    (1)     /* microseconds a port write may take */
+
+typedef struct _FMPACE {
+        LONGLONG        llFrequency;    /* performance counter ticks per second */
+        LONGLONG        llDelay;        /* settle time in ticks */
+        LONGLONG        llReady;        /* tick the chip takes the next access, 0 = now */
+        LONGLONG        llNow;          /* tick FmPace_Wait() returned */
+        ULONG           ulDelayUs;
+        DWORD           dwStallUs;      /* microseconds actually waited */
+        DWORD           dwSavedUs;      /* settle time that passed without waiting */
+} FMPACE;
+
+/*
+ * FmPace_Init - set up pacing for a chip needing ulDelayUs after a write.
+ */
+__inline VOID FmPace_Init(FMPACE *pPace, ULONG ulDelayUs)
+{
+    LARGE_INTEGER Frequency;
+
+    KeQueryPerformanceCounter(&Frequency);
+    pPace->llFrequency = Frequency.QuadPart;
+    pPace->llDelay = (Frequency.QuadPart * (ulDelayUs + FM_PACE_PORT) + 999999) / 1000000;
+    pPace->llReady = 0;
+    pPace->llNow = 0;
+    pPace->ulDelayUs = ulDelayUs;
+    pPace->dwStallUs = 0;
+    pPace->dwSavedUs = 0;
+}
+
+/*
+ * FmPace_Wait - call before accessing the chip, waits until the
+ * previous write has settled.
+ */
+__inline VOID FmPace_Wait(FMPACE *pPace)
+{
+    LONGLONG llLeft;
+    ULONG    ulStall;
+
+    pPace->llNow = KeQueryPerformanceCounter(NULL).QuadPart;
+    if (!pPace->llReady)
+        return;
+
+    llLeft = pPace->llReady - pPace->llNow;
+    pPace->llReady = 0;
+    if (llLeft <= 0)
+    {
+        pPace->dwSavedUs += pPace->ulDelayUs;
+        return;
+    }
+
+    ulStall = (ULONG)((llLeft * 1000000 + pPace->llFrequency - 1) / pPace->llFrequency);
+    if (ulStall > pPace->ulDelayUs)
+        ulStall = pPace->ulDelayUs;
+    KeStallExecutionProcessor(ulStall);
+    pPace->llNow += (pPace->llFrequency * ulStall + 999999) / 1000000;
+    pPace->dwStallUs += ulStall;
+    pPace->dwSavedUs += pPace->ulDelayUs - ulStall;
+}
+
+/*
+ * FmPace_Done - call after a write to the chip, starts its settle time
+ * from the FmPace_Wait() before it.
+ */
+__inline VOID FmPace_Done(FMPACE *pPace)
+{
+    pPace->llReady = pPace->llNow + pPace->llDelay;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*****************************************************************************
+ * fmsched.h - time ordered queue of synth events
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * DirectMusic hands the FM stream its events ahead of their presentation
+ * time, see CMiniportMidiFM::NewStream().  They wait here until a timer
+ * DPC plays all that are due in one batch.  The queue is a binary heap
+ * on the presentation time; events with the same time come out in the
+ * order they were put in, so a note off and a note on at the same time
+ * keep their order.  The queue only keeps the event pointers, it needs
+ * no memory besides the FMSCHED.
+ */
+
+#ifndef _FMSCHED_H_
+#define _FMSCHED_H_
+
+#define FMSCHED_MAXEVENTS       (512)
+
+typedef struct _FMSCHEDENTRY {
+        ULONGLONG       ullTime;        /* presentation time, 100ns */
+        ULONG           ulSeq;          /* put order, for equal times */
+        PVOID           pEvent;
+} FMSCHEDENTRY;
+
+typedef struct _FMSCHED {
+        ULONG           ulCount;
+        ULONG           ulSeq;          /* next ulSeq */
+        DWORD           dwOverflows;    /* events played early or dropped, queue was full */
+        FMSCHEDENTRY    Entry[FMSCHED_MAXEVENTS];
+} FMSCHED;
+
+__inline VOID FmSched_Init(FMSCHED *pSched)
+{
+    pSched->ulCount = 0;
+    pSched->ulSeq = 0;
+    pSched->dwOverflows = 0;
+}
+
+/* TRUE if entry a comes out before entry b */
+__inline BOOL FmSched_Before(FMSCHEDENTRY *a, FMSCHEDENTRY *b)
+{
+    if (a->ullTime != b->ullTime)
+        return a->ullTime < b->ullTime;
+    /* wraps after 4G events, only the distance counts */
+    return (LONG)(a->ulSeq - b->ulSeq) < 0;
+}
+
+/*
+ * FmSched_Put - queue pEvent for ullTime.
+ *
+ * returns FALSE if the queue is full
+ */
+__inline BOOL FmSched_Put(FMSCHED *pSched, ULONGLONG ullTime, PVOID pEvent)
+{
+    FMSCHEDENTRY New;
+    ULONG        i, ulParent;
+
+    if (pSched->ulCount == FMSCHED_MAXEVENTS)
+        return FALSE;
+
+    New.ullTime = ullTime;
+    New.ulSeq = pSched->ulSeq++;
+    New.pEvent = pEvent;
+
+    /* move parents down until the new entry fits */
+    for (i = pSched->ulCount++; i; i = ulParent)
+    {
+        ulParent = (i - 1) / 2;
+        if (!FmSched_Before(&New, &pSched->Entry[ulParent]))
+            break;
+        pSched->Entry[i] = pSched->Entry[ulParent];
+    }
+    pSched->Entry[i] = New;
+    return TRUE;
+}
+
+/*
+ * FmSched_Next - presentation time of the first event.
+ *
+ * returns FALSE if the queue is empty
+ */
+__inline BOOL FmSched_Next(FMSCHED *pSched, ULONGLONG *pullTime)
+{
+    if (!pSched->ulCount)
+        return FALSE;
+    *pullTime = pSched->Entry[0].ullTime;
+    return TRUE;
+}
+
+/*
+ * FmSched_Pop - take the first event out of the queue.
+ *
+ * returns NULL if the queue is empty
+ */
+__inline PVOID FmSched_Pop(FMSCHED *pSched)
+{
+    FMSCHEDENTRY *pLast;
+    PVOID        pEvent;
+    ULONG        i, ulChild;
+
+    if (!pSched->ulCount)
+        return NULL;
+
+    pEvent = pSched->Entry[0].pEvent;
+    pLast = &pSched->Entry[--pSched->ulCount];
+
+    /* move children up until the last entry fits */
+    for (i = 0; (ulChild = 2 * i + 1) < pSched->ulCount; i = ulChild)
+    {
+        if (ulChild + 1 < pSched->ulCount &&
+            FmSched_Before(&pSched->Entry[ulChild + 1], &pSched->Entry[ulChild]))
+            ulChild++;
+        if (!FmSched_Before(&pSched->Entry[ulChild], pLast))
+            break;
+        pSched->Entry[i] = pSched->Entry[ulChild];
+    }
+    pSched->Entry[i] = *pLast;
+    return pEvent;
+}
+
+#endif
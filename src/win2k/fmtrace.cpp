@@ -0,0 +1,371 @@
+/*****************************************************************************
+ * fmtrace.cpp - FM register write trace capture and replay
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Only built with FM_TRACE.  Capture puts the records into a ring in
+ * nonpaged memory, which can be filled at DISPATCH_LEVEL.  Whenever it
+ * is half full, a work item appends its contents to FMTRACE_FILE.
+ * Replay is reached through KSPROPERTY_FMTRACE_REPLAY of the FM miniport.
+ */
+
+#include "common.h"
+#include "fmtrace.h"
+
+#define STR_MODULENAME "fmtrace: "
+
+#ifdef FM_TRACE
+
+static struct {
+    KSPIN_LOCK          Lock;
+    DWORD *             pRing;
+    ULONG               ulHead;                 /* free running, masked on access */
+    ULONG               ulTail;
+    ULONG               ulLost;                 /* records dropped on a full ring */
+    ULONGLONG           ullLast;                /* time of last record, in us */
+    LARGE_INTEGER       Frequency;
+    HANDLE              hFile;
+    LONG                lOpen;
+    BOOL                fActive;
+    BOOL                fDrainQueued;
+    WORK_QUEUE_ITEM     WorkItem;
+    KEVENT              DrainIdle;
+} s_Trace;
+
+/*
+ * FmTrace_Now - current time in microseconds.
+ */
+static ULONGLONG FmTrace_Now(VOID)
+{
+    LARGE_INTEGER Now = KeQueryPerformanceCounter(NULL);
+
+    return (Now.QuadPart / s_Trace.Frequency.QuadPart) * 1000000 +
+           (Now.QuadPart % s_Trace.Frequency.QuadPart) * 1000000 / s_Trace.Frequency.QuadPart;
+}
+
+/*
+ * FmTrace_Append - put a record into the ring, trace lock held.
+ * If the ring is full the record is lost, which is noted in the trace
+ * as soon as there is room again.
+ */
+static VOID FmTrace_Append(DWORD dwRecord)
+{
+    if (s_Trace.ulLost)
+    {
+        if (s_Trace.ulHead - s_Trace.ulTail >= FMTRACE_RINGSIZE - 1)
+        {
+            s_Trace.ulLost++;
+            return;
+        }
+        s_Trace.pRing[s_Trace.ulHead++ & (FMTRACE_RINGSIZE - 1)] =
+            FMTRACE_RECORD(0, FMTRACE_LOST, s_Trace.ulLost > 0xFF ? 0xFF : s_Trace.ulLost);
+        s_Trace.ulLost = 0;
+    }
+    if (s_Trace.ulHead - s_Trace.ulTail == FMTRACE_RINGSIZE)
+    {
+        s_Trace.ulLost++;
+        return;
+    }
+    s_Trace.pRing[s_Trace.ulHead++ & (FMTRACE_RINGSIZE - 1)] = dwRecord;
+}
+
+/*
+ * FmTrace_Flush - append everything in the ring to the trace file.
+ * PASSIVE_LEVEL, only one caller at a time.
+ */
+static VOID FmTrace_Flush(VOID)
+{
+    IO_STATUS_BLOCK IoStatusBlock;
+    LARGE_INTEGER   Offset;
+    KIRQL           OldIrql;
+    ULONG           ulTail, ulCount;
+
+    Offset.HighPart = -1;
+    Offset.LowPart = FILE_WRITE_TO_END_OF_FILE;
+
+    for (;;)
+    {
+        KeAcquireSpinLock(&s_Trace.Lock, &OldIrql);
+        ulTail = s_Trace.ulTail;
+        ulCount = s_Trace.ulHead - ulTail;
+        KeReleaseSpinLock(&s_Trace.Lock, OldIrql);
+
+        if (!ulCount)
+            break;
+
+        // the ring wraps, write the part up to its end first
+        ulTail &= FMTRACE_RINGSIZE - 1;
+        if (ulTail + ulCount > FMTRACE_RINGSIZE)
+            ulCount = FMTRACE_RINGSIZE - ulTail;
+
+        ZwWriteFile(s_Trace.hFile, NULL, NULL, NULL, &IoStatusBlock,
+                    &s_Trace.pRing[ulTail], ulCount * sizeof(DWORD), &Offset, NULL);
+
+        KeAcquireSpinLock(&s_Trace.Lock, &OldIrql);
+        s_Trace.ulTail += ulCount;
+        KeReleaseSpinLock(&s_Trace.Lock, OldIrql);
+    }
+}
+
+/*
+ * FmTrace_Drain - work item queued by FmTrace_Write().
+ */
+static VOID FmTrace_Drain(PVOID Context)
+{
+    KIRQL OldIrql;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    FmTrace_Flush();
+
+    KeAcquireSpinLock(&s_Trace.Lock, &OldIrql);
+    s_Trace.fDrainQueued = FALSE;
+    KeSetEvent(&s_Trace.DrainIdle, 0, FALSE);
+    KeReleaseSpinLock(&s_Trace.Lock, OldIrql);
+}
+
+#pragma code_seg("PAGE")
+/*
+ * FmTrace_Open - start capturing, opens or creates the trace file.
+ * Calls nest, capture runs until the last FmTrace_Close().
+ */
+NTSTATUS FmTrace_Open(VOID)
+{
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK IoStatusBlock;
+    UNICODE_STRING  UnicodeString;
+    FMTRACEHDR      Header;
+    NTSTATUS        ntStatus;
+
+    PAGED_CODE();
+
+    if (s_Trace.lOpen++)
+        return STATUS_SUCCESS;
+
+    KeInitializeSpinLock(&s_Trace.Lock);
+    KeInitializeEvent(&s_Trace.DrainIdle, NotificationEvent, TRUE);
+    ExInitializeWorkItem(&s_Trace.WorkItem, FmTrace_Drain, NULL);
+
+    s_Trace.pRing = (DWORD *)ExAllocatePool(NonPagedPool, FMTRACE_RINGSIZE * sizeof(DWORD));
+    if (!s_Trace.pRing)
+    {
+        s_Trace.lOpen = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitUnicodeString(&UnicodeString, FMTRACE_FILE);
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &UnicodeString,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    ntStatus = ZwCreateFile(&s_Trace.hFile,
+                            FILE_APPEND_DATA | SYNCHRONIZE,
+                            &ObjectAttributes,
+                            &IoStatusBlock,
+                            0,
+                            FILE_ATTRIBUTE_NORMAL,
+                            FILE_SHARE_READ,
+                            FILE_OPEN_IF,
+                            FILE_SYNCHRONOUS_IO_NONALERT,
+                            NULL,
+                            0);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("[FmTrace_Open] Cannot open trace file: %08X", ntStatus));
+        ExFreePool(s_Trace.pRing);
+        s_Trace.pRing = NULL;
+        s_Trace.lOpen = 0;
+        return ntStatus;
+    }
+
+    if (IoStatusBlock.Information == FILE_CREATED)
+    {
+        Header.dwSignature = FMTRACE_SIGNATURE;
+        Header.dwVersion = FMTRACE_VERSION;
+        ZwWriteFile(s_Trace.hFile, NULL, NULL, NULL, &IoStatusBlock,
+                    &Header, sizeof(Header), NULL, NULL);
+    }
+
+    KeQueryPerformanceCounter(&s_Trace.Frequency);
+    s_Trace.ullLast = FmTrace_Now();
+    s_Trace.ulHead = s_Trace.ulTail = s_Trace.ulLost = 0;
+    s_Trace.fDrainQueued = FALSE;
+    s_Trace.fActive = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg()
+/*
+ * FmTrace_Close - stop capturing, writes out what is left in the ring.
+ */
+VOID FmTrace_Close(VOID)
+{
+    KIRQL OldIrql;
+
+    if (!s_Trace.lOpen || --s_Trace.lOpen)
+        return;
+
+    KeAcquireSpinLock(&s_Trace.Lock, &OldIrql);
+    s_Trace.fActive = FALSE;
+    KeReleaseSpinLock(&s_Trace.Lock, OldIrql);
+
+    KeWaitForSingleObject(&s_Trace.DrainIdle, Executive, KernelMode, FALSE, NULL);
+    FmTrace_Flush();
+
+    ZwClose(s_Trace.hFile);
+    ExFreePool(s_Trace.pRing);
+    s_Trace.pRing = NULL;
+}
+
+/*
+ * FmTrace_Write - record a register write or a marker.
+ * Any IRQL up to DISPATCH_LEVEL.
+ */
+VOID FmTrace_Write(WORD wAddress, BYTE bValue)
+{
+    KIRQL       OldIrql;
+    ULONGLONG   ullNow, ullDelta;
+    ULONG       ulDelay;
+
+    if (!s_Trace.fActive)
+        return;
+
+    ullNow = FmTrace_Now();
+
+    KeAcquireSpinLock(&s_Trace.Lock, &OldIrql);
+    if (s_Trace.fActive)
+    {
+        ullDelta = ullNow > s_Trace.ullLast ? ullNow - s_Trace.ullLast : 0;
+        s_Trace.ullLast = ullNow;
+
+        while (ullDelta > FMTRACE_MAXDELTA)
+        {
+            ulDelay = ullDelta > FMTRACE_MAXDELAY ? FMTRACE_MAXDELAY : (ULONG)ullDelta;
+            FmTrace_Append(FMTRACE_RECORD(ulDelay >> 8, FMTRACE_DELAY, ulDelay));
+            ullDelta -= ulDelay;
+        }
+        FmTrace_Append(FMTRACE_RECORD(ullDelta, wAddress, bValue));
+
+        if (s_Trace.ulHead - s_Trace.ulTail >= FMTRACE_RINGSIZE / 2 && !s_Trace.fDrainQueued)
+        {
+            s_Trace.fDrainQueued = TRUE;
+            KeClearEvent(&s_Trace.DrainIdle);
+            ExQueueWorkItem(&s_Trace.WorkItem, DelayedWorkQueue);
+        }
+    }
+    KeReleaseSpinLock(&s_Trace.Lock, OldIrql);
+}
+
+#pragma code_seg()
+/*
+ * FmTrace_Stall - wait ulMicroseconds, sleeping if the IRQL allows it.
+ */
+static VOID FmTrace_Stall(ULONG ulMicroseconds)
+{
+    LARGE_INTEGER Interval;
+
+    if (ulMicroseconds >= 1000 && KeGetCurrentIrql() == PASSIVE_LEVEL)
+    {
+        Interval.QuadPart = -(LONGLONG)ulMicroseconds * 10;
+        KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+        return;
+    }
+    while (ulMicroseconds)
+    {
+        ULONG ulStall = ulMicroseconds > 50 ? 50 : ulMicroseconds;
+
+        KeStallExecutionProcessor(ulStall);
+        ulMicroseconds -= ulStall;
+    }
+}
+
+/*
+ * FmTrace_Replay - play back trace records.
+ *
+ * inputs
+ *      pRecords - records, i.e. the trace file behind its FMTRACEHDR
+ *      nRecords - number of records
+ *      ulSpeed - 0 = no waiting, 1 = original timing, n = n times faster
+ *      pfnSink, pContext - where the writes go.  FmTrace_PortSink plays
+ *              them on the chip.
+ * returns
+ *      number of register writes replayed
+ */
+ULONG FmTrace_Replay(const DWORD *pRecords, ULONG nRecords, ULONG ulSpeed,
+                     PFNFMTRACESINK pfnSink, PVOID pContext)
+{
+    ULONG i, ulPending = 0, ulWait, nWrites = 0;
+
+    for (i = 0; i < nRecords; i++)
+    {
+        DWORD dwRecord = pRecords[i];
+        WORD  wAddress = FMTRACE_ADDRESS(dwRecord);
+
+        if (wAddress == FMTRACE_DELAY)
+        {
+            ulPending += (FMTRACE_DELTA(dwRecord) << 8) | FMTRACE_VALUE(dwRecord);
+            continue;
+        }
+        ulPending += FMTRACE_DELTA(dwRecord);
+
+        if (ulSpeed)
+        {
+            // keep the remainder, so the speedup does not lose time
+            ulWait = ulPending / ulSpeed;
+            ulPending -= ulWait * ulSpeed;
+            if (ulWait)
+                FmTrace_Stall(ulWait);
+        }
+        else
+        {
+            ulPending = 0;
+        }
+
+        pfnSink(pContext, wAddress, FMTRACE_VALUE(dwRecord));
+        if (wAddress < FMTRACE_MARKER)
+            nWrites++;
+    }
+
+    return nWrites;
+}
+
+/*
+ * FmTrace_PortSink - replay sink writing to the FM ports.  The chip has
+ * to be in the mode the trace was taken in already, the path markers
+ * only select how the address is sent.
+ */
+VOID FmTrace_PortSink(PVOID pContext, WORD wAddress, BYTE bValue)
+{
+    FMTRACEPORT *pPort = (FMTRACEPORT *)pContext;
+
+    if (wAddress >= FMTRACE_MARKER)
+    {
+        if (wAddress == FMTRACE_ESFM)
+            pPort->fESFM = TRUE;
+        else if (wAddress == FMTRACE_OPL3)
+            pPort->fESFM = FALSE;
+        return;
+    }
+
+    if (pPort->fESFM)
+    {
+        WRITE_PORT_UCHAR(pPort->PortBase + 2, LOBYTE(wAddress));
+        KeStallExecutionProcessor(10);
+        WRITE_PORT_UCHAR(pPort->PortBase + 3, HIBYTE(wAddress));
+        KeStallExecutionProcessor(10);
+        WRITE_PORT_UCHAR(pPort->PortBase + 1, bValue);
+        KeStallExecutionProcessor(10);
+    }
+    else
+    {
+        WRITE_PORT_UCHAR(pPort->PortBase + (wAddress < 0x100 ? 0 : 2), (UCHAR)wAddress);
+        KeStallExecutionProcessor(23);
+        WRITE_PORT_UCHAR(pPort->PortBase + (wAddress < 0x100 ? 1 : 3), bValue);
+        KeStallExecutionProcessor(23);
+    }
+}
+
+#endif  // FM_TRACE
@@ -0,0 +1,95 @@
+/*****************************************************************************
+ * fmtrace.h - FM register write trace
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Built with FM_TRACE, every register write that reaches the FM chip on
+ * either the native ESFM or the OPL3 path is appended to a trace file.
+ *
+ * The file starts with an FMTRACEHDR followed by 32 bit records:
+ *
+ *      bits 31-18  microseconds since the previous record (0-16383)
+ *      bits 17-8   register address, 0x000-0x2FF, or a marker
+ *      bits 7-0    value written
+ *
+ * Longer pauses are written as FMTRACE_DELAY records in front of the
+ * write.  Records are only ever appended, so a trace can be read while
+ * it is still being written, and the driver holds no more of it in
+ * memory than the ring that is being drained to the file.
+ */
+
+#ifndef _FMTRACE_H_
+#define _FMTRACE_H_
+
+#define FMTRACE_SIGNATURE       (0x52544D46)    /* 'FMTR' */
+#define FMTRACE_VERSION         (1)
+
+#define FMTRACE_FILE            L"\\SystemRoot\\fmtrace.bin"
+#define FMTRACE_RINGSIZE        (8192)          /* records, power of 2 */
+
+/* marker addresses, above anything either chip decodes */
+#define FMTRACE_MARKER          (0x3F0)
+#define FMTRACE_LOST            (0x3FB)         /* value = records dropped, saturated */
+#define FMTRACE_MESSAGE         (0x3FC)         /* value = MIDI status byte */
+#define FMTRACE_ESFM            (0x3FD)         /* following writes are native ESFM */
+#define FMTRACE_OPL3            (0x3FE)         /* following writes are OPL3 */
+#define FMTRACE_DELAY           (0x3FF)         /* bits 31-18 and 7-0 = additional microseconds */
+
+#define FMTRACE_MAXDELTA        (0x3FFF)
+#define FMTRACE_MAXDELAY        (0x3FFFFF)
+
+#define FMTRACE_RECORD(delta, addr, val) \
+        (((DWORD)(delta) << 18) | ((DWORD)((addr) & 0x3FF) << 8) | (BYTE)(val))
+#define FMTRACE_DELTA(rec)      ((rec) >> 18)
+#define FMTRACE_ADDRESS(rec)    ((WORD)(((rec) >> 8) & 0x3FF))
+#define FMTRACE_VALUE(rec)      ((BYTE)(rec))
+
+typedef struct _FMTRACEHDR {
+        DWORD   dwSignature;
+        DWORD   dwVersion;
+} FMTRACEHDR;
+
+/* Gets register writes, in the order the chip would see them.  The
+   replay also passes the markers, everything with an address of
+   FMTRACE_MARKER or above is not a register.  See FmTrace_Replay() and
+   CEsfmEngine::SetSink(). */
+typedef VOID (*PFNFMTRACESINK)(PVOID pContext, WORD wAddress, BYTE bValue);
+
+#ifdef FM_TRACE
+NTSTATUS FmTrace_Open(VOID);
+VOID FmTrace_Close(VOID);
+VOID FmTrace_Write(WORD wAddress, BYTE bValue);
+
+/*
+ * Replay.  A trace file is played back on the chip by setting
+ * KSPROPERTY_FMTRACE_REPLAY on the FM synth filter, i.e. with
+ * IOCTL_KS_PROPERTY from a user mode tool:
+ *
+ *      property    KSPROPERTY with Set = KSPROPSETID_FmTrace,
+ *                  Id = KSPROPERTY_FMTRACE_REPLAY, Flags = KSPROPERTY_TYPE_SET,
+ *                  followed by a ULONG speed: 0 = no waiting,
+ *                  1 = original timing, n = n times faster
+ *      value       the trace file, FMTRACEHDR and records
+ *
+ * The chip is set up as for a stream, so the filter must not have one
+ * open.  The request returns when the whole trace has been played.
+ */
+#define STATIC_KSPROPSETID_FmTrace\
+    0xC43570A3L, 0x18A4, 0x4E59, 0x86, 0x7E, 0x36, 0xCE, 0x4E, 0x61, 0xDC, 0x72
+DEFINE_GUIDSTRUCT("C43570A3-18A4-4E59-867E-36CE4E61DC72", KSPROPSETID_FmTrace);
+#define KSPROPSETID_FmTrace DEFINE_GUIDNAMED(KSPROPSETID_FmTrace)
+
+#define KSPROPERTY_FMTRACE_REPLAY       (0)
+
+/* context for FmTrace_PortSink */
+typedef struct _FMTRACEPORT {
+        PUCHAR  PortBase;
+        BOOL    fESFM;                  /* switched by the path markers */
+} FMTRACEPORT;
+
+ULONG FmTrace_Replay(const DWORD *pRecords, ULONG nRecords, ULONG ulSpeed,
+                     PFNFMTRACESINK pfnSink, PVOID pContext);
+VOID FmTrace_PortSink(PVOID pContext, WORD wAddress, BYTE bValue);
+#endif
+
+#endif
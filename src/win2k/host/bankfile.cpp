@@ -0,0 +1,101 @@
+/*****************************************************************************
+ * bankfile.cpp - bank files mapped with mmap() for the host build
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ */
+
+#include "driver.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "bankfile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * HostBank_Want - PFNFMBANKWANT, queues the work, see HostBank_Work()
+ */
+static VOID HostBank_Want(PVOID pContext)
+{
+    HOSTBANK *pHost = (HOSTBANK *)pContext;
+
+    pHost->lWork++;
+    pHost->ulWants++;
+}
+
+VOID HostBank_Init(HOSTBANK *pHost)
+{
+    RtlZeroMemory(pHost, sizeof(*pHost));
+    FmBank_Init(&pHost->Bank, HostBank_Want, pHost);
+}
+
+VOID HostBank_Free(HOSTBANK *pHost)
+{
+    ULONG i;
+
+    FmBank_Free(&pHost->Bank);
+    for (i = 0; i < pHost->ulViews; i++)
+        munmap((void *)pHost->pView[i], pHost->ulViewSize[i]);
+    pHost->ulViews = 0;
+}
+
+/*
+ * HostBank_LoadFile - map a bank file and load it as bank 0 or attach it
+ * as bank ulMsb.ulLsb, the same checks as LoadBankFile() in the driver.
+ *
+ * returns the number of patches found
+ */
+ULONG HostBank_LoadFile(HOSTBANK *pHost, const char *pszPath, ULONG ulMsb, ULONG ulLsb)
+{
+    struct stat st;
+    const BYTE *pView;
+    ULONG ulSize, ulPatches = 0;
+    int fd;
+
+    if (pHost->ulViews >= FMBANK_MAXBANKS)
+        return 0;
+    if ((fd = open(pszPath, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) || st.st_size < 2 * NUMPATCHES || st.st_size > FMBANK_MAXSIZE)
+    {
+        close(fd);
+        return 0;
+    }
+    ulSize = (ULONG)st.st_size;
+
+    // the mapping keeps the file open
+    pView = (const BYTE *)mmap(NULL, ulSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pView == (const BYTE *)MAP_FAILED)
+        return 0;
+
+    if (ulMsb || ulLsb)
+        ulPatches = FmBank_Attach(&pHost->Bank, FMBANK_NUMBER(ulMsb, ulLsb), pView, ulSize);
+    else
+        ulPatches = FmBank_Load(&pHost->Bank, FMBANK_NUMBER(0, 0), pView, ulSize);
+    if (ulPatches && (ulMsb || ulLsb))
+    {
+        pHost->pView[pHost->ulViews] = pView;
+        pHost->ulViewSize[pHost->ulViews] = ulSize;
+        pHost->ulViews++;
+    }
+    else
+        munmap((void *)pView, ulSize);
+    return ulPatches;
+}
+
+/*
+ * HostBank_Work - decode the patches asked for since the last call, what
+ * the work item queued by BankWant() does in the driver.
+ *
+ * returns the number of patches decoded
+ */
+ULONG HostBank_Work(HOSTBANK *pHost)
+{
+    if (!pHost->lWork)
+        return 0;
+    pHost->lWork = 0;
+    return FmBank_Fetch(&pHost->Bank);
+}
@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * bankfile.h - bank files mapped with mmap() for the host build
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * The user mode side of what CMiniportMidiFM::LoadBankFile(), BankWant()
+ * and BankWork() do in the driver: a bank file is mapped read only and
+ * handed to FmBank_Load() for bank 0 or to FmBank_Attach() for any other
+ * bank, which keeps the view until HostBank_Free().  Patches the engine
+ * asks for are decoded by HostBank_Work(), which stands in for the work
+ * item, so a test decides when the fetch runs.
+ */
+
+#ifndef _BANKFILE_H_
+#define _BANKFILE_H_
+
+typedef struct _HOSTBANK {
+        FMBANK      Bank;
+        LONG        lWork;                      /* BankWant calls not worked off */
+        ULONG       ulWants;                    /* BankWant calls since HostBank_Init() */
+        ULONG       ulViews;
+        const BYTE *pView[FMBANK_MAXBANKS];     /* attached bank files */
+        ULONG       ulViewSize[FMBANK_MAXBANKS];
+} HOSTBANK;
+
+VOID  HostBank_Init(HOSTBANK *pHost);
+VOID  HostBank_Free(HOSTBANK *pHost);
+ULONG HostBank_LoadFile(HOSTBANK *pHost, const char *pszPath, ULONG ulMsb, ULONG ulLsb);
+ULONG HostBank_Work(HOSTBANK *pHost);
+
+#endif
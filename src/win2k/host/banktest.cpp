@@ -0,0 +1,249 @@
+/*****************************************************************************
+ * banktest.cpp - bank files attached and decoded on demand
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Writes the built in bank to a file and maps it with the provider in
+ * bankfile.cpp, as bank 0 and as attached banks, then checks that
+ *
+ *  - a patch of an attached bank stays FMBANK_LAZY until it is asked for
+ *    and fetched, and then uses the same pool voices as bank 0,
+ *  - a second voice uploaded to a lazy patch survives the fetch,
+ *  - a MIDI stream gives the same register writes with the banks
+ *    attached and fetched after every message as with them loaded.
+ *
+ * Also prints what loading and attaching a bank file take.
+ */
+
+#include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+#include "bank.h"
+#include "bankfile.h"
+#include "midigen.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define LAZYBANK        FMBANK_NUMBER(8, 0)
+#define MAXWRITES       (1 << 20)
+#define TIMEDLOADS      (200)
+
+typedef struct _CAPTURE {
+        ULONG   nWrites;
+        DWORD   dwWrite[MAXWRITES];     /* FMTRACE_RECORD() without time */
+} CAPTURE;
+
+static HOSTBANK    s_Loaded, s_Lazy;
+static CEsfmEngine s_Engine, s_LazyEngine;
+static CAPTURE     s_Capture, s_LazyCapture;
+
+static VOID Capture(PVOID pContext, WORD wAddress, BYTE bValue)
+{
+    CAPTURE *pCapture = (CAPTURE *)pContext;
+
+    if (pCapture->nWrites < MAXWRITES)
+        pCapture->dwWrite[pCapture->nWrites] = FMTRACE_RECORD(0, wAddress, bValue);
+    pCapture->nWrites++;
+}
+
+/* first patch of the built in bank from iFirst on with one or two voices */
+static int FindPatch(BOOL fTwoVoices, int iFirst)
+{
+    int patch, offset;
+
+    for (patch = iFirst; patch < NUMPATCHES; patch++)
+    {
+        offset = bank[2 * patch] | (bank[2 * patch + 1] << 8);
+        if (offset && !((bank[offset] >> 1) & 3) == !fTwoVoices)
+            return patch;
+    }
+    return -1;
+}
+
+static double Now(VOID)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * the engine asks for a patch of a lazy bank, plays the bank 0 one in
+ * the meantime and gets the bank's own once it is fetched
+ */
+static VOID TestLazyDecode(VOID)
+{
+    FMBANKMAP *pMap0 = s_Lazy.Bank.pMap[0], *pMap;
+    int iBank = FmBank_Find(&s_Lazy.Bank, LAZYBANK), patch = FindPatch(TRUE, 0);
+    ULONG ulWrites;
+
+    CHECK(iBank > 0 && patch >= 0);
+    if (iBank <= 0 || patch < 0)
+        return;
+    pMap = s_Lazy.Bank.pMap[iBank];
+    CHECK(pMap->bMode[patch] == FMBANK_LAZY);
+
+    HostChip_Reset();
+    s_LazyEngine.Init(HOST_PORTBASE, &s_Lazy.Bank);
+    s_LazyEngine.MidiMessage(0x0800B0);                 // bank 8.0
+    s_LazyEngine.MidiMessage(0x0020B0);
+    s_LazyEngine.MidiMessage(0x00C0 | (patch << 8));
+    CHECK(s_Lazy.lWork == 1);
+    CHECK(pMap->bMode[patch] == FMBANK_LAZY);
+
+    ulWrites = g_HostChip.ulDataWrites;
+    s_LazyEngine.MidiMessage(0x7F3C90);
+    CHECK(g_HostChip.ulDataWrites > ulWrites);          // not silent while lazy
+    CHECK(pMap->bMode[patch] == FMBANK_LAZY);
+
+    CHECK(HostBank_Work(&s_Lazy) == 1);
+    CHECK(s_Lazy.lWork == 0);
+    CHECK(pMap->bMode[patch] == pMap0->bMode[patch]);
+    CHECK(pMap->wVoice[patch][0] == pMap0->wVoice[patch][0]);
+    CHECK(pMap->wVoice[patch][1] == pMap0->wVoice[patch][1]);
+    s_LazyEngine.MidiMessage(0x003C80);
+}
+
+/*
+ * a second voice set on a lazy patch is kept, the first one still comes
+ * from the bank file; takes a patch TestLazyDecode() did not fetch
+ */
+static VOID TestUploadWhileLazy(BOOL fTwoVoices)
+{
+    FMBANKMAP *pMap0 = s_Lazy.Bank.pMap[0], *pMap;
+    int iBank = FmBank_Find(&s_Lazy.Bank, LAZYBANK), patch = FindPatch(fTwoVoices, FindPatch(TRUE, 0) + 1);
+    BYTE bVoice[FMBANK_VOICESIZE];
+    ULONG ulWants = s_Lazy.ulWants;
+
+    CHECK(iBank > 0 && patch >= 0);
+    if (iBank <= 0 || patch < 0)
+        return;
+    pMap = s_Lazy.Bank.pMap[iBank];
+    CHECK(pMap->bMode[patch] == FMBANK_LAZY);
+
+    memset(bVoice, 0x5A, sizeof(bVoice));
+    bVoice[0] = 0;
+    CHECK(FmBank_SetVoice(&s_Lazy.Bank, iBank, patch, 1, bVoice));
+    CHECK(pMap->bMode[patch] == FMBANK_LAZY);
+    CHECK(s_Lazy.ulWants == ulWants + 1);
+
+    CHECK(HostBank_Work(&s_Lazy) == 1);
+    CHECK(pMap->bMode[patch] == pMap0->bMode[patch]);
+    CHECK(pMap->wVoice[patch][0] == pMap0->wVoice[patch][0]);
+    CHECK(pMap->wVoice[patch][1] != FMBANK_NOVOICE);
+    CHECK(pMap->wVoice[patch][1] != pMap0->wVoice[patch][1]);
+    CHECK(pMap->wVoice[patch][1] != pMap->wVoice[patch][0]);
+}
+
+/*
+ * the generator selects banks 0-2.0-2, the file goes in as 1.0 and 0.1,
+ * loaded for one engine and attached for the other
+ */
+static VOID TestStream(const char *pszPath, ULONG ulSeed, ULONG nMessages)
+{
+    FMBANKINFO Info;
+    MIDIGEN Gen;
+    DWORD dwData;
+    ULONG i, ulFetched = 0;
+
+    HostBank_Init(&s_Loaded);
+    HostBank_LoadFile(&s_Loaded, pszPath, 0, 0);
+    FmBank_Load(&s_Loaded.Bank, FMBANK_NUMBER(1, 0), bank, sizeof(bank));
+    FmBank_Load(&s_Loaded.Bank, FMBANK_NUMBER(0, 1), bank, sizeof(bank));
+    HostBank_Init(&s_Lazy);
+    HostBank_LoadFile(&s_Lazy, pszPath, 0, 0);
+    HostBank_LoadFile(&s_Lazy, pszPath, 1, 0);
+    HostBank_LoadFile(&s_Lazy, pszPath, 0, 1);
+
+    s_Capture.nWrites = s_LazyCapture.nWrites = 0;
+    s_Engine.Init(HOST_PORTBASE, &s_Loaded.Bank);
+    s_Engine.SetSink(Capture, &s_Capture);
+    s_LazyEngine.Init(HOST_PORTBASE, &s_Lazy.Bank);
+    s_LazyEngine.SetSink(Capture, &s_LazyCapture);
+
+    Gen.ulSeed = ulSeed;
+    for (i = 0; i < nMessages; i++)
+    {
+        dwData = MidiGen_Message(&Gen);
+        s_Engine.MidiMessage(dwData);
+        s_LazyEngine.MidiMessage(dwData);
+        ulFetched += HostBank_Work(&s_Lazy);
+    }
+
+    FmBank_Query(&s_Lazy.Bank, FmBank_Find(&s_Lazy.Bank, FMBANK_NUMBER(1, 0)), &Info);
+    printf("seed %u: %u writes, %u wants, %u patches fetched, %u of %u still lazy in bank 1.0\n",
+        ulSeed, s_LazyCapture.nWrites, s_Lazy.ulWants, ulFetched, Info.ulLazy, Info.ulPatches);
+    CHECK(ulFetched > 0 && Info.ulLazy < Info.ulPatches);
+    CHECK(s_Capture.nWrites > 0 && s_Capture.nWrites <= MAXWRITES);
+    CHECK(s_LazyCapture.nWrites == s_Capture.nWrites);
+    CHECK(!memcmp(s_LazyCapture.dwWrite, s_Capture.dwWrite, s_Capture.nWrites * sizeof(DWORD)));
+    CHECK(s_Loaded.Bank.ulVoices == s_Lazy.Bank.ulVoices);
+
+    HostBank_Free(&s_Loaded);
+    HostBank_Free(&s_Lazy);
+}
+
+static VOID TimeLoad(const char *pszPath)
+{
+    double t0, t1, t2;
+    int i;
+
+    t0 = Now();
+    for (i = 0; i < TIMEDLOADS; i++)
+    {
+        HostBank_Init(&s_Loaded);
+        HostBank_LoadFile(&s_Loaded, pszPath, 0, 0);
+        HostBank_Free(&s_Loaded);
+    }
+    t1 = Now();
+    for (i = 0; i < TIMEDLOADS; i++)
+    {
+        HostBank_Init(&s_Lazy);
+        HostBank_LoadFile(&s_Lazy, pszPath, 8, 0);
+        HostBank_Free(&s_Lazy);
+    }
+    t2 = Now();
+    printf("bank file loaded in %.1f us, attached in %.1f us\n",
+        (t1 - t0) / TIMEDLOADS, (t2 - t1) / TIMEDLOADS);
+}
+
+int main(int argc, char **argv)
+{
+    char szPath[] = "/tmp/banktestXXXXXX";
+    ULONG ulSeed, nMessages = argc > 1 ? atoi(argv[1]) : 20000;
+    FMBANKINFO Info;
+    int fd;
+
+    fd = mkstemp(szPath);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return 1;
+    CHECK(write(fd, bank, sizeof(bank)) == sizeof(bank));
+    close(fd);
+
+    HostBank_Init(&s_Lazy);
+    CHECK(HostBank_LoadFile(&s_Lazy, szPath, 0, 0) > 0);
+    CHECK(HostBank_LoadFile(&s_Lazy, szPath, 8, 0) > 0);
+    CHECK(s_Lazy.ulViews == 1);
+    CHECK(FmBank_Query(&s_Lazy.Bank, FmBank_Find(&s_Lazy.Bank, LAZYBANK), &Info));
+    CHECK(Info.ulLazy == Info.ulPatches && Info.ulVoices == 0);
+    TestLazyDecode();
+    TestUploadWhileLazy(TRUE);
+    TestUploadWhileLazy(FALSE);
+    HostBank_Free(&s_Lazy);
+
+    for (ulSeed = 1; ulSeed <= 3; ulSeed++)
+        TestStream(szPath, ulSeed, nMessages);
+
+    TimeLoad(szPath);
+    unlink(szPath);
+
+    printf("%s\n", g_nHostFailed ? "FAILED" : "passed");
+    return g_nHostFailed ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+/*****************************************************************************
+ * midigen.h - reproducible random MIDI streams for the host tests
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Notes on and off on all channels, a fifth of them drums, bends, program
+ * changes and the controllers the engine acts on.  The same seed always
+ * gives the same stream.
+ */
+
+#ifndef _MIDIGEN_H_
+#define _MIDIGEN_H_
+
+typedef struct _MIDIGEN {
+        ULONG   ulSeed;
+} MIDIGEN;
+
+__inline ULONG MidiGen_Random(MIDIGEN *pGen)
+{
+    pGen->ulSeed = pGen->ulSeed * 1103515245 + 12345;
+    return (pGen->ulSeed >> 8) & 0xFFFFFF;
+}
+
+/*
+ * MidiGen_Message - next short message, packed as for MidiMessage().
+ */
+__inline DWORD MidiGen_Message(MIDIGEN *pGen)
+{
+    static const BYTE bControllers[] = { 7, 7, 11, 11, 10, 64, 64, 121, 123, 6, 100, 101, 0, 32, 120 };
+    ULONG r = MidiGen_Random(pGen) % 100, ch = MidiGen_Random(pGen) % 16;
+    BYTE c, v;
+
+    if (MidiGen_Random(pGen) % 5 == 0)
+        ch = 9;
+    if (r < 35)
+        return 0x90 | ch | ((30 + MidiGen_Random(pGen) % 60) << 8) | ((1 + MidiGen_Random(pGen) % 127) << 16);
+    if (r < 65)
+        return 0x80 | ch | ((30 + MidiGen_Random(pGen) % 60) << 8);
+    if (r < 70)
+        return 0x90 | ch | ((30 + MidiGen_Random(pGen) % 60) << 8);
+    if (r < 80)
+        return 0xE0 | ch | ((MidiGen_Random(pGen) % 128) << 8) | ((MidiGen_Random(pGen) % 128) << 16);
+    if (r < 85)
+        return 0xC0 | ch | ((MidiGen_Random(pGen) % 128) << 8);
+
+    c = bControllers[MidiGen_Random(pGen) % sizeof(bControllers)];
+    v = (BYTE)(MidiGen_Random(pGen) % 128);
+    if (c == 100 || c == 101)
+        v = 0;                          /* RPN 0, bend range */
+    if (c == 0 || c == 32)
+        v = (BYTE)(MidiGen_Random(pGen) % 3);
+    if (c == 6)
+        v = (BYTE)(1 + MidiGen_Random(pGen) % 12);
+    return 0xB0 | ch | (c << 8) | (v << 16);
+}
+
+#endif
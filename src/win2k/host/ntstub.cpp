@@ -0,0 +1,83 @@
+/*****************************************************************************
+ * ntstub.cpp - simulated FM chip and clock of the host build
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ */
+
+#include "ntstub.h"
+
+HOSTCHIP  g_HostChip;
+ULONGLONG g_ullHostNs;
+ULONG     g_ulHostPortNs = 1000;
+ULONG     g_ulHostQpcNs = 0;
+int       g_nHostFailed;
+
+/*
+ * HostChip_Reset - forget the register contents and the counts.
+ */
+VOID HostChip_Reset(VOID)
+{
+    PFNHOSTWRITE pfnWrite = g_HostChip.pfnWrite;
+    PVOID pContext = g_HostChip.pContext;
+
+    memset(&g_HostChip, 0, sizeof(g_HostChip));
+    g_HostChip.pfnWrite = pfnWrite;
+    g_HostChip.pContext = pContext;
+}
+
+VOID WRITE_PORT_UCHAR(PUCHAR Port, UCHAR Value)
+{
+    WORD wAddress;
+
+    g_HostChip.ulPortWrites++;
+    g_ullHostNs += g_ulHostPortNs;
+
+    switch (Port - HOST_PORTBASE)
+    {
+        case 2:
+            g_HostChip.bLow = Value;
+            break;
+        case 3:
+            g_HostChip.bHigh = Value;
+            g_HostChip.ulHighWrites++;
+            break;
+        case 1:
+            wAddress = (WORD)((g_HostChip.bHigh << 8) | g_HostChip.bLow);
+            g_HostChip.ulDataWrites++;
+            if (wAddress < HOST_REGS)
+            {
+                if (g_HostChip.bKnown[wAddress] && g_HostChip.bReg[wAddress] == Value)
+                    g_HostChip.ulRedundant++;
+                g_HostChip.bReg[wAddress] = Value;
+                g_HostChip.bKnown[wAddress] = TRUE;
+            }
+            if (g_HostChip.pfnWrite)
+                g_HostChip.pfnWrite(g_HostChip.pContext, wAddress, Value);
+            break;
+    }
+}
+
+UCHAR READ_PORT_UCHAR(PUCHAR Port)
+{
+    UNREFERENCED_PARAMETER(Port);
+    g_ullHostNs += g_ulHostPortNs;
+    return 0;
+}
+
+VOID KeStallExecutionProcessor(ULONG ulMicroseconds)
+{
+    g_HostChip.ulStallUs += ulMicroseconds;
+    g_ullHostNs += ulMicroseconds * 1000ULL;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *pFrequency)
+{
+    LARGE_INTEGER Now;
+
+    g_HostChip.ulQpcCalls++;
+    g_ullHostNs += g_ulHostQpcNs;
+    if (pFrequency)
+        pFrequency->QuadPart = HOST_FREQUENCY;
+    Now.QuadPart = (LONGLONG)(g_ullHostNs * HOST_FREQUENCY / 1000000000ULL);
+    return Now;
+}
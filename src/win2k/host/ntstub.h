@@ -0,0 +1,143 @@
+/*****************************************************************************
+ * ntstub.h - kernel mode stand-ins for the host build of the FM engine
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Forced in front of every source of the host build (see Makefile), in
+ * place of common.h.  The FM ports go to HOSTCHIP, which counts the port
+ * writes and decodes them into register writes like the ESFM does in
+ * native mode: base+2 the low address byte, base+3 the latched high
+ * address byte, base+1 the data.  Time is simulated: every port access
+ * takes HOST_PORTNS, every KeQueryPerformanceCounter() call HOST_QPCNS,
+ * a stall as long as it was asked for.
+ */
+
+#ifndef _NTSTUB_H_
+#define _NTSTUB_H_
+
+/* the driver's common.h drags in the DDK, keep it out */
+#define _COMMON_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char           BYTE, UCHAR, *PUCHAR, *PBYTE, BOOLEAN;
+typedef char                    CHAR;
+typedef unsigned short          USHORT, WORD;
+typedef short                   SHORT;
+typedef unsigned int            UINT, ULONG, DWORD, *PULONG, *PDWORD;
+typedef int                     INT, LONG, BOOL, NTSTATUS;
+typedef long long               LONGLONG;
+typedef unsigned long long      ULONGLONG;
+typedef size_t                  ULONG_PTR, SIZE_T;
+typedef void                    VOID, *PVOID;
+typedef union _LARGE_INTEGER {
+        struct { ULONG LowPart; LONG HighPart; };
+        LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE                    1
+#define FALSE                   0
+#define NEAR
+#define FAR
+#define PASCAL
+#define IN
+#define OUT
+#define __inline                static inline
+
+#define LOBYTE(w)               ((BYTE)((w) & 0xFF))
+#define HIBYTE(w)               ((BYTE)(((w) >> 8) & 0xFF))
+
+#define NT_SUCCESS(s)           ((NTSTATUS)(s) >= 0)
+#define STATUS_SUCCESS          ((NTSTATUS)0)
+
+#define ASSERT(e)
+#define PAGED_CODE()
+#define UNREFERENCED_PARAMETER(p)       (void)(p)
+#define _DbgPrintF(lvl, args)
+
+#define RtlZeroMemory(d, l)             memset((d), 0, (l))
+#define RtlFillMemory(d, l, v)          memset((d), (v), (l))
+#define RtlCopyMemory(d, s, l)          memcpy((d), (s), (l))
+__inline SIZE_T RtlCompareMemory(const VOID *a, const VOID *b, SIZE_T l)
+{
+    SIZE_T i = 0;
+
+    while (i < l && ((const BYTE *)a)[i] == ((const BYTE *)b)[i])
+        i++;
+    return i;
+}
+
+#define NonPagedPool            0
+#define PagedPool               1
+#define ExAllocatePool(t, l)    malloc(l)
+#define ExFreePool(p)           free(p)
+
+/* one thread, the locks only have to compile */
+typedef LONG                    KSPIN_LOCK;
+typedef BYTE                    KIRQL;
+#define KeInitializeSpinLock(l)         (*(l) = 0)
+#define KeAcquireSpinLock(l, o)         (*(o) = 0)
+#define KeReleaseSpinLock(l, o)         ((void)(o))
+#define KeMemoryBarrier()               __sync_synchronize()
+#define InterlockedExchange(p, v)       __sync_lock_test_and_set((p), (v))
+#define InterlockedOr(p, v)             __sync_fetch_and_or((p), (v))
+
+__inline BYTE _BitScanForward(ULONG *pIndex, ULONG ulMask)
+{
+    if (!ulMask)
+        return 0;
+    *pIndex = __builtin_ctz(ulMask);
+    return 1;
+}
+
+__inline BYTE _BitScanReverse(ULONG *pIndex, ULONG ulMask)
+{
+    if (!ulMask)
+        return 0;
+    *pIndex = 31 - __builtin_clz(ulMask);
+    return 1;
+}
+
+/*
+ * The simulated chip and clock.
+ */
+#define HOST_PORTBASE           ((PUCHAR)0x388)
+#define HOST_REGS               (0x300)
+#define HOST_FREQUENCY          (3579545)       /* ACPI PM timer */
+
+/* gets every register write the chip decodes */
+typedef VOID (*PFNHOSTWRITE)(PVOID pContext, WORD wAddress, BYTE bValue);
+
+typedef struct _HOSTCHIP {
+        BYTE            bLow, bHigh;            /* address latches */
+        BYTE            bReg[HOST_REGS];
+        BYTE            bKnown[HOST_REGS];      /* register written since HostChip_Reset() */
+        ULONG           ulPortWrites;
+        ULONG           ulHighWrites;           /* writes of the high address byte */
+        ULONG           ulDataWrites;
+        ULONG           ulRedundant;            /* data writes of the value the register had */
+        ULONG           ulStallUs;              /* KeStallExecutionProcessor() */
+        ULONG           ulQpcCalls;             /* KeQueryPerformanceCounter() */
+        PFNHOSTWRITE    pfnWrite;
+        PVOID           pContext;
+} HOSTCHIP;
+
+extern HOSTCHIP  g_HostChip;
+extern ULONGLONG g_ullHostNs;                   /* simulated time */
+extern ULONG     g_ulHostPortNs;                /* cost of a port access */
+extern ULONG     g_ulHostQpcNs;                 /* cost of reading the counter */
+
+VOID HostChip_Reset(VOID);
+VOID WRITE_PORT_UCHAR(PUCHAR Port, UCHAR Value);
+UCHAR READ_PORT_UCHAR(PUCHAR Port);
+VOID KeStallExecutionProcessor(ULONG ulMicroseconds);
+LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *pFrequency);
+
+/* bare bones checks for the tests */
+extern int g_nHostFailed;
+#define CHECK(e)        ((e) ? (void)0 : (void)(g_nHostFailed++, \
+                         fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #e)))
+
+#endif
@@ -0,0 +1,107 @@
+/*****************************************************************************
+ * pacebench.cpp - cost of the port write pacing of the ESFM engine
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Plays a MIDI stream on the simulated chip with reading the performance
+ * counter costing nothing (TSC), about as much as a port access (HPET)
+ * and a bit more (ACPI PM timer), and with the engine taking 0, 2 or 5
+ * microseconds of its own to work out each register.  Prints per note on
+ * what the writes took on the simulated clock, what stalling the whole
+ * FM_ESFM_DELAY after every write would have taken, the difference, and
+ * the counter reads per port write.  With no work between writes and a
+ * slow counter, pacing costs more than it saves.
+ *
+ * pacebench [messages]
+ */
+
+#include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+#include "bank.h"
+#include "midigen.h"
+
+#define BENCH_SEED      (1)
+
+static ULONG       s_ulWorkNs;          /* per register write */
+
+static FMBANK      s_Bank;
+static CEsfmEngine s_Engine;
+
+static const struct {
+        const char *pszClock;
+        ULONG       ulQpcNs;
+} s_Clocks[] = {
+        { "TSC",      0 },
+        { "HPET",     1000 },
+        { "PM timer", 1500 },
+};
+
+static const ULONG s_ulWork[] = { 0, 2000, 5000 };
+
+/* the engine working out the next register write */
+static VOID Work(PVOID pContext, WORD wAddress, BYTE bValue)
+{
+    UNREFERENCED_PARAMETER(pContext);
+    UNREFERENCED_PARAMETER(wAddress);
+    UNREFERENCED_PARAMETER(bValue);
+    g_ullHostNs += s_ulWorkNs;
+}
+
+int main(int argc, char **argv)
+{
+    ULONG i, c, w, nMessages = argc > 1 ? atoi(argv[1]) : 20000, nNotes;
+    ULONGLONG ullStart, ullFixed;
+    double dNote;
+    MIDIGEN Gen;
+    DWORD dwData;
+
+    FmBank_Init(&s_Bank, NULL, NULL);
+    FmBank_Load(&s_Bank, 0, bank, sizeof(bank));
+
+    g_HostChip.pfnWrite = Work;
+    printf("%-9s %7s %10s %10s %10s %10s %7s\n", "counter", "work us",
+        "paced us", "fixed us", "saved us", "stall us", "reads");
+    for (c = 0; c < sizeof(s_Clocks) / sizeof(s_Clocks[0]); c++)
+    for (w = 0; w < sizeof(s_ulWork) / sizeof(s_ulWork[0]); w++)
+    {
+        g_ulHostQpcNs = s_Clocks[c].ulQpcNs;
+        s_ulWorkNs = s_ulWork[w];
+        HostChip_Reset();
+        s_Engine.Init(HOST_PORTBASE, &s_Bank);
+        HostChip_Reset();
+        ullStart = g_ullHostNs;
+
+        nNotes = 0;
+        Gen.ulSeed = BENCH_SEED;
+        for (i = 0; i < nMessages; i++)
+        {
+            dwData = MidiGen_Message(&Gen);
+            if ((dwData & 0xF0) == 0x90 && (dwData >> 16))
+                nNotes++;
+            s_Engine.MidiMessage(dwData);
+        }
+
+        // per note on, what stalling the whole settle time would take
+        dNote = nNotes ? nNotes : 1;
+        ullFixed = (ULONGLONG)g_HostChip.ulPortWrites * (FM_ESFM_DELAY * 1000 + g_ulHostPortNs) +
+            (ULONGLONG)g_HostChip.ulDataWrites * s_ulWorkNs;
+        printf("%-9s %7.1f %10.2f %10.2f %10.2f %10.2f %7.3f\n", s_Clocks[c].pszClock,
+            s_ulWorkNs / 1000.0, (g_ullHostNs - ullStart) / 1000.0 / dNote, ullFixed / 1000.0 / dNote,
+            ((double)ullFixed - (g_ullHostNs - ullStart)) / 1000.0 / dNote,
+            g_HostChip.ulStallUs / dNote,
+            (double)g_HostChip.ulQpcCalls / g_HostChip.ulPortWrites);
+        CHECK(g_HostChip.ulQpcCalls == g_HostChip.ulPortWrites);
+        if (!g_ulHostQpcNs)
+            CHECK(g_ullHostNs - ullStart <= ullFixed);
+    }
+    g_HostChip.pfnWrite = NULL;
+    g_ulHostQpcNs = 0;
+
+    printf("%s\n", g_nHostFailed ? "FAILED" : "passed");
+    return g_nHostFailed ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+/*****************************************************************************
+ * shadowtest.cpp - register shadow of the ESFM engine
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Plays a random MIDI stream and checks that the engine counts its shadow
+ * hits and misses, that every miss is exactly one data write on the port,
+ * and that no write of a value the register already holds reaches it.
+ */
+
+#include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+#include "bank.h"
+#include "midigen.h"
+
+static FMBANK     s_Bank;
+static CEsfmEngine s_Engine;
+
+int main(int argc, char **argv)
+{
+    static const BYTE GmReset[] = { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
+    MIDIGEN Gen;
+    const FMSTATS *pStats;
+    ULONG i, ulSeed, nMessages = argc > 1 ? atoi(argv[1]) : 20000;
+    ULONG ulHits, ulPortWrites;
+
+    FmBank_Init(&s_Bank, NULL, NULL);
+    FmBank_Load(&s_Bank, 0, bank, sizeof(bank));
+
+    for (ulSeed = 1; ulSeed <= 3; ulSeed++)
+    {
+        // engine and chip both start out not knowing any register
+        Gen.ulSeed = ulSeed;
+        HostChip_Reset();
+        s_Engine.Init(HOST_PORTBASE, &s_Bank);
+        for (i = 0; i < nMessages; i++)
+            s_Engine.MidiMessage(MidiGen_Message(&Gen));
+
+        pStats = s_Engine.GetStats();
+        printf("seed %u: %u hits, %u misses, %u port writes, %u redundant\n",
+            ulSeed, pStats->dwShadowHits, pStats->dwShadowMisses,
+            g_HostChip.ulPortWrites, g_HostChip.ulRedundant);
+        CHECK(pStats->dwShadowHits > 0);
+        CHECK(pStats->dwShadowMisses == g_HostChip.ulDataWrites);
+        CHECK(pStats->dwPortWrites == g_HostChip.ulPortWrites);
+        CHECK(g_HostChip.ulRedundant == 0);
+
+        // a second reset rewrites what the first one did, all of it hits
+        s_Engine.MidiSysEx(GmReset, sizeof(GmReset));
+        ulHits = pStats->dwShadowHits;
+        ulPortWrites = g_HostChip.ulPortWrites;
+        s_Engine.MidiSysEx(GmReset, sizeof(GmReset));
+        pStats = s_Engine.GetStats();
+        CHECK(pStats->dwShadowHits > ulHits);
+        CHECK(g_HostChip.ulPortWrites == ulPortWrites);
+
+        // after an invalidate nothing is known, the same writes go out again
+        s_Engine.fminvalidate();
+        s_Engine.MidiSysEx(GmReset, sizeof(GmReset));
+        CHECK(g_HostChip.ulPortWrites > ulPortWrites);
+    }
+
+    printf("%s\n", g_nHostFailed ? "FAILED" : "passed");
+    return g_nHostFailed ? 1 : 0;
+}
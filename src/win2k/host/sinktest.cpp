@@ -0,0 +1,91 @@
+/*****************************************************************************
+ * sinktest.cpp - register write backend of the ESFM engine
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Plays the same MIDI stream once on the chip and once into a sink set
+ * with CEsfmEngine::SetSink().  The sink has to get exactly the register
+ * writes the chip decodes from its ports, and the ports nothing.
+ */
+
+#include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+#include "bank.h"
+#include "midigen.h"
+
+#define MAXWRITES       (1 << 20)
+
+typedef struct _CAPTURE {
+        ULONG   nWrites;
+        DWORD   dwWrite[MAXWRITES];     /* FMTRACE_RECORD() without time */
+} CAPTURE;
+
+static FMBANK      s_Bank;
+static CEsfmEngine s_Engine;
+static CAPTURE     s_Chip, s_Sink;
+
+static VOID Capture(PVOID pContext, WORD wAddress, BYTE bValue)
+{
+    CAPTURE *pCapture = (CAPTURE *)pContext;
+
+    if (pCapture->nWrites < MAXWRITES)
+        pCapture->dwWrite[pCapture->nWrites] = FMTRACE_RECORD(0, wAddress, bValue);
+    pCapture->nWrites++;
+}
+
+static VOID Play(ULONG ulSeed, ULONG nMessages)
+{
+    MIDIGEN Gen;
+    ULONG i;
+
+    Gen.ulSeed = ulSeed;
+    for (i = 0; i < nMessages; i++)
+        s_Engine.MidiMessage(MidiGen_Message(&Gen));
+}
+
+int main(int argc, char **argv)
+{
+    ULONG ulSeed, nMessages = argc > 1 ? atoi(argv[1]) : 20000;
+
+    FmBank_Init(&s_Bank, NULL, NULL);
+    FmBank_Load(&s_Bank, 0, bank, sizeof(bank));
+
+    for (ulSeed = 1; ulSeed <= 3; ulSeed++)
+    {
+        // on the chip, the decoded port writes are captured
+        s_Chip.nWrites = 0;
+        g_HostChip.pfnWrite = Capture;
+        g_HostChip.pContext = &s_Chip;
+        HostChip_Reset();
+        s_Engine.Init(HOST_PORTBASE, &s_Bank);
+        Play(ulSeed, nMessages);
+        g_HostChip.pfnWrite = NULL;
+
+        // the same into the sink
+        s_Sink.nWrites = 0;
+        HostChip_Reset();
+        s_Engine.Init(HOST_PORTBASE, &s_Bank);
+        s_Engine.SetSink(Capture, &s_Sink);
+        Play(ulSeed, nMessages);
+
+        printf("seed %u: %u writes on the chip, %u into the sink\n",
+            ulSeed, s_Chip.nWrites, s_Sink.nWrites);
+        CHECK(s_Chip.nWrites > 0 && s_Chip.nWrites <= MAXWRITES);
+        CHECK(s_Sink.nWrites == s_Chip.nWrites);
+        CHECK(!memcmp(s_Sink.dwWrite, s_Chip.dwWrite, s_Chip.nWrites * sizeof(DWORD)));
+        CHECK(g_HostChip.ulPortWrites == 0);
+
+        // and back to the chip
+        s_Engine.SetSink(NULL, NULL);
+        s_Engine.MidiMessage(0x7F3C90);
+        CHECK(g_HostChip.ulPortWrites > 0);
+    }
+
+    printf("%s\n", g_nHostFailed ? "FAILED" : "passed");
+    return g_nHostFailed ? 1 : 0;
+}
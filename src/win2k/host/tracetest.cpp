@@ -0,0 +1,123 @@
+/*****************************************************************************
+ * tracetest.cpp - register writes of the ESFM engine against a reference
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * Plays a MIDI stream through the engine and records the register writes
+ * the simulated chip decodes from its ports, in the FM_TRACE file format
+ * (see fmtrace.h): an FMTRACE_ESFM marker, then for every message an
+ * FMTRACE_MESSAGE marker and its writes.  Times are left at 0, only the
+ * writes and their order count.  The trace has to match trace.ref, which
+ * can also be played back on a card with KSPROPERTY_FMTRACE_REPLAY.
+ *
+ * Built twice, as tracetest and, with NATV.cpp built with FM_NOLATCH, as
+ * tracetest_nolatch.  Both have to produce the same trace, the first one
+ * with fewer writes of the high address byte.
+ *
+ * tracetest -w <file> writes the trace instead, to make a new reference
+ * after a change of the engine's output that is meant to be.
+ */
+
+#include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+#include "bank.h"
+#include "midigen.h"
+
+#define TRACE_SEED      (1)
+#define TRACE_MESSAGES  (1000)
+#define MAXRECORDS      (1 << 18)
+
+typedef struct _TRACE {
+        FMTRACEHDR      Hdr;
+        DWORD           dwRecord[MAXRECORDS];
+} TRACE;
+
+static FMBANK      s_Bank;
+static CEsfmEngine s_Engine;
+static TRACE       s_Trace, s_Ref;
+static ULONG       s_nRecords;
+
+static VOID Record(PVOID pContext, WORD wAddress, BYTE bValue)
+{
+    UNREFERENCED_PARAMETER(pContext);
+    if (s_nRecords < MAXRECORDS)
+        s_Trace.dwRecord[s_nRecords] = FMTRACE_RECORD(0, wAddress, bValue);
+    s_nRecords++;
+}
+
+int main(int argc, char **argv)
+{
+    const char *pszRef = argc > 1 ? argv[argc - 1] : "trace.ref";
+    BOOL fWrite = argc > 2 && !strcmp(argv[1], "-w");
+    MIDIGEN Gen;
+    DWORD dwData;
+    ULONG i, ulSize;
+    FILE *fp;
+
+    FmBank_Init(&s_Bank, NULL, NULL);
+    FmBank_Load(&s_Bank, 0, bank, sizeof(bank));
+
+    HostChip_Reset();
+    g_HostChip.pfnWrite = Record;
+    s_Engine.Init(HOST_PORTBASE, &s_Bank);
+
+    Record(NULL, FMTRACE_ESFM, 0);
+    Gen.ulSeed = TRACE_SEED;
+    for (i = 0; i < TRACE_MESSAGES; i++)
+    {
+        dwData = MidiGen_Message(&Gen);
+        Record(NULL, FMTRACE_MESSAGE, (BYTE)dwData);
+        s_Engine.MidiMessage(dwData);
+    }
+    s_Trace.Hdr.dwSignature = FMTRACE_SIGNATURE;
+    s_Trace.Hdr.dwVersion = FMTRACE_VERSION;
+    ulSize = sizeof(FMTRACEHDR) + s_nRecords * sizeof(DWORD);
+
+    printf("%u records, %u data writes, %u high address writes, %u latch skips\n",
+        s_nRecords, g_HostChip.ulDataWrites, g_HostChip.ulHighWrites,
+        s_Engine.GetStats()->dwLatchSkips);
+    CHECK(s_nRecords <= MAXRECORDS);
+#ifdef FM_NOLATCH
+    CHECK(g_HostChip.ulHighWrites == g_HostChip.ulDataWrites);
+#else
+    CHECK(g_HostChip.ulHighWrites < g_HostChip.ulDataWrites);
+    CHECK(g_HostChip.ulHighWrites + s_Engine.GetStats()->dwLatchSkips == g_HostChip.ulDataWrites);
+#endif
+
+    if (fWrite)
+    {
+        fp = fopen(pszRef, "wb");
+        CHECK(fp && fwrite(&s_Trace, ulSize, 1, fp) == 1);
+        if (fp)
+            fclose(fp);
+    }
+    else
+    {
+        fp = fopen(pszRef, "rb");
+        CHECK(fp != NULL);
+        if (fp)
+        {
+            i = (ULONG)fread(&s_Ref, 1, sizeof(s_Ref), fp);
+            fclose(fp);
+            CHECK(i == ulSize);
+            CHECK(!memcmp(&s_Ref, &s_Trace, ulSize < i ? ulSize : i));
+            for (i = 0; i < s_nRecords && i < MAXRECORDS; i++)
+            {
+                if (s_Ref.dwRecord[i] != s_Trace.dwRecord[i])
+                {
+                    fprintf(stderr, "record %u: %08X, reference %08X\n", i,
+                        s_Trace.dwRecord[i], s_Ref.dwRecord[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("%s\n", g_nHostFailed ? "FAILED" : "passed");
+    return g_nHostFailed ? 1 : 0;
+}
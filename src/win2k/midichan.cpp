@@ -0,0 +1,165 @@
+/*****************************************************************************
+ * midichan.cpp - MIDI channel state shared by the FM synths
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ */
+
+#include "common.h"
+#include "driver.h"
+#include "midichan.h"
+
+#define STR_MODULENAME "midichan: "
+
+/* bend multiplier, fine and coarse part, see MidiChan_CalcBendMult() */
+static const USHORT gwBendFine[64] = {
+    1024, 1025, 1026, 1027, 1028, 1029, 1030, 1030, 1031, 1032,
+    1033, 1034, 1035, 1036, 1037, 1038, 1039, 1040, 1041, 1042,
+    1043, 1044, 1045, 1045, 1046, 1047, 1048, 1049, 1050, 1051,
+    1052, 1053, 1054, 1055, 1056, 1057, 1058, 1059, 1060, 1061,
+    1062, 1063, 1064, 1065, 1065, 1066, 1067, 1068, 1069, 1070,
+    1071, 1072, 1073, 1074, 1075, 1076, 1077, 1078, 1079, 1080,
+    1081, 1082, 1083, 1084,
+};
+static const USHORT gwBendCoarse[49] = {
+    256,  271,  287,  304,  323,  342,  362,  384,  406,  431,
+    456,  483,  512,  542,  575,  609,  645,  683,  724,  767,
+    813,  861,  912,  967,  1024, 1085, 1149, 1218, 1290, 1367,
+    1448, 1534, 1625, 1722, 1825, 1933, 2048, 2170, 2299, 2435,
+    2580, 2734, 2896, 3069, 3251, 3444, 3649, 3866, 4096,
+};
+
+/*
+ * MidiChan_Reset - set a channel to its power on state.
+ */
+VOID MidiChan_Reset(MIDICHAN *pChan)
+{
+    pChan->bProgram = 0;
+    pChan->bBankMsb = 0;
+    pChan->bBankLsb = 0;
+    pChan->bVolume = 100;
+    pChan->bExpr = 127;
+    pChan->bPan = 64;
+    pChan->bHold = 0;
+    pChan->bBendRange = 2;
+    pChan->wBend = MIDICHAN_BENDCENTER;
+    pChan->bBendKeyRange = 0xFF;
+}
+
+/*
+ * MidiChan_Message - take a channel message for pChan apart.  Updates
+ * the channel and returns the MIDIEV_* the synth has to act upon.
+ */
+int MidiChan_Message(MIDICHAN *pChan, DWORD dwData)
+{
+    BYTE    data1, data2;
+
+    data1 = (BYTE) ((WORD) dwData >> 8) & (BYTE)0x7f;
+    data2 = (BYTE) (dwData >> 16) & (BYTE)0x7f;
+
+    switch ((BYTE)dwData & 0xf0)
+    {
+        case 0x90:
+            /* turn key on, or key off if volume == 0 */
+            if (data2)
+                return MIDIEV_NOTEON;
+            return MIDIEV_NOTEOFF;
+
+        case 0x80:
+            return MIDIEV_NOTEOFF;
+
+        case 0xb0:
+            /* change control */
+            switch (data1)
+            {
+                case 0:
+                    /* bank select, takes effect at the next program change */
+                    pChan->bBankMsb = data2;
+                    break;
+                case 32:
+                    pChan->bBankLsb = data2;
+                    break;
+                case 6:
+                    /* data entry, only the bend range RPN is known */
+                    if ((pChan->bHold & MIDICHAN_RPNBEND) == MIDICHAN_RPNBEND)
+                        pChan->bBendRange = (data2 > MIDICHAN_MAXBENDRANGE) ?
+                            (BYTE)MIDICHAN_MAXBENDRANGE : data2;
+                    break;
+                case 7:
+                    pChan->bVolume = data2;
+                    return MIDIEV_VOLUME;
+                case 8:
+                case 10:
+                    pChan->bPan = data2;
+                    return MIDIEV_PAN;
+                case 11:
+                    pChan->bExpr = data2;
+                    return MIDIEV_VOLUME;
+                case 64:
+                    if (data2 < 64)
+                        pChan->bHold &= ~MIDICHAN_SUSTAIN;
+                    else
+                        pChan->bHold |= MIDICHAN_SUSTAIN;
+                    return MIDIEV_SUSTAIN;
+                case 100:
+                    if (data2 == 0)
+                    {
+                        pChan->bHold |= MIDICHAN_RPNLSB0;
+                        break;
+                    }
+                case 98:
+                    pChan->bHold &= ~MIDICHAN_RPNLSB0;
+                    break;
+                case 101:
+                    if (data2 == 0)
+                    {
+                        pChan->bHold |= MIDICHAN_RPNMSB0;
+                        break;
+                    }
+                case 99:
+                    pChan->bHold &= ~MIDICHAN_RPNMSB0;
+                    break;
+                case 120:
+                case 124:
+                case 125:
+                    return MIDIEV_SOUNDOFF;
+                case 121:
+                    /* reset all controllers */
+                    pChan->bHold &= ~MIDICHAN_SUSTAIN;
+                    pChan->bVolume = 100;
+                    pChan->bExpr = 127;
+                    pChan->wBend = MIDICHAN_BENDCENTER;
+                    pChan->bPan = 64;
+                    pChan->bBendRange = 2;
+                    return MIDIEV_RESETCTRL;
+                case 123:
+                case 126:
+                case 127:
+                    return MIDIEV_NOTESOFF;
+            }
+            break;
+
+        case 0xc0:
+            pChan->bProgram = data1;
+            return MIDIEV_PROGRAM;
+
+        case 0xe0:
+            pChan->wBend = data1 | (data2 << 7);
+            return MIDIEV_BEND;
+    }
+
+    return MIDIEV_NONE;
+}
+
+/*
+ * MidiChan_CalcBendMult - pitch multiplier for a bend, 1024 is no bend.
+ * A bent pitch is (pitch * mult + 512) >> 10.
+ */
+USHORT MidiChan_CalcBendMult(USHORT wBend, USHORT wBendRange)
+{
+    //!WARN iBend is int16 in OPL midi driver sample
+    int v5;
+
+    if ( wBend >= 0x3F80 ) wBend = 0x4000;
+    v5 = ((wBendRange * (((int)wBend - 0x2000))) >> 5) + 0x1800;
+    return (USHORT)((gwBendFine[(v5>>2)&0x3F] * gwBendCoarse[v5>>8]) >> 10);
+}
@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * midichan.h - MIDI channel state shared by the FM synths
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * The ESFM engine (natv.cpp) and the OPL3 path of the FM miniport keep
+ * their per channel controller state in a MIDICHAN and take channel
+ * messages apart with MidiChan_Message().  It updates the channel and
+ * tells the synth what to do about its voices, so a controller only has
+ * to be decoded once and the synths just deal with their chip.  Pitch
+ * bend math is shared the same way, see MidiChan_BendMult().
+ */
+
+#ifndef _MIDICHAN_H_
+#define _MIDICHAN_H_
+
+/* bHold */
+#define MIDICHAN_SUSTAIN        (0x01)          /* sustain pedal down */
+#define MIDICHAN_RPNLSB0        (0x02)          /* RPN LSB 0 selected */
+#define MIDICHAN_RPNMSB0        (0x04)          /* RPN MSB 0 selected */
+#define MIDICHAN_RPNBEND        (MIDICHAN_RPNLSB0 | MIDICHAN_RPNMSB0)
+
+#define MIDICHAN_BENDCENTER     (0x2000)
+#define MIDICHAN_MAXBENDRANGE   (24)            /* semitones, see MidiChan_CalcBendMult() */
+
+/* what MidiChan_Message() leaves to the synth */
+#define MIDIEV_NONE             (0)     /* nothing, the channel may have changed */
+#define MIDIEV_NOTEON           (1)     /* note and velocity are in the message */
+#define MIDIEV_NOTEOFF          (2)     /* also a note on with velocity 0 */
+#define MIDIEV_VOLUME           (3)     /* bVolume or bExpr changed */
+#define MIDIEV_PAN              (4)
+#define MIDIEV_BEND             (5)
+#define MIDIEV_SUSTAIN          (6)     /* pedal moved, release held voices if up */
+#define MIDIEV_PROGRAM          (7)     /* bProgram, the bank select is in bBankMsb/Lsb */
+#define MIDIEV_SOUNDOFF         (8)     /* CC120/124/125, cut off all voices */
+#define MIDIEV_NOTESOFF         (9)     /* CC123/126/127, release the voices not held */
+#define MIDIEV_RESETCTRL        (10)    /* CC121, pedal is up, release held voices */
+
+typedef struct _MIDICHAN {
+        BYTE    bProgram;
+        BYTE    bBankMsb;               /* bank select, CC0 and CC32 */
+        BYTE    bBankLsb;
+        BYTE    bVolume;                /* CC7 */
+        BYTE    bExpr;                  /* CC11 */
+        BYTE    bPan;                   /* CC10, CC8 is taken as pan too */
+        BYTE    bHold;                  /* MIDICHAN_SUSTAIN and RPN selection */
+        BYTE    bBendRange;             /* RPN 0, in semitones */
+        USHORT  wBend;                  /* 0-0x3FFF */
+        /* bend cache, see MidiChan_BendMult() */
+        USHORT  wBendMult;
+        USHORT  wBendKey;
+        BYTE    bBendKeyRange;          /* 0xFF if nothing cached */
+} MIDICHAN;
+
+VOID   MidiChan_Reset(MIDICHAN *pChan);
+int    MidiChan_Message(MIDICHAN *pChan, DWORD dwData);
+USHORT MidiChan_CalcBendMult(USHORT wBend, USHORT wBendRange);
+
+/*
+ * MidiChan_BendMult - the pitch multiplier for the current bend of a
+ * channel, see MidiChan_CalcBendMult().  Only computed again when bend
+ * or bend range have changed since last time.
+ */
+__inline USHORT MidiChan_BendMult(MIDICHAN *pChan)
+{
+    if (pChan->wBendKey != pChan->wBend || pChan->bBendKeyRange != pChan->bBendRange)
+    {
+        pChan->wBendKey = pChan->wBend;
+        pChan->bBendKeyRange = pChan->bBendRange;
+        pChan->wBendMult = MidiChan_CalcBendMult(pChan->wBend, pChan->bBendRange);
+    }
+    return pChan->wBendMult;
+}
+
+#endif
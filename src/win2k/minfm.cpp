@@ -6,8 +6,8 @@
 // ==============================================================================
 
 #include "minfm.h"    // contains class definitions.
+#include "fmtrace.h"
 #include "patch.h"
-#include "natv.h"
 #include "bank.h"
 
 #define STR_MODULENAME "fmsynth: "
@@ -62,15 +62,27 @@ static WORD BCODE gw2OpOffset[ NUM2VOICES ][ 2 ] =
      { 0x112,0x115 },
    } ;
 
+/* slots n and n + 3 (n = 0-2, 9-11) can be joined to a 4-operator voice,
+   or used for the two voices of a PATCH_2_2OP, see Opl3_FindEmptyPair() */
+#define PAIR_FIRST      (0x0E07UL)              /* first slot of each pair */
+#define PAIR_SECOND     (PAIR_FIRST << 3)
+
+/* second slots of the pairs joined in an AD_CONNECTION value */
+#define PAIR_4OPSECOND(c)       ((((DWORD)(c) & 0x07) << 3) | (((DWORD)(c) & 0x38) << 9))
+
+/* AD_CONNECTION bit of the pair a slot is in */
+static BYTE BCODE gbPairBit[ NUM2VOICES ] =
+   {
+     0x01,0x02,0x04,0x01,0x02,0x04,0x00,0x00,0x00,
+     0x08,0x10,0x20,0x08,0x10,0x20,0x00,0x00,0x00,
+   } ;
+
 /* pitch values, from middle c, to octave above it */
 static DWORD BCODE gdwPitch[12] = {
         PITCH(C), PITCH(CSHARP), PITCH(D), PITCH(DSHARP),
         PITCH(E), PITCH(F), PITCH(FSHARP), PITCH(G),
         PITCH(GSHARP), PITCH(A), PITCH(ASHARP), PITCH(B)};
 
-PUCHAR g_PortBase = NULL;
-BYTE * gBankMem = bank;
-
 // ==============================================================================
 // CreateMiniportMidiESFM()
 // Creates a MIDI FM miniport driver.  This uses a
@@ -178,18 +190,24 @@ PVOID * Object
 
     _DbgPrintF(DEBUGLVL_VERBOSE,("CMiniportMidiFM::NonDelegatingQueryInterface"));
 
+    // IMiniportMidi and IMiniportDMus both have an IMiniport,
+    // the one of IMiniportMidi stands for the object.
     if (IsEqualGUIDAligned(Interface,IID_IUnknown))
     {
-        *Object = PVOID(PUNKNOWN(PMINIPORT(this)));
+        *Object = PVOID(PUNKNOWN(PMINIPORTMIDI(this)));
     }
     else if (IsEqualGUIDAligned(Interface,IID_IMiniport))
     {
-        *Object = PVOID(PMINIPORT(this));
+        *Object = PVOID(PMINIPORT(PMINIPORTMIDI(this)));
     }
     else if (IsEqualGUIDAligned(Interface,IID_IMiniportMidi))
     {
         *Object = PVOID(PMINIPORTMIDI(this));
     }
+    else if (IsEqualGUIDAligned(Interface,IID_IMiniportDMus))
+    {
+        *Object = PVOID(PMINIPORTDMUS(this));
+    }
     else
     {
         *Object = NULL;
@@ -228,12 +246,67 @@ void
     {
         m_pAdapterCommon->Release();
     }
+    if (m_pBank)
+    {
+        KeWaitForSingleObject(&m_BankIdle, Executive, KernelMode, FALSE, NULL);
+        FmBank_Free(m_pBank);
+        ExFreePool(m_pBank);
+    }
+    while (m_ulBankViews)
+    {
+        m_ulBankViews--;
+        MmUnmapViewInSystemSpace(m_pBankView[m_ulBankViews]);
+        ObDereferenceObject(m_pBankSection[m_ulBankViews]);
+    }
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiFM::BankWant()
+// A note on wants a patch of an attached bank, which is decoded at
+// PASSIVE_LEVEL by BankWork().  Any IRQL up to DISPATCH_LEVEL.
+// ==============================================================================
+VOID
+CMiniportMidiFM::
+BankWant
+(
+    IN  PVOID   Context
+)
+{
+    CMiniportMidiFM *that = (CMiniportMidiFM *)Context;
+
+    if (InterlockedIncrement(&that->m_lBankWork) == 1)
+        KeClearEvent(&that->m_BankIdle);
+    ExQueueWorkItem(&that->m_BankWork, DelayedWorkQueue);
+}
+
+#pragma code_seg("PAGE")
+// ==============================================================================
+// CMiniportMidiFM::BankWork()
+// Work item, decodes the wanted patches from the bank file views.
+// ==============================================================================
+VOID
+CMiniportMidiFM::
+BankWork
+(
+    IN  PVOID   Context
+)
+{
+    CMiniportMidiFM *that = (CMiniportMidiFM *)Context;
+
+    PAGED_CODE();
+
+    ULONG ulPatches = FmBank_Fetch(that->m_pBank);
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("[BankWork] %d patches decoded", ulPatches));
+
+    if (!InterlockedDecrement(&that->m_lBankWork))
+        KeSetEvent(&that->m_BankIdle, 0, FALSE);
 }
 
 #pragma code_seg()
 // ==============================================================================
 // CMiniportMidiFM::Init()
-// Initializes a the miniport.
+// Initializes a the miniport for PortMidi.
 // ==============================================================================
 STDMETHODIMP_(NTSTATUS)
 CMiniportMidiFM::
@@ -247,6 +320,47 @@ Init
 {
     PAGED_CODE();
 
+    return InitMiniport(UnknownAdapter, ResourceList, Port_, ServiceGroup);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiFM::Init()
+// Initializes a the miniport for PortDMus.
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS)
+CMiniportMidiFM::
+Init
+(
+    IN      PUNKNOWN        UnknownAdapter,
+    IN      PRESOURCELIST   ResourceList,
+    IN      PPORTDMUS       Port_,
+    OUT     PSERVICEGROUP * ServiceGroup
+)
+{
+    PAGED_CODE();
+
+    m_fDMus = TRUE;
+    return InitMiniport(UnknownAdapter, ResourceList, Port_, ServiceGroup);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiFM::InitMiniport()
+// Initializes a the miniport, for either port.
+// ==============================================================================
+NTSTATUS
+CMiniportMidiFM::
+InitMiniport
+(
+    IN      PUNKNOWN        UnknownAdapter,
+    IN      PRESOURCELIST   ResourceList,
+    IN      PPORT           Port_,
+    OUT     PSERVICEGROUP * ServiceGroup
+)
+{
+    PAGED_CODE();
+
     ASSERT(UnknownAdapter);
     ASSERT(ResourceList);
     ASSERT(Port_);
@@ -258,6 +372,12 @@ Init
     m_Port = Port_;
     m_Port->AddRef();
 
+    FmPace_Init(&m_Pace, FM_OPL_DELAY);
+    m_fCoalesce = TRUE;
+    m_fDemote2nd = TRUE;
+    RtlFillMemory(m_bStealRank, sizeof(m_bStealRank), 0xFF);
+    m_ulLookahead = FM_LOOKAHEAD_MS;
+
     //
     // We want the IAdapterCommon interface on the adapter common object,
     // which is given to us as a IUnknown.  The QueryInterface call gives us
@@ -303,8 +423,36 @@ Init
                 KeStallExecutionProcessor(25);
                 WRITE_PORT_UCHAR(m_PortBase + 1, 0x80);
                 KeStallExecutionProcessor(25);
-                g_PortBase = m_PortBase;
-                fmreset();
+
+                // decode the banks once, for the note on path.  The built
+                // in bank is bank 0, unless the registry replaces it
+                KeInitializeEvent(&m_BankIdle, NotificationEvent, TRUE);
+                ExInitializeWorkItem(&m_BankWork, BankWork, this);
+                m_pBank = (FMBANK *)ExAllocatePool(NonPagedPool, sizeof(FMBANK));
+                if (m_pBank)
+                {
+                    FmBank_Init(m_pBank, BankWant, this);
+                    if (FmBank_Load(m_pBank, FMBANK_NUMBER(0, 0), bank, sizeof(bank)))
+                    {
+#ifdef LOAD_PATCHES
+                        LoadPatchLib();
+#endif
+#if (DBG)
+                        FMBANKINFO Info;
+
+                        for (int i = 0; FmBank_Query(m_pBank, i, &Info); i++)
+                        {
+                            _DbgPrintF(DEBUGLVL_TERSE, ("[FM16::Init] bank %d.%d: %d patches (%d not decoded yet), %d voices (%d shared), %d bytes",
+                                Info.wNumber >> 7, Info.wNumber & 0x7F, Info.ulPatches, Info.ulLazy, Info.ulVoices, Info.ulShared, Info.ulBytes));
+                        }
+                        _DbgPrintF(DEBUGLVL_TERSE, ("[FM16::Init] %d of %d pool voices used", m_pBank->ulVoices, FMBANK_VOICES));
+#endif
+                    }
+                    else
+                        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+                }
+                else
+                    ntStatus = STATUS_INSUFFICIENT_RESOURCES;
             }
         }
         else
@@ -357,6 +505,91 @@ NewStream
 
     PAGED_CODE();
 
+    CMiniportMidiStreamFM *pStream;
+    NTSTATUS ntStatus = CreateStream(&pStream, OuterUnknown, PoolType);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        *Stream = PMINIPORTMIDISTREAM(pStream);
+        (*Stream)->AddRef();
+
+        *ServiceGroup = NULL;
+
+        pStream->Release();
+    }
+
+    return ntStatus;
+}
+
+#pragma code_seg("PAGE")
+// ==============================================================================
+// NewStream()
+// Creates a new DirectMusic stream.  The port holds the events back
+// until m_ulLookahead before their presentation time, from there on the
+// stream plays them at their time, see CMiniportMidiStreamFM::PutMessage().
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS)
+CMiniportMidiFM::
+NewStream
+(
+    OUT     PMXF *                  MXF,
+    IN      PUNKNOWN                OuterUnknown    OPTIONAL,
+    IN      POOL_TYPE               PoolType,
+    IN      ULONG                   PinID,
+    IN      DMUS_STREAM_TYPE        StreamType,
+    IN      PKSDATAFORMAT           DataFormat,
+    OUT     PSERVICEGROUP *         ServiceGroup,
+    IN      PAllocatorMXF           AllocatorMXF,
+    IN      PMASTERCLOCK            MasterClock,
+    OUT     PULONGLONG              SchedulePreFetch
+)
+{
+    UNREFERENCED_PARAMETER(PinID);
+    UNREFERENCED_PARAMETER(DataFormat);
+
+    PAGED_CODE();
+
+    if (StreamType != DMUS_STREAM_MIDI_RENDER)
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    CMiniportMidiStreamFM *pStream;
+    NTSTATUS ntStatus = CreateStream(&pStream, OuterUnknown, PoolType);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        pStream->InitDMus(AllocatorMXF, MasterClock);
+
+        *MXF = PMXF(pStream);
+        (*MXF)->AddRef();
+
+        *ServiceGroup = NULL;
+        *SchedulePreFetch = (ULONGLONG)m_ulLookahead * 10000;
+
+        pStream->Release();
+    }
+
+    return ntStatus;
+}
+
+#pragma code_seg("PAGE")
+// ==============================================================================
+// CreateStream()
+// Creates the stream for NewStream(), there is only one at a time.
+// Returns it with a reference the caller has to release.
+// ==============================================================================
+NTSTATUS
+CMiniportMidiFM::
+CreateStream
+(
+    OUT     CMiniportMidiStreamFM **    Stream,
+    IN      PUNKNOWN                    OuterUnknown    OPTIONAL,
+    IN      POOL_TYPE                   PoolType
+)
+{
+    PAGED_CODE();
+
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
     if (m_fStreamExists)
@@ -376,14 +609,13 @@ NewStream
 
             if (NT_SUCCESS(ntStatus))
             {
-                *Stream = PMINIPORTMIDISTREAM(pStream);
-                (*Stream)->AddRef();
-
-                *ServiceGroup = NULL;
+                *Stream = pStream;
                 m_fStreamExists = TRUE;
             }
-
-            pStream->Release();
+            else
+            {
+                pStream->Release();
+            }
         }
         else
         {
@@ -467,6 +699,43 @@ PKSDATARANGE PinDataRangePointersStream[] =
     PKSDATARANGE(&PinDataRangesStream[0])
 };
 
+// ==============================================================================
+// PinDataRangesStreamDMus
+// Structures indicating range of valid format values for streaming pins
+// on PortDMus, which also takes legacy MIDI to DirectMusic events.
+// ==============================================================================
+static
+KSDATARANGE_MUSIC PinDataRangesStreamDMus[] =
+{
+    {
+        {
+            sizeof(KSDATARANGE_MUSIC),
+            0,
+            0,
+            0,
+            STATICGUIDOF(KSDATAFORMAT_TYPE_MUSIC),
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_DIRECTMUSIC),
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_NONE)
+        },
+        STATICGUIDOF(KSMUSIC_TECHNOLOGY_FMSYNTH),
+        NUM2VOICES,
+        NUM2VOICES,
+        0xffffffff
+    }
+};
+
+// ==============================================================================
+// PinDataRangePointersStreamDMus
+// List of pointers to structures indicating range of valid format values
+// for streaming pins on PortDMus.
+// ==============================================================================
+static
+PKSDATARANGE PinDataRangePointersStreamDMus[] =
+{
+    PKSDATARANGE(&PinDataRangesStream[0]),
+    PKSDATARANGE(&PinDataRangesStreamDMus[0])
+};
+
 // ==============================================================================
 // PinDataRangesBridge
 // Structures indicating range of valid format values for bridge pins.
@@ -539,6 +808,84 @@ PCPIN_DESCRIPTOR MiniportPins[] =
     }
 };
 
+// ==============================================================================
+// SynthProperties
+// DirectMusic asks for these to enumerate the synth.
+// ==============================================================================
+static
+PCPROPERTY_ITEM SynthProperties[] =
+{
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_CAPS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_Synth
+    },
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_PORTPARAMETERS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_Synth
+    },
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_CHANNELGROUPS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_Synth
+    },
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_LATENCYCLOCK,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_Synth
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationSynth, SynthProperties);
+
+// ==============================================================================
+// MiniportPinsDMus
+// List of pins on PortDMus.
+// ==============================================================================
+static
+PCPIN_DESCRIPTOR MiniportPinsDMus[] =
+{
+    {
+        1,1,1,  // InstanceCount
+        &AutomationSynth,   // AutomationTable
+        {       // KsPinDescriptor
+            0,                                          // InterfacesCount
+            NULL,                                       // Interfaces
+            0,                                          // MediumsCount
+            NULL,                                       // Mediums
+            SIZEOF_ARRAY(PinDataRangePointersStreamDMus),   // DataRangesCount
+            PinDataRangePointersStreamDMus,             // DataRanges
+            KSPIN_DATAFLOW_IN,                          // DataFlow
+            KSPIN_COMMUNICATION_SINK,                   // Communication
+            (GUID *) &KSCATEGORY_SYNTHESIZER,           // Category
+            NULL,                                       // Name
+            0                                           // Reserved
+        }
+    },
+    {
+        0,0,0,  // InstanceCount
+        NULL,   // AutomationTable
+        {       // KsPinDescriptor
+            0,                                          // InterfacesCount
+            NULL,                                       // Interfaces
+            0,                                          // MediumsCount
+            NULL,                                       // Mediums
+            SIZEOF_ARRAY(PinDataRangePointersBridge),   // DataRangesCount
+            PinDataRangePointersBridge,                 // DataRanges
+            KSPIN_DATAFLOW_OUT,                         // DataFlow
+            KSPIN_COMMUNICATION_NONE,                   // Communication
+            (GUID *) &KSCATEGORY_AUDIO,                 // Category
+            NULL,                                       // Name
+            0                                           // Reserved
+        }
+    }
+};
+
 // ==============================================================================
 // MiniportNodes
 // List of nodes.
@@ -611,6 +958,25 @@ PCCONNECTION_DESCRIPTOR MiniportConnections[] =
     {   eFMSynthNode,   eFMNodeOutput,  PCFILTER_NODE,  eBridgeOutput } // Synth to bridge out.
 };
 
+#ifdef FM_TRACE
+// ==============================================================================
+// FmTraceProperties
+// Replay of FM register write traces on the filter.
+// ==============================================================================
+static
+PCPROPERTY_ITEM FmTraceProperties[] =
+{
+    {
+        &KSPROPSETID_FmTrace,
+        KSPROPERTY_FMTRACE_REPLAY,
+        KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_FmTrace
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationFmTrace, FmTraceProperties);
+#endif
+
 // ==============================================================================
 // MiniportDescription
 // Complete description of the miniport.
@@ -619,7 +985,11 @@ static
 PCFILTER_DESCRIPTOR MiniportFilterDescriptor =
 {
     0,                                  // Version
+#ifdef FM_TRACE
+    &AutomationFmTrace,                 // AutomationTable
+#else
     NULL,                               // AutomationTable
+#endif
     sizeof(PCPIN_DESCRIPTOR),           // PinSize
     SIZEOF_ARRAY(MiniportPins),         // PinCount
     MiniportPins,                       // Pins
@@ -632,6 +1002,31 @@ PCFILTER_DESCRIPTOR MiniportFilterDescriptor =
     NULL                                // Categories
 };
 
+// ==============================================================================
+// MiniportFilterDescriptorDMus
+// Complete description of the miniport on PortDMus.
+// ==============================================================================
+static
+PCFILTER_DESCRIPTOR MiniportFilterDescriptorDMus =
+{
+    0,                                  // Version
+#ifdef FM_TRACE
+    &AutomationFmTrace,                 // AutomationTable
+#else
+    NULL,                               // AutomationTable
+#endif
+    sizeof(PCPIN_DESCRIPTOR),           // PinSize
+    SIZEOF_ARRAY(MiniportPinsDMus),     // PinCount
+    MiniportPinsDMus,                   // Pins
+    sizeof(PCNODE_DESCRIPTOR),          // NodeSize
+    1,                                  // NodeCount - no volume node
+    MiniportNodes,                      // Nodes
+    SIZEOF_ARRAY(MiniportConnections),  // ConnectionCount
+    MiniportConnections,                // Connections
+    0,                                  // CategoryCount
+    NULL                                // Categories
+};
+
 #pragma code_seg("PAGE")
 // ==============================================================================
 // CMiniportMidiFM::GetDescription()
@@ -649,20 +1044,236 @@ GetDescription
 
     ASSERT(OutFilterDescriptor);
 
-    *OutFilterDescriptor = &MiniportFilterDescriptor;
+    if (m_fDMus)
+        *OutFilterDescriptor = &MiniportFilterDescriptorDMus;
+    else
+        *OutFilterDescriptor = &MiniportFilterDescriptor;
 
     return STATUS_SUCCESS;
 }
 
 #pragma code_seg("PAGE")
 // ==============================================================================
-// CMiniportMidiStreamFM::NonDelegatingQueryInterface()
-// Obtains an interface.  This function works just like a COM QueryInterface
-// call and is used if the object is not being aggregated.
+// PropertyHandler_Synth()
+// Accesses the KSPROPSETID_Synth properties of the DirectMusic pin.  The
+// synth is fixed, so only the latency clock needs the stream.
 // ==============================================================================
-STDMETHODIMP_(NTSTATUS) CMiniportMidiStreamFM::NonDelegatingQueryInterface
+static
+NTSTATUS
+PropertyHandler_Synth
 (
-REFIID  Interface,
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE,("[PropertyHandler_Synth]"));
+
+    NTSTATUS        ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+    ULONG           ulSize;
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize >= sizeof(ULONG))
+        {
+            // return the access flags
+            *PULONG(PropertyRequest->Value) = PropertyRequest->PropertyItem->Flags;
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            ntStatus = STATUS_SUCCESS;
+        }
+        else
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+        return ntStatus;
+    }
+
+    switch (PropertyRequest->PropertyItem->Id)
+    {
+        case KSPROPERTY_SYNTH_CAPS:
+            ulSize = sizeof(SYNTHCAPS);
+            break;
+        case KSPROPERTY_SYNTH_PORTPARAMETERS:
+            ulSize = sizeof(SYNTH_PORTPARAMS);
+            if (PropertyRequest->InstanceSize < sizeof(SYNTH_PORTPARAMS))
+                return STATUS_INVALID_PARAMETER;
+            break;
+        case KSPROPERTY_SYNTH_CHANNELGROUPS:
+            ulSize = sizeof(ULONG);
+            break;
+        case KSPROPERTY_SYNTH_LATENCYCLOCK:
+            ulSize = sizeof(ULONGLONG);
+            break;
+        default:
+            return ntStatus;
+    }
+
+    if (PropertyRequest->ValueSize < ulSize)
+    {
+        // a size query has no buffer at all
+        ntStatus = PropertyRequest->ValueSize ? STATUS_BUFFER_TOO_SMALL : STATUS_BUFFER_OVERFLOW;
+        PropertyRequest->ValueSize = ulSize;
+        return ntStatus;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET)
+    {
+        // one channel group is all there is
+        if (PropertyRequest->PropertyItem->Id == KSPROPERTY_SYNTH_CHANNELGROUPS)
+            ntStatus = (*PULONG(PropertyRequest->Value) == 1) ?
+                STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+        return ntStatus;
+    }
+
+    switch (PropertyRequest->PropertyItem->Id)
+    {
+        case KSPROPERTY_SYNTH_CAPS:
+        {
+            static const WCHAR szDescription[] = L"ESS ES1969 FM Synth";
+            SYNTHCAPS *pCaps = (SYNTHCAPS *)PropertyRequest->Value;
+
+            RtlZeroMemory(pCaps, sizeof(SYNTHCAPS));
+            pCaps->Guid = CLSID_MiniportDriverESFMSynth;
+            pCaps->Flags = SYNTH_PC_GMINHARDWARE | SYNTH_PC_MEMORYSIZEFIXED;
+            pCaps->MaxChannelGroups = 1;
+            pCaps->MaxVoices = NUM2VOICES;
+            pCaps->MaxAudioChannels = 2;
+            pCaps->EffectFlags = SYNTH_EFFECT_NONE;
+            RtlCopyMemory(pCaps->Description, szDescription, sizeof(szDescription));
+            ntStatus = STATUS_SUCCESS;
+            break;
+        }
+
+        case KSPROPERTY_SYNTH_PORTPARAMETERS:
+        {
+            // take what was asked for, but there is only one channel group
+            SYNTH_PORTPARAMS *pParams = (SYNTH_PORTPARAMS *)PropertyRequest->Value;
+
+            RtlCopyMemory(pParams, PropertyRequest->Instance, sizeof(SYNTH_PORTPARAMS));
+            pParams->ValidParams &= SYNTH_PORTPARAMS_CHANNELGROUPS;
+            pParams->ChannelGroups = 1;
+            ntStatus = STATUS_SUCCESS;
+            break;
+        }
+
+        case KSPROPERTY_SYNTH_CHANNELGROUPS:
+            *PULONG(PropertyRequest->Value) = 1;
+            ntStatus = STATUS_SUCCESS;
+            break;
+
+        case KSPROPERTY_SYNTH_LATENCYCLOCK:
+        {
+            PMXF pMXF;
+
+            if (!PropertyRequest->MinorTarget)
+                break;
+            ntStatus = PropertyRequest->MinorTarget->QueryInterface(IID_IMXF, (PVOID *)&pMXF);
+            if (NT_SUCCESS(ntStatus))
+            {
+                ntStatus = ((CMiniportMidiStreamFM *)pMXF)->GetLatencyClock(PULONGLONG(PropertyRequest->Value));
+                pMXF->Release();
+            }
+            break;
+        }
+    }
+
+    if (NT_SUCCESS(ntStatus))
+        PropertyRequest->ValueSize = ulSize;
+
+    return ntStatus;
+}
+
+#ifdef FM_TRACE
+#pragma code_seg("PAGE")
+// ==============================================================================
+// PropertyHandler_FmTrace()
+// Plays the trace file in the value back on the chip, see fmtrace.h.  The
+// miniport counts as having a stream until the replay is done.
+// ==============================================================================
+static
+NTSTATUS
+PropertyHandler_FmTrace
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE,("[PropertyHandler_FmTrace]"));
+
+    NTSTATUS            ntStatus;
+    PMINIPORTMIDI       pMiniportMidi;
+    CMiniportMidiFM *   that;
+    const FMTRACEHDR *  pHdr;
+    FMTRACEPORT         Port;
+    ULONG               nRecords, nWrites;
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize >= sizeof(ULONG))
+        {
+            // return the access flags
+            *PULONG(PropertyRequest->Value) = PropertyRequest->PropertyItem->Flags;
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            ntStatus = STATUS_SUCCESS;
+        }
+        else
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+        return ntStatus;
+    }
+
+    if (!(PropertyRequest->Verb & KSPROPERTY_TYPE_SET))
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    pHdr = (const FMTRACEHDR *)PropertyRequest->Value;
+    if (PropertyRequest->InstanceSize < sizeof(ULONG) ||
+        PropertyRequest->ValueSize < sizeof(FMTRACEHDR) ||
+        pHdr->dwSignature != FMTRACE_SIGNATURE ||
+        pHdr->dwVersion != FMTRACE_VERSION)
+        return STATUS_INVALID_PARAMETER;
+    nRecords = (PropertyRequest->ValueSize - sizeof(FMTRACEHDR)) / sizeof(DWORD);
+
+    ntStatus = PropertyRequest->MajorTarget->QueryInterface(IID_IMiniportMidi, (PVOID *)&pMiniportMidi);
+    if (!NT_SUCCESS(ntStatus))
+        return ntStatus;
+    that = (CMiniportMidiFM *)pMiniportMidi;
+
+    if (that->m_fStreamExists)
+    {
+        ntStatus = STATUS_DEVICE_BUSY;
+    }
+    else
+    {
+        // set the chip up the way a stream does
+        that->m_fStreamExists = TRUE;
+        that->m_pAdapterCommon->StartESFM(TRUE);
+
+        Port.PortBase = that->m_PortBase;
+        Port.fESFM = that->m_fESFM;
+        nWrites = FmTrace_Replay((const DWORD *)(pHdr + 1), nRecords,
+            *PULONG(PropertyRequest->Instance), FmTrace_PortSink, &Port);
+        _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] trace replayed, %d register writes", nWrites));
+
+        that->m_pAdapterCommon->StartESFM(FALSE);
+        that->m_fStreamExists = FALSE;
+    }
+
+    pMiniportMidi->Release();
+    return ntStatus;
+}
+#endif
+
+#pragma code_seg("PAGE")
+// ==============================================================================
+// CMiniportMidiStreamFM::NonDelegatingQueryInterface()
+// Obtains an interface.  This function works just like a COM QueryInterface
+// call and is used if the object is not being aggregated.
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS) CMiniportMidiStreamFM::NonDelegatingQueryInterface
+(
+REFIID  Interface,
 PVOID * Object
 )
 {
@@ -680,6 +1291,11 @@ PVOID * Object
         *Object = PVOID(PMINIPORTMIDISTREAM(this));
     }
     else
+    if (IsEqualGUIDAligned(Interface,IID_IMXF))
+    {
+        *Object = PVOID(PMXF(this));
+    }
+    else
     {
         *Object = NULL;
     }
@@ -708,8 +1324,35 @@ void
 {
     PAGED_CODE();
 
+    if (m_AllocatorMXF)
+    {
+        // returns the queued events, then wait for a late EventDpc()
+        SetState(KSSTATE_STOP);
+        KeFlushQueuedDpcs();
+        if (m_Sched.dwOverflows)
+            _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] %d events played early or dropped, queue was full",
+                m_Sched.dwOverflows));
+        m_AllocatorMXF->Release();
+        if (m_MasterClock)
+            m_MasterClock->Release();
+    }
+
     if (m_Miniport) m_Miniport->m_pAdapterCommon->StartESFM(FALSE);
     Opl3_AllNotesOff();
+#ifdef FM_TRACE
+    FmTrace_Close();
+#endif
+
+    const FMSTATS *pStats = m_Engine.GetStats();
+    _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] %d messages: %d writes skipped, %d coalesced, %d written",
+        pStats->dwMessages, pStats->dwShadowHits, pStats->dwCoalesced, pStats->dwShadowMisses));
+    _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] %d port writes (%d address latches saved), %d us stalled, %d us overlapped",
+        pStats->dwPortWrites, pStats->dwLatchSkips, pStats->dwStallUs, pStats->dwSavedUs));
+    _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] %d bends and %d volume changes coalesced",
+        pStats->dwBendsCoalesced, pStats->dwVolumesCoalesced));
+    if (m_Miniport)
+        _DbgPrintF(DEBUGLVL_TERSE, ("[FM16] OPL3: %d us stalled, %d us overlapped",
+            m_Miniport->m_Pace.dwStallUs, m_Miniport->m_Pace.dwSavedUs));
 
     if (m_Miniport)
     {
@@ -745,24 +1388,95 @@ Init
     m_Miniport->AddRef();
     m_Miniport->m_pAdapterCommon->StartESFM(TRUE);
 
+#ifdef FM_TRACE
+    if (NT_SUCCESS(FmTrace_Open()))
+        FmTrace_Write(m_Miniport->m_fESFM ? FMTRACE_ESFM : FMTRACE_OPL3, 0);
+#endif
+
+    // StartESFM() has reset the chip, so start from a clean engine state
+    if (m_Miniport->m_fESFM)
+    {
+        m_Engine.Init(PortBase, m_Miniport->m_pBank);
+        m_Engine.SetCoalesce(m_Miniport->m_fCoalesce);
+        m_Engine.SetDemote2nd(m_Miniport->m_fDemote2nd);
+        for (i = 0; i < NUMCHANNELS; i++)
+            m_Engine.SetStealRank((BYTE)i, m_Miniport->m_bStealRank[i]);
+    }
+    else
+    {
+        // no pair starts out as a 4-operator voice
+        m_bConnection = 0;
+        m_Miniport->SoundMidiSendFM(PortBase, AD_CONNECTION, m_bConnection);
+    }
+
     m_wSynthAttenL = 0;        /* in 1.5dB steps */
     m_wSynthAttenR = 0;        /* in 1.5dB steps */
     m_PortBase = PortBase;
 
+    KeInitializeSpinLock(&m_EventLock);
+    KeInitializeTimer(&m_EventTimer);
+    KeInitializeDpc(&m_EventDpc, EventDpc, this);
+    FmSched_Init(&m_Sched);
+
     /* start attenuations at -3 dB, which is 90 MIDI level */
     for (i = 0; i < NUMCHANNELS; i++) 
     {
+        MidiChan_Reset(&m_Chan[i]);
+        m_dwChanHeld[i] = 0;
         m_bChanAtten[i] = 4;
         m_bStereoMask[i] = 0xff;
     };
 
+    /* all voices start out as unused voices of channel 0 */
+    m_dwChanVoices[0] = (1UL << NUM2VOICES) - 1;
+    m_dwUnusedSlots = (1UL << NUM2VOICES) - 1;
+    VoiceList_Init(&m_OffSlots);
+    VoiceList_Init(&m_OnSlots);
+    for (i = 0; i < 256; i++)
+        VoiceList_Init(&m_PatchSlots[i]);
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        m_Voice[i].bLink = VOICE_NIL;
+        VoiceList_Insert(&m_OffSlots, m_SlotLink, (BYTE)i, VOICE_NIL);
+    }
+
     return STATUS_SUCCESS;
 }
 
 #pragma code_seg("PAGE")
 // ==============================================================================
+// CMiniportMidiStreamFM::InitDMus()
+// Makes an initialized stream a DirectMusic one, which gets its events
+// through PutMessage().
+// ==============================================================================
+VOID
+CMiniportMidiStreamFM::
+InitDMus
+(
+    IN      PAllocatorMXF       AllocatorMXF,
+    IN      PMASTERCLOCK        MasterClock
+)
+{
+    PAGED_CODE();
+
+    ASSERT(AllocatorMXF);
+
+    m_AllocatorMXF = AllocatorMXF;
+    m_AllocatorMXF->AddRef();
+    m_MasterClock = MasterClock;
+    if (m_MasterClock)
+        m_MasterClock->AddRef();
+}
+
+#pragma code_seg()
+// ==============================================================================
 // CMiniportMidiStreamFM::SetState()
 // Sets the transport state.
+//
+// A DirectMusic stream plays its queued events only while running.  A
+// pause keeps them, to be played on the next run, only a stop drops them.
+// The system timer runs at 1 ms while running, or m_EventTimer would fire
+// up to a clock tick late.
 // ==============================================================================
 STDMETHODIMP_(NTSTATUS)
 CMiniportMidiStreamFM::
@@ -771,22 +1485,50 @@ SetState
     IN      KSSTATE     NewState
 )
 {
-    PAGED_CODE();
-
     NTSTATUS ntStatus = STATUS_SUCCESS;
+    KIRQL    OldIrql;
 
     switch (NewState)
     {
     case KSSTATE_STOP:
     case KSSTATE_ACQUIRE:
     case KSSTATE_PAUSE:
+        if (m_AllocatorMXF)
+        {
+            KeAcquireSpinLock(&m_EventLock, &OldIrql);
+            m_fRunning = FALSE;
+            KeCancelTimer(&m_EventTimer);
+            if (NewState == KSSTATE_STOP)
+                FreeEvents();
+        }
         if (m_Miniport->m_fESFM)
-            MidiAllNotesOff();
+            m_Engine.MidiAllNotesOff();
         else
             Opl3_AllNotesOff();
+        if (m_AllocatorMXF)
+        {
+            KeReleaseSpinLock(&m_EventLock, OldIrql);
+            if (m_fTimerRes)
+            {
+                ExSetTimerResolution(0, FALSE);
+                m_fTimerRes = FALSE;
+            }
+        }
         break;
 
     case KSSTATE_RUN:
+        if (m_AllocatorMXF)
+        {
+            if (!m_fTimerRes)
+            {
+                ExSetTimerResolution(10000, TRUE);
+                m_fTimerRes = TRUE;
+            }
+            KeAcquireSpinLock(&m_EventLock, &OldIrql);
+            m_fRunning = TRUE;
+            PlayEvents();
+            KeReleaseSpinLock(&m_EventLock, OldIrql);
+        }
         break;
     }
 
@@ -829,17 +1571,24 @@ IN    UCHAR Data
 {
     ASSERT(Address < 0x200);
 
+#ifdef FM_TRACE
+    FmTrace_Write((WORD)Address, Data);
+#endif
+
     // these delays need to be 23us at least for old opl2 chips, even
-    // though new chips can handle 1 us delays.
+    // though new chips can handle 1 us delays.  m_Pace only waits for
+    // the part of it that has not passed yet.
 
     _DbgPrintF(DEBUGLVL_VERBOSE, ("[MidiFM::SoundMidiSendFM]"));
     _DbgPrintF(DEBUGLVL_VERBOSE, ("[SoundMidiSendFM] Writing Address 0x%X ", Address));
+    FmPace_Wait(&m_Pace);
     WRITE_PORT_UCHAR(PortBase + (Address < 0x100 ? 0 : 2), (UCHAR)Address);
-    KeStallExecutionProcessor(23);
+    FmPace_Done(&m_Pace);
 
     _DbgPrintF(DEBUGLVL_VERBOSE, ("[SoundMidiSendFM] Writing Data 0x%X to ", Data));
+    FmPace_Wait(&m_Pace);
     WRITE_PORT_UCHAR(PortBase + (Address < 0x100 ? 1 : 3), Data);
-    KeStallExecutionProcessor(23);
+    FmPace_Done(&m_Pace);
 }
 
 #pragma code_seg()
@@ -879,16 +1628,10 @@ Read
 #pragma code_seg()
 // ==============================================================================
 // CMiniportMidiStreamFM::Write()
-// Writes outgoing MIDI data.  
-// 
-// N.B.!!!
-// THIS DATA SINK ASSUMES THAT DATA COMES IN ONE MESSAGE AT A TIME!!!
-// IF LENGTH IS MORE THAN THREE BYTES, SUCH AS SYSEX OR MULTIPLE MIDI 
-// MESSAGES, ALL THE DATA IS DROPPED UNCEREMONIOUSLY ON THE FLOOR!!!
-// ALSO DOES NOT PLAY WELL WITH RUNNING STATUS!!!
-// 
-// CLEARLY, THIS MINIPORT HAS SOME "ISSUES".
+// Writes outgoing MIDI data.
 //
+// The buffer is one batch for the ESFM synth: bends and volume changes
+// superseded within it never reach the chip, see MidiBatchBegin().
 // ==============================================================================
 STDMETHODIMP_(NTSTATUS)
 CMiniportMidiStreamFM::
@@ -902,22 +1645,390 @@ Write
     ASSERT(BufferAddress);
     ASSERT(BytesWritten);
 
-    if (Length <= 4)
+    if (m_Miniport->m_fESFM)
+        m_Engine.MidiBatchBegin();
+
+    ParseMidi((PUCHAR)BufferAddress, Length);
+
+    if (m_Miniport->m_fESFM)
+        m_Engine.MidiBatchEnd();
+
+    *BytesWritten = Length;
+
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::ParseMidi()
+// Passes MIDI data to the synth.
+//
+// The data is a MIDI byte stream, it may hold any number of messages
+// and use running status.  A message may also be split across calls,
+// the parser state is kept in the stream.  System realtime bytes can
+// appear anywhere and are dropped without affecting the message they
+// interrupt.  SysEx messages up to SYSEX_MAXLEN bytes are collected for
+// SendSysEx(), longer ones and system common messages are skipped.
+// Both cancel running status.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+ParseMidi
+(
+    IN      PUCHAR  pData,
+    IN      ULONG   Length
+)
+{
+    ULONG   i;
+    BYTE    bData;
+
+    for (i = 0; i < Length; i++)
+    {
+        bData = pData[i];
+
+        if (bData >= 0xf8)
+        {
+            /* system realtime, nothing for the synth */
+            continue;
+        }
+
+        if (m_fSysEx)
+        {
+            if (!(bData & 0x80) || bData == 0xf7)
+            {
+                if (m_ulSysExLen < SYSEX_MAXLEN)
+                    m_bSysEx[m_ulSysExLen] = bData;
+                m_ulSysExLen++;
+                if (bData != 0xf7)
+                    continue;
+                if (m_ulSysExLen <= SYSEX_MAXLEN)
+                    SendSysEx(m_bSysEx, m_ulSysExLen);
+                m_fSysEx = FALSE;
+                continue;
+            }
+            /* not terminated, drop it */
+            m_fSysEx = FALSE;
+        }
+
+        if (bData >= 0xf0)
+        {
+            /* SysEx or system common, skip up to the next status byte */
+            m_bRunStatus = 0;
+            m_bMsgPos = 0;
+            if (bData == 0xf0)
+            {
+                m_bSysEx[0] = bData;
+                m_ulSysExLen = 1;
+                m_fSysEx = TRUE;
+            }
+            continue;
+        }
+
+        if (bData & 0x80)
+        {
+            /* channel message */
+            m_bRunStatus = bData;
+            m_dwMsg = bData;
+            m_bMsgPos = 1;
+            m_bMsgLeft = ((bData & 0xe0) == 0xc0) ? 1 : 2;
+            continue;
+        }
+
+        if (!m_bMsgPos)
+        {
+            /* data byte without a status, or inside a SysEx */
+            if (!m_bRunStatus)
+                continue;
+            m_dwMsg = m_bRunStatus;
+            m_bMsgPos = 1;
+            m_bMsgLeft = ((m_bRunStatus & 0xe0) == 0xc0) ? 1 : 2;
+        }
+
+        m_dwMsg |= (DWORD)bData << (m_bMsgPos++ * 8);
+        if (!--m_bMsgLeft)
+        {
+            SendMidiMessage(m_dwMsg);
+            m_bMsgPos = 0;
+        }
+    }
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::SendMidiMessage()
+// Hands a complete channel message to the synth in use.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+SendMidiMessage(DWORD dwData)
+{
+#ifdef FM_TRACE
+    FmTrace_Write(FMTRACE_MESSAGE, (BYTE)dwData);
+#endif
+    if (m_Miniport->m_fESFM)
+        m_Engine.MidiMessage(dwData);
+    else
+        WriteMidiData(dwData);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::SendSysEx()
+// Hands a complete SysEx message to the synth in use.  Only the ESFM
+// synth knows any, the OPL3 path ignores them.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+SendSysEx(PUCHAR pData, ULONG ulLength)
+{
+    if (m_Miniport->m_fESFM)
+        m_Engine.MidiSysEx(pData, ulLength);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::PutMessage()
+// Takes a chain of DirectMusic events.
+//
+// The events wait in m_Sched for their presentation time.  While the
+// stream runs, the ones that are due already are played right away,
+// otherwise they wait for SetState(KSSTATE_RUN).  Only channel group 1
+// exists, events for other groups are dropped.
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS)
+CMiniportMidiStreamFM::
+PutMessage
+(
+    IN      PDMUS_KERNEL_EVENT  pDMKEvt
+)
+{
+    PDMUS_KERNEL_EVENT  pEvent;
+    KIRQL               OldIrql;
+
+    KeAcquireSpinLock(&m_EventLock, &OldIrql);
+
+    while (pDMKEvt)
     {
-        RtlCopyMemory(&Length, BufferAddress, Length);
-        if (Length & 0x80)
+        pEvent = pDMKEvt;
+        pDMKEvt = pEvent->pNextEvt;
+        pEvent->pNextEvt = NULL;
+
+        if (pEvent->usChannelGroup > 1)
         {
-            if (m_Miniport->m_fESFM)
-                MidiMessage(Length);
+            FreeEvent(pEvent);
+            continue;
+        }
+        if (!FmSched_Put(&m_Sched, pEvent->ullPresTime100ns, pEvent))
+        {
+            /* full, make room by playing the first event early, or
+               dropping it if the stream does not run */
+            m_Sched.dwOverflows++;
+            if (m_fRunning)
+                PlayEvent((PDMUS_KERNEL_EVENT)FmSched_Pop(&m_Sched));
             else
-                WriteMidiData(Length);
+                FreeEvent((PDMUS_KERNEL_EVENT)FmSched_Pop(&m_Sched));
+            FmSched_Put(&m_Sched, pEvent->ullPresTime100ns, pEvent);
         }
     }
-    *BytesWritten = Length;
-    
+
+    PlayEvents();
+
+    KeReleaseSpinLock(&m_EventLock, OldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::PlayEvents()
+// Plays the queued events that are due and sets m_EventTimer for the next
+// one.  Events less than FM_EARLYPLAY_100NS ahead count as due, waiting
+// for them would take longer than their distance.  The events played
+// together are one batch for the ESFM synth, see MidiBatchBegin().
+// Nothing is played unless the stream runs.  Called with m_EventLock held.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+PlayEvents(VOID)
+{
+    ULONGLONG       ullNow, ullNext;
+    LARGE_INTEGER   DueTime;
+    BOOL            fBatch = FALSE;
+
+    if (!m_fRunning || !m_Sched.ulCount)
+        return;
+
+    GetLatencyClock(&ullNow);
+
+    while (FmSched_Next(&m_Sched, &ullNext) && ullNext < ullNow + FM_EARLYPLAY_100NS)
+    {
+        if (!fBatch && m_Miniport->m_fESFM)
+        {
+            m_Engine.MidiBatchBegin();
+            fBatch = TRUE;
+        }
+        PlayEvent((PDMUS_KERNEL_EVENT)FmSched_Pop(&m_Sched));
+    }
+
+    if (fBatch)
+        m_Engine.MidiBatchEnd();
+
+    if (FmSched_Next(&m_Sched, &ullNext))
+    {
+        /* relative due time */
+        DueTime.QuadPart = -(LONGLONG)(ullNext - ullNow);
+        KeSetTimer(&m_EventTimer, DueTime, &m_EventDpc);
+    }
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::PlayEvent()
+// Passes the data of an event to the synth and frees it.  A package is
+// a chain of events to play in one go.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+PlayEvent
+(
+    IN      PDMUS_KERNEL_EVENT  pEvent
+)
+{
+    PDMUS_KERNEL_EVENT  pPart;
+
+    if (PACKAGE_EVT(pEvent))
+    {
+        for (pPart = pEvent->uData.pPackageEvt; pPart; pPart = pPart->pNextEvt)
+            ParseMidi(SHORT_EVT(pPart) ? pPart->uData.abData : pPart->uData.pbData,
+                pPart->cbEvent);
+    }
+    else
+        ParseMidi(SHORT_EVT(pEvent) ? pEvent->uData.abData : pEvent->uData.pbData,
+            pEvent->cbEvent);
+
+    FreeEvent(pEvent);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::FreeEvent()
+// Gives an event back to the allocator, with its package if it has one.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+FreeEvent
+(
+    IN      PDMUS_KERNEL_EVENT  pEvent
+)
+{
+    if (PACKAGE_EVT(pEvent) && pEvent->uData.pPackageEvt)
+    {
+        m_AllocatorMXF->PutMessage(pEvent->uData.pPackageEvt);
+        pEvent->uData.pPackageEvt = NULL;
+    }
+    m_AllocatorMXF->PutMessage(pEvent);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::FreeEvents()
+// Drops all queued events.  Called with m_EventLock held.
+// ==============================================================================
+void
+CMiniportMidiStreamFM::
+FreeEvents(VOID)
+{
+    PDMUS_KERNEL_EVENT  pEvent;
+
+    while ((pEvent = (PDMUS_KERNEL_EVENT)FmSched_Pop(&m_Sched)) != NULL)
+        FreeEvent(pEvent);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::EventDpc()
+// m_EventTimer has expired, play what is due.
+// ==============================================================================
+VOID
+CMiniportMidiStreamFM::
+EventDpc
+(
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
+)
+{
+    CMiniportMidiStreamFM *that = (CMiniportMidiStreamFM *)DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    KeAcquireSpinLockAtDpcLevel(&that->m_EventLock);
+    that->PlayEvents();
+    KeReleaseSpinLockFromDpcLevel(&that->m_EventLock);
+}
+
+#pragma code_seg()
+// ==============================================================================
+// CMiniportMidiStreamFM::GetLatencyClock()
+// Gets the time of the master clock, events before it are due.
+// ==============================================================================
+NTSTATUS
+CMiniportMidiStreamFM::
+GetLatencyClock
+(
+    OUT     PULONGLONG  pullTime
+)
+{
+    REFERENCE_TIME  rtNow = 0;
+
+    if (m_MasterClock)
+        m_MasterClock->GetTime(&rtNow);
+    *pullTime = (ULONGLONG)rtNow;
+
     return STATUS_SUCCESS;
 }
 
+#pragma code_seg("PAGE")
+// ==============================================================================
+// CMiniportMidiStreamFM::ConnectOutput()
+// The render stream has no output.
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS)
+CMiniportMidiStreamFM::
+ConnectOutput
+(
+    IN      PMXF    sinkMXF
+)
+{
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(sinkMXF);
+
+    return STATUS_NOT_IMPLEMENTED;
+}
+
+#pragma code_seg("PAGE")
+// ==============================================================================
+// CMiniportMidiStreamFM::DisconnectOutput()
+// The render stream has no output.
+// ==============================================================================
+STDMETHODIMP_(NTSTATUS)
+CMiniportMidiStreamFM::
+DisconnectOutput
+(
+    IN      PMXF    sinkMXF
+)
+{
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(sinkMXF);
+
+    return STATUS_NOT_IMPLEMENTED;
+}
+
 // ==============================================================================
 // ==============================================================================
 // Private Methods of CMiniportMidiFM
@@ -1061,6 +2172,7 @@ IN PUCHAR inbase
     SoundMidiSendFM(base, AD_MASK, 0x60);             // mask T1 & T2
     SoundMidiSendFM(base, AD_MASK, 0x80);             // reset IRQ
 
+    FmPace_Wait(&m_Pace);
     t1 = READ_PORT_UCHAR((PUCHAR)inbase);       // read status register
 
     SoundMidiSendFM(base, AD_TIMER2, 0xff);             // set timer - 1 latch
@@ -1108,35 +2220,30 @@ void
 CMiniportMidiStreamFM::
 WriteMidiData(DWORD dwData)
 {
-    BYTE    bMsgType,bChannel, bVelocity, bNote;
-    WORD    wTemp;
+    BYTE    bChannel, bVelocity, bNote;
+    MIDICHAN *pChan;
 
-    bMsgType = (BYTE) dwData & (BYTE)0xf0;
     bChannel = (BYTE) dwData & (BYTE)0x0f;
     bNote = (BYTE) ((WORD) dwData >> 8) & (BYTE)0x7f;
     bVelocity = (BYTE) (dwData >> 16) & (BYTE)0x7f;
+    pChan = &m_Chan[bChannel];
     
     _DbgPrintF(DEBUGLVL_VERBOSE,("[MidiFM::WriteMidiData]"));
 
-    switch (bMsgType)
+    switch (MidiChan_Message(pChan, dwData))
     {
-        case 0x90:      /* turn key on, or key off if volume == 0 */
-            if (bVelocity)
+        case MIDIEV_NOTEON:
+            if (bChannel == DRUMCHANNEL)
             {
-                if (bChannel == DRUMCHANNEL)
-                {
-                    Opl3_NoteOn((BYTE)(bNote + 128),bNote,bChannel,bVelocity,(short)m_iBend[bChannel]);
-                }
-                else
-                {
-                    Opl3_NoteOn((BYTE)m_bPatch[bChannel],bNote,bChannel,bVelocity,(short) m_iBend[bChannel]);
-                }
-                break;
-            } // if bVelocity.
-            //NOTE: no break specified here. On an else case we want to continue through and turn key off
+                Opl3_NoteOn((BYTE)(bNote + 128),bNote,bChannel,bVelocity);
+            }
+            else
+            {
+                Opl3_NoteOn(pChan->bProgram,bNote,bChannel,bVelocity);
+            }
+            break;
 
-        case 0x80:
-            /* turn key off */
+        case MIDIEV_NOTEOFF:
             //  we don't care what the velocity is on note off
             if (bChannel == DRUMCHANNEL)
             {
@@ -1144,40 +2251,45 @@ WriteMidiData(DWORD dwData)
             }
             else
             {
-                Opl3_NoteOff ((BYTE) m_bPatch[bChannel],bNote, bChannel);
+                Opl3_NoteOff(pChan->bProgram,bNote, bChannel);
             }
             break;
 
-        case 0xb0:
-            /* change control */
-            switch (bNote) 
-            {
-                case 7:
-                    /* change channel volume */
-                    Opl3_ChannelVolume(bChannel,gbVelocityAtten[bVelocity >> 1]);
-                    break;
-
-                case 8:
-                case 10:
-                    /* change the pan level */
-                    Opl3_SetPan(bChannel, bVelocity);
-                    break;
-            };
+        case MIDIEV_VOLUME:
+            /* change channel volume, expression attenuates on top of it */
+            Opl3_ChannelVolume(bChannel,(WORD)(gbVelocityAtten[pChan->bVolume >> 2] +
+                                               gbVelocityAtten[pChan->bExpr >> 2]));
             break;
 
-        case 0xc0:
-            if (bChannel != DRUMCHANNEL)
-            {
-               m_bPatch[ bChannel ] = bNote ;
+        case MIDIEV_PAN:
+            /* change the pan level */
+            Opl3_SetPan(bChannel, pChan->bPan);
+            break;
 
-            }
+        case MIDIEV_BEND:
+            Opl3_PitchBend(bChannel);
+            break;
+
+        case MIDIEV_SUSTAIN:
+            if (!(pChan->bHold & MIDICHAN_SUSTAIN))
+                Opl3_SlotsOff(m_dwChanHeld[bChannel]);
             break;
 
-        case 0xe0:  // pitch bend
-            wTemp = ((WORD) bVelocity << 9) | ((WORD) bNote << 2);
-            m_iBend[bChannel] = (short) (WORD) (wTemp + 0x8000);
-            Opl3_PitchBend(bChannel, m_iBend[bChannel]);
+        case MIDIEV_SOUNDOFF:
+            Opl3_SlotsOff(m_dwChanVoices[bChannel]);
+            break;
 
+        case MIDIEV_NOTESOFF:
+            Opl3_ChannelNotesOff(bChannel);
+            break;
+
+        case MIDIEV_RESETCTRL:
+            /* the pedal is up and volume, pan and bend are back to default */
+            Opl3_SlotsOff(m_dwChanHeld[bChannel]);
+            m_bChanAtten[bChannel] = (BYTE)(gbVelocityAtten[pChan->bVolume >> 2] +
+                                            gbVelocityAtten[pChan->bExpr >> 2]);
+            Opl3_SetPan(bChannel, pChan->bPan);
+            Opl3_PitchBend(bChannel);
             break;
     };
     
@@ -1193,12 +2305,76 @@ void
 CMiniportMidiStreamFM::
 Opl3_AllNotesOff()
 {
-    BYTE i;
+    // the sustain pedal does not hold anything here
+    Opl3_SlotsOff((1UL << NUM2VOICES) - 1);
+}
 
-    for (i = 0; i < NUM2VOICES; i++) 
-    {
-        Opl3_NoteOff(m_Voice[i].bPatch, m_Voice[i].bNote, m_Voice[i].bChannel);
-    }
+#pragma code_seg()
+// ==========================================================================
+//  void Opl3_SlotsOff
+//
+//  Description:
+//     Keys off the note slots of a mask that are on, no matter if
+//     they are held by the sustain pedal.
+//
+//  Parameters:
+//     DWORD dwMask
+//        note slots, bit n stands for m_Voice[n]
+//
+//  Return Value:
+//     Nothing.
+// ==========================================================================
+void 
+CMiniportMidiStreamFM::
+Opl3_SlotsOff
+(
+    DWORD           dwMask
+)
+{
+   ULONG            i ;
+
+   while (_BitScanForward(&i, dwMask))
+   {
+      dwMask &= dwMask - 1 ;
+      if (m_Voice[ i ].bOn)
+         Opl3_SlotOff( (BYTE)i ) ;
+   }
+}
+
+#pragma code_seg()
+// ==========================================================================
+//  void Opl3_ChannelNotesOff
+//
+//  Description:
+//     Releases all notes of a channel, as if there was a note off
+//     for each of them.  With the sustain pedal down they are held.
+//
+//  Parameters:
+//     BYTE bChannel
+//        MIDI channel
+//
+//  Return Value:
+//     Nothing.
+// ==========================================================================
+void 
+CMiniportMidiStreamFM::
+Opl3_ChannelNotesOff
+(
+    BYTE            bChannel
+)
+{
+   ULONG            i ;
+   DWORD            dwMask ;
+
+   // The second slot of a pair goes with the first one,
+   // so it is either off or held when its turn comes.
+   dwMask = m_dwChanVoices[ bChannel ] & ~m_dwChanHeld[ bChannel ] ;
+   while (_BitScanForward(&i, dwMask))
+   {
+      dwMask &= dwMask - 1 ;
+      if (m_Voice[ i ].bOn && !m_Voice[ i ].bSusHeld)
+         Opl3_ReleaseSlot( (BYTE)i ) ;
+   }
 }
 
 #pragma code_seg()
@@ -1233,30 +2409,124 @@ Opl3_NoteOff
     BYTE            bChannel
 )
 {
-   UNREFERENCED_PARAMETER(bPatch);
-
-   WORD             wOffset, wTemp ;
-
-   // Find the note slot
-   wTemp = Opl3_FindFullSlot( bNote, bChannel ) ;
+   UNREFERENCED_PARAMETER(bPatch);
+
+   WORD             wTemp ;
+
+   // Find the note slot
+   wTemp = Opl3_FindFullSlot( bNote, bChannel ) ;
+
+   if (wTemp != 0xffff)
+      Opl3_ReleaseSlot( (BYTE)wTemp ) ;
+}
+
+#pragma code_seg()
+// ==========================================================================
+//  void Opl3_ReleaseSlot
+//
+//  Description:
+//     Releases the note of a slot, and the second voice if the note
+//     has one.  If the sustain pedal of its channel is down, the note
+//     keeps sounding until the pedal comes up, see m_dwChanHeld.
+//
+//  Parameters:
+//     BYTE bSlot
+//        note slot, must be on
+//
+//  Return Value:
+//     Nothing.
+// ==========================================================================
+void 
+CMiniportMidiStreamFM::
+Opl3_ReleaseSlot
+(
+    BYTE            bSlot
+)
+{
+   BYTE             bChannel, bLink ;
+
+   bChannel = m_Voice[ bSlot ].bChannel ;
+   bLink = m_Voice[ bSlot ].bLink ;
+   if (!(m_Chan[ bChannel ].bHold & MIDICHAN_SUSTAIN))
+   {
+      Opl3_SlotOff( bSlot ) ;
+      if (bLink != VOICE_NIL)
+         Opl3_SlotOff( bLink ) ;
+      return ;
+   }
+
+   // Held notes are no longer found by their note, another
+   // one on the same key gets its own note off.
+   m_dwNoteOn[ bChannel ][ m_Voice[ bSlot ].bNote ] &= ~(1UL << bSlot) ;
+   m_Voice[ bSlot ].bSusHeld = TRUE ;
+   m_dwChanHeld[ bChannel ] |= 1UL << bSlot ;
+   if (bLink != VOICE_NIL)
+   {
+      m_Voice[ bLink ].bSusHeld = TRUE ;
+      m_dwChanHeld[ bChannel ] |= 1UL << bLink ;
+   }
+}
+
+#pragma code_seg()
+// ==========================================================================
+//  void Opl3_SlotOff
+//
+//  Description:
+//     Keys off a note slot and moves it over to the notes off.
+//     The slot stays in its pair, if any.
+//
+//  Parameters:
+//     BYTE bSlot
+//        note slot, must be on
+//
+//  Return Value:
+//     Nothing.
+// ==========================================================================
+void 
+CMiniportMidiStreamFM::
+Opl3_SlotOff
+(
+    BYTE            bSlot
+)
+{
+   WORD             wOffset ;
+   BYTE             bBefore, bPrev ;
 
-   if (wTemp != 0xffff)
+   // shut off the note portion, the second slot of
+   // a 4-operator voice is keyed by the first one.
+   if (!((1UL << bSlot) & PAIR_4OPSECOND( m_bConnection )))
    {
-      // shut off the note portion
-      // we have the note slot, turn it off.
-      wOffset = wTemp;
-      if (wTemp >= (NUM2VOICES / 2))
+      wOffset = bSlot;
+      if (bSlot >= (NUM2VOICES / 2))
          wOffset += (0x100 - (NUM2VOICES / 2));
 
       m_Miniport->SoundMidiSendFM(m_PortBase, AD_BLOCK + wOffset,
-                  (BYTE)(m_Voice[ wTemp ].bBlock[ 0 ] & 0x1f) ) ;
+                  (BYTE)(m_Voice[ bSlot ].bBlock[ 0 ] & 0x1f) ) ;
+   }
 
-      // Note this...
-      m_Voice[ wTemp ].bOn = FALSE ;
-      m_Voice[ wTemp ].bBlock[ 0 ] &= 0x1f ;
-      m_Voice[ wTemp ].bBlock[ 1 ] &= 0x1f ;
-      m_Voice[ wTemp ].dwTime = m_dwCurTime ;
+   // Note this...
+   m_dwNoteOn[ m_Voice[ bSlot ].bChannel ][ m_Voice[ bSlot ].bNote ] &= ~(1UL << bSlot) ;
+   m_dwChanHeld[ m_Voice[ bSlot ].bChannel ] &= ~(1UL << bSlot) ;
+   m_Voice[ bSlot ].bSusHeld = FALSE ;
+   m_Voice[ bSlot ].bOn = FALSE ;
+   m_Voice[ bSlot ].bBlock[ 0 ] &= 0x1f ;
+   m_Voice[ bSlot ].bBlock[ 1 ] &= 0x1f ;
+   m_Voice[ bSlot ].dwTime = m_dwCurTime ;
+
+   // Move it over to the notes off.  Those turned off since
+   // the last note on have the same time, keep them in slot order.
+   VoiceList_Remove(&m_OnSlots, m_SlotLink, bSlot) ;
+   VoiceList_Remove(&m_PatchSlots[ m_Voice[ bSlot ].bPatch ], m_PatchLink, bSlot) ;
+   bBefore = VOICE_NIL ;
+   bPrev = m_OffSlots.bTail ;
+   while (bPrev != VOICE_NIL && bPrev > bSlot && m_Voice[ bPrev ].dwTime == m_dwCurTime)
+   {
+      bBefore = bPrev ;
+      bPrev = m_SlotLink[ bPrev ].bPrev ;
    }
+   VoiceList_Insert(&m_OffSlots, m_SlotLink, bSlot, bBefore) ;
+   if (m_dwCurTime)
+      m_dwUnusedSlots &= ~(1UL << bSlot) ;
 }
 
 #pragma code_seg()
@@ -1288,18 +2558,12 @@ Opl3_FindFullSlot
     BYTE            bChannel
 )
 {
-   WORD  i ;
+   ULONG  i ;
+
+   if (_BitScanForward(&i, m_dwNoteOn[ bChannel ][ bNote ]))
+      return ( (WORD)i ) ;
 
-   for (i = 0; i < NUM2VOICES; i++)
-   {
-      if ((bChannel == m_Voice[ i ].bChannel) 
-            && (bNote == m_Voice[ i ].bNote) 
-            && (m_Voice[ i ].bOn))
-      {
-            return ( i ) ;
-      }
    // couldn't find it
-   }
    return ( 0xFFFF ) ;
 } 
 
@@ -1319,6 +2583,10 @@ Opl3_FindFullSlot
 //        structure containing information about what
 //        is to be played.
 //
+//     BOOL fPair
+//        TRUE to play both voices of the patch, on wNote and
+//        wNote + 3, see Opl3_FindEmptyPair()
+//
 //  Return Value:
 //     Nothing.
 //------------------------------------------------------------------------
@@ -1327,28 +2595,43 @@ CMiniportMidiStreamFM::
 Opl3_FMNote
 (
     WORD                wNote,
-    noteStruct FAR *    lpSN
+    noteStruct FAR *    lpSN,
+    BOOL                fPair
 )
 {
-   WORD            i ;
+   WORD            i, j ;
    WORD            wOffset ;
+   BYTE            bConnection ;
    operStruct FAR  *lpOS ;
 
    // write out a note off, just to make sure...
 
-   wOffset = wNote;
-   if (wNote >= (NUM2VOICES / 2))
-      wOffset += (0x100 - (NUM2VOICES / 2));
+   for (j = 0; j < (WORD)(fPair ? 2 : 1); j++)
+   {
+      wOffset = wNote + j * 3;
+      if (wOffset >= (NUM2VOICES / 2))
+         wOffset += (0x100 - (NUM2VOICES / 2));
+
+      m_Miniport->SoundMidiSendFM(m_PortBase, AD_BLOCK + wOffset, 0 ) ;
+   }
+
+   // join or split the pair the slot is in
 
-   m_Miniport->SoundMidiSendFM(m_PortBase, AD_BLOCK + wOffset, 0 ) ;
+   bConnection = m_bConnection & ~gbPairBit[ wNote ] ;
+   if (fPair && lpSN -> bOp == PATCH_1_4OP)
+      bConnection |= gbPairBit[ wNote ] ;
+   if (bConnection != m_bConnection)
+   {
+      m_bConnection = bConnection ;
+      m_Miniport->SoundMidiSendFM(m_PortBase, AD_CONNECTION, m_bConnection ) ;
+   }
 
    // writing the operator information
 
-//   for (i = 0; i < (WORD)((wNote < NUM4VOICES) ? NUMOPS : 2); i++)
-   for (i = 0; i < 2; i++)
+   for (i = 0; i < (WORD)(fPair ? NUMOPS : 2); i++)
    {
       lpOS = &lpSN -> op[ i ] ;
-      wOffset = gw2OpOffset[ wNote ][ i ] ;
+      wOffset = gw2OpOffset[ wNote + (i / 2) * 3 ][ i % 2 ] ;
       m_Miniport->SoundMidiSendFM( m_PortBase, 0x20 + wOffset, lpOS -> bAt20) ;
       m_Miniport->SoundMidiSendFM( m_PortBase, 0x40 + wOffset, lpOS -> bAt40) ;
       m_Miniport->SoundMidiSendFM( m_PortBase, 0x60 + wOffset, lpOS -> bAt60) ;
@@ -1357,14 +2640,25 @@ Opl3_FMNote
 
    }
 
-   // write out the voice information
-   wOffset = (wNote < 9) ? wNote : (wNote + 0x100 - 9) ;
-   m_Miniport->SoundMidiSendFM(m_PortBase, 0xa0 + wOffset, lpSN -> bAtA0[ 0 ] ) ;
-   m_Miniport->SoundMidiSendFM(m_PortBase, 0xc0 + wOffset, lpSN -> bAtC0[ 0 ] ) ;
+   // write out the voice information, second slot first.  A
+   // 4-operator voice only takes the connection from that one.
+
+   for (j = (WORD)(fPair ? 2 : 1); j-- > 0; )
+   {
+      wOffset = wNote + j * 3;
+      wOffset = (wOffset < 9) ? wOffset : (wOffset + 0x100 - 9) ;
+      if (j && (bConnection & gbPairBit[ wNote ]))
+      {
+         m_Miniport->SoundMidiSendFM(m_PortBase, 0xc0 + wOffset, lpSN -> bAtC0[ j ] ) ;
+         continue;
+      }
+      m_Miniport->SoundMidiSendFM(m_PortBase, 0xa0 + wOffset, lpSN -> bAtA0[ j ] ) ;
+      m_Miniport->SoundMidiSendFM(m_PortBase, 0xc0 + wOffset, lpSN -> bAtC0[ j ] ) ;
 
-   // Note on...
-   m_Miniport->SoundMidiSendFM(m_PortBase, 0xb0 + wOffset,
-               (BYTE)(lpSN -> bAtB0[ 0 ] | 0x20) ) ;
+      // Note on...
+      m_Miniport->SoundMidiSendFM(m_PortBase, 0xb0 + wOffset,
+                  (BYTE)(lpSN -> bAtB0[ j ] | 0x20) ) ;
+   }
 
 } // end of Opl3_FMNote()
 
@@ -1390,9 +2684,6 @@ Opl3_FMNote
 //     BYTE bVelocity
 //        velocity value
 //
-//     short iBend
-//        current pitch bend from -32768 to 32767
-//
 //  Return Value:
 //     WORD
 //        note slot #, or 0xFFFF if it is inaudible
@@ -1404,12 +2695,12 @@ Opl3_NoteOn
     BYTE            bPatch,
     BYTE            bNote,
     BYTE            bChannel,
-    BYTE            bVelocity,
-    short           iBend
+    BYTE            bVelocity
 )
 {
-   WORD             wTemp, i, j ;
+   WORD             wTemp, wTemp2, i, j ;
    BYTE             b4Op, bTemp, bMode, bStereo ;
+   USHORT           wMult ;
    patchStruct FAR  *lpPS ;
    DWORD            dwBasicPitch, dwPitch[ 2 ] ;
    noteStruct       NS ;
@@ -1432,8 +2723,19 @@ Opl3_NoteOn
    // the total level and pitch according to
    // the velocity, midi volume, and tuning.
 
+   wMult = MidiChan_BendMult( &m_Chan[ bChannel ] ) ;
+
    RtlCopyMemory( (LPSTR) &NS, (LPSTR) &lpPS -> note, sizeof( noteStruct ) ) ;
-   b4Op = (BYTE)(NS.bOp != PATCH_1_2OP) ;
+
+   // A patch with two voices needs a pair of slots, it only
+   // gets one if that does not cut off a sounding note.  Else
+   // it makes do with its first voice, like a 2-operator patch.
+   wTemp = 0xFFFF ;
+   if (NS.bOp != PATCH_1_2OP)
+      wTemp = Opl3_FindEmptyPair() ;
+   b4Op = (BYTE)(wTemp != 0xFFFF) ;
+   if (!b4Op)
+      wTemp = Opl3_FindEmptySlot( bPatch ) ;
 
    for (j = 0; j < 2; j++)
    {
@@ -1445,25 +2747,25 @@ Opl3_NoteOn
       else if (bTemp < 4)
          dwPitch[ j ] = AsULSHR( dwPitch[ j ], (BYTE)((BYTE)4 - bTemp) ) ;
 
-      wTemp = Opl3_CalcFAndB( Opl3_CalcBend( dwPitch[ j ], iBend ) ) ;
-      NS.bAtA0[ j ] = (BYTE) wTemp ;
-      NS.bAtB0[ j ] = (BYTE) 0x20 | (BYTE) (wTemp >> 8) ;
+      wTemp2 = Opl3_CalcFAndB( Opl3_CalcBend( dwPitch[ j ], wMult ) ) ;
+      NS.bAtA0[ j ] = (BYTE) wTemp2 ;
+      NS.bAtB0[ j ] = (BYTE) 0x20 | (BYTE) (wTemp2 >> 8) ;
    }
 
    // Modify level for each operator, but only
    // if they are carrier waves
 
-   bMode = (BYTE) ((NS.bAtC0[ 0 ] & 0x01) * 2 + 4) ;
+   bMode = Opl3_CalcMode( &NS, b4Op ) ;
 
-   for (i = 0; i < 2; i++)
+   for (i = 0; i < (WORD)(b4Op ? NUMOPS : 2); i++)
    {
-      wTemp = (BYTE) 
+      wTemp2 = (BYTE) 
           Opl3_CalcVolume(  (BYTE)(NS.op[ i ].bAt40 & (BYTE) 0x3f),
                             bChannel, 
                             bVelocity, 
                             (BYTE) i, 
                             bMode ) ;
-      NS.op[ i ].bAt40 = (NS.op[ i ].bAt40 & (BYTE)0xc0) | (BYTE) wTemp ;
+      NS.op[ i ].bAt40 = (NS.op[ i ].bAt40 & (BYTE)0xc0) | (BYTE) wTemp2 ;
    }
 
    // Do stereo panning, but cutting off a left or
@@ -1471,26 +2773,94 @@ Opl3_NoteOn
 
    bStereo = Opl3_CalcStereoMask( bChannel ) ;
    NS.bAtC0[ 0 ] &= bStereo ;
+   NS.bAtC0[ 1 ] &= bStereo ;
 
-   // Find an empty slot, and use it...
-   wTemp = Opl3_FindEmptySlot( bPatch ) ;
+   // Free the slots, and use them...
+   Opl3_TakeSlot( (BYTE)wTemp ) ;
+   if (b4Op)
+      Opl3_TakeSlot( (BYTE)(wTemp + 3) ) ;
 
-   Opl3_FMNote(wTemp, &NS ) ;
-   m_Voice[ wTemp ].bNote = bNote ;
-   m_Voice[ wTemp ].bChannel = bChannel ;
-   m_Voice[ wTemp ].bPatch = bPatch ;
-   m_Voice[ wTemp ].bVelocity = bVelocity ;
-   m_Voice[ wTemp ].bOn = TRUE ;
-   m_Voice[ wTemp ].dwTime = m_dwCurTime++ ;
-   m_Voice[ wTemp ].dwOrigPitch[0] = dwPitch[ 0 ] ;  // not including bend
-   m_Voice[ wTemp ].dwOrigPitch[1] = dwPitch[ 1 ] ;  // not including bend
-   m_Voice[ wTemp ].bBlock[0] = NS.bAtB0[ 0 ] ;
-   m_Voice[ wTemp ].bBlock[1] = NS.bAtB0[ 1 ] ;
-   m_Voice[ wTemp ].bSusHeld = 0;
+   Opl3_FMNote(wTemp, &NS, b4Op ) ;
+
+   // Move the slots in the voice index, and to the
+   // tail of the notes on.  Only the first one is
+   // looked up by the note.
+   m_dwNoteOn[ bChannel ][ bNote ] |= 1UL << wTemp ;
+   for (j = 0; j < (WORD)(b4Op ? 2 : 1); j++)
+   {
+      bTemp = (BYTE)(wTemp + j * 3) ;
+      m_dwChanVoices[ bChannel ] |= 1UL << bTemp ;
+      VoiceList_Insert(&m_OnSlots, m_SlotLink, bTemp, VOICE_NIL) ;
+      VoiceList_Insert(&m_PatchSlots[ bPatch ], m_PatchLink, bTemp, VOICE_NIL) ;
+      if (m_dwCurTime)
+         m_dwUnusedSlots &= ~(1UL << bTemp) ;
+
+      m_Voice[ bTemp ].bNote = bNote ;
+      m_Voice[ bTemp ].bChannel = bChannel ;
+      m_Voice[ bTemp ].bPatch = bPatch ;
+      m_Voice[ bTemp ].bVelocity = bVelocity ;
+      m_Voice[ bTemp ].bOn = TRUE ;
+      m_Voice[ bTemp ].bLink = b4Op ? (BYTE)(wTemp + (1 - j) * 3) : VOICE_NIL ;
+      m_Voice[ bTemp ].dwTime = m_dwCurTime ;
+      m_Voice[ bTemp ].dwOrigPitch[0] = dwPitch[ j ] ;  // not including bend
+      m_Voice[ bTemp ].dwOrigPitch[1] = dwPitch[ 1 - j ] ;  // not including bend
+      m_Voice[ bTemp ].bBlock[0] = NS.bAtB0[ j ] ;
+      m_Voice[ bTemp ].bBlock[1] = NS.bAtB0[ 1 - j ] ;
+      m_Voice[ bTemp ].bSusHeld = 0;
+   }
+   m_dwCurTime++ ;
 
 
 } // end of Opl3_NoteOn()
 
+#pragma code_seg()
+//=======================================================================
+//  void Opl3_TakeSlot
+//
+//  Description:
+//     Takes a note slot out of the voice index for a new note.  If
+//     the slot is in a pair, the other voice of its note is turned
+//     off, as it can not go on alone.
+//
+//  Parameters:
+//     BYTE bSlot
+//        note slot
+//
+//  Return Value:
+//     Nothing.
+//=======================================================================
+void 
+CMiniportMidiStreamFM::
+Opl3_TakeSlot
+(
+    BYTE            bSlot
+)
+{
+   BYTE             bLink ;
+
+   bLink = m_Voice[ bSlot ].bLink ;
+   if (bLink != VOICE_NIL)
+   {
+      if (m_Voice[ bLink ].bOn)
+         Opl3_SlotOff( bLink ) ;
+      m_Voice[ bLink ].bLink = VOICE_NIL ;
+      m_Voice[ bSlot ].bLink = VOICE_NIL ;
+   }
+
+   if (m_Voice[ bSlot ].bOn)
+   {
+      m_dwNoteOn[ m_Voice[ bSlot ].bChannel ][ m_Voice[ bSlot ].bNote ] &= ~(1UL << bSlot) ;
+      VoiceList_Remove(&m_OnSlots, m_SlotLink, bSlot) ;
+      VoiceList_Remove(&m_PatchSlots[ m_Voice[ bSlot ].bPatch ], m_PatchLink, bSlot) ;
+   }
+   else
+   {
+      VoiceList_Remove(&m_OffSlots, m_SlotLink, bSlot) ;
+   }
+   m_dwChanVoices[ m_Voice[ bSlot ].bChannel ] &= ~(1UL << bSlot) ;
+   m_dwChanHeld[ m_Voice[ bSlot ].bChannel ] &= ~(1UL << bSlot) ;
+}
+
 #pragma code_seg()
 //=======================================================================
 //Opl3_CalcFAndB - Calculates the FNumber and Block given a frequency.
@@ -1526,30 +2896,41 @@ Opl3_CalcFAndB(DWORD dwPitch)
 //
 //inputs
 //        DWORD   dwOrig - original frequency
-//        short   iBend - from -32768 to 32768, -2 half steps to +2
+//        USHORT  wMult - bend multiplier, see MidiChan_BendMult()
 //returns
 //        DWORD - new frequency
 //=======================================================================
 DWORD 
 CMiniportMidiStreamFM::
-Opl3_CalcBend (DWORD dwOrig, short iBend)
+Opl3_CalcBend (DWORD dwOrig, USHORT wMult)
 {
-    DWORD   dw;
-  
-    /* do different things depending upon positive or
-        negative bend */
-    if (iBend > 0)
-    {
-        dw = (DWORD)((iBend * (LONG)(256.0 * (EQUAL * EQUAL - 1.0))) >> 8);
-        dwOrig += (DWORD)(AsULMUL(dw, dwOrig) >> 15);
-    }
-    else if (iBend < 0)
-    {
-        dw = (DWORD)(((-iBend) * (LONG)(256.0 * (1.0 - 1.0 / EQUAL / EQUAL))) >> 8);
-        dwOrig -= (DWORD)(AsULMUL(dw, dwOrig) >> 15);
-    }
+    return (DWORD)((AsULMUL(dwOrig, wMult) + 512) >> 10);
+}
+
 
-    return dwOrig;
+#pragma code_seg()
+//=======================================================================
+// Opl3_CalcMode - This finds the voice mode of a patch for Opl3_CalcVolume.
+//
+//inputs
+//        noteStruct *lpNS - the patch
+//        BOOL    fPair - TRUE if both voices of the patch are played
+//returns
+//        BYTE - voice mode
+//=======================================================================
+BYTE 
+CMiniportMidiStreamFM::
+Opl3_CalcMode(noteStruct FAR *lpNS, BOOL fPair)
+{
+    BYTE        bMode;
+
+    if (!fPair)
+        return (BYTE)((lpNS->bAtC0[0] & 0x01) * 2 + 4);
+
+    bMode = (BYTE)((lpNS->bAtC0[0] & 0x01) * 2 + (lpNS->bAtC0[1] & 0x01));
+    if (lpNS->bOp == PATCH_2_2OP)
+        bMode += 4;
+    return bMode;
 }
 
 
@@ -1595,7 +2976,7 @@ Opl3_CalcVolume(BYTE bOrigAtten,BYTE bChannel,BYTE bVelocity,BYTE bOper,BYTE bMo
                 bVolume = (BYTE)(bOper >= 1);
                 break;
         case 6:
-                bVolume = (BYTE)(bOper <= 2);
+                bVolume = (BYTE)(bOper != 2);
                 break;
         case 7:
                 bVolume = TRUE;
@@ -1611,7 +2992,7 @@ Opl3_CalcVolume(BYTE bOrigAtten,BYTE bChannel,BYTE bVelocity,BYTE bOper,BYTE bMo
     wTemp = bOrigAtten + 
             ((wMin << 1) +
             m_bChanAtten[bChannel] + 
-            gbVelocityAtten[bVelocity >> 1]);
+            gbVelocityAtten[bVelocity >> 2]);
     return (wTemp > 0x3f) ? (BYTE) 0x3f : (BYTE) wTemp;
 }
 
@@ -1660,48 +3041,52 @@ Opl3_SetVolume
     BYTE   bChannel
 )
 {
-   WORD            i, j, wTemp, wOffset ;
+   ULONG           i ;
+   WORD            j, wTemp, wOffset ;
    noteStruct FAR  *lpPS ;
-   BYTE            bMode, bStereo ;
+   BYTE            bMode, bStereo, bHalf, bOper ;
+   DWORD           dwMask ;
 
    // Make sure that we are actually open...
    if (!glpPatch)
       return ;
 
-   // Loop through all the notes looking for the right
-   // channel.  Anything with the right channel gets
-   // its pitch bent.
-   for (i = 0; i < NUM2VOICES; i++)
+   // Every voice last used by the channel gets its
+   // volume and pan redone.
+   dwMask = (bChannel == 0xff) ? ((1UL << NUM2VOICES) - 1) : m_dwChanVoices[ bChannel ] ;
+   while (_BitScanForward(&i, dwMask))
    {
-      if ((m_Voice[ i ].bChannel == bChannel) || (bChannel == 0xff))
+      dwMask &= dwMask - 1 ;
+
+      // Get a pointer to the patch, the second slot
+      // of a pair plays its operators 2 and 3.
+      lpPS = &(glpPatch + m_Voice[ i ].bPatch) -> note ;
+      bHalf = (BYTE) (((1UL << i) & PAIR_SECOND) && m_Voice[ i ].bLink != VOICE_NIL) ;
+
+      // Modify level for each operator, IF they are carrier waves...
+      bMode = Opl3_CalcMode( lpPS, m_Voice[ i ].bLink != VOICE_NIL ) ;
+
+      for (j = 0; j < 2; j++)
       {
-         // Get a pointer to the patch
-         lpPS = &(glpPatch + m_Voice[ i ].bPatch) -> note ;
-
-         // Modify level for each operator, IF they are carrier waves...
-         bMode = (BYTE) ( (lpPS->bAtC0[0] & 0x01) * 2 + 4);
-
-         for (j = 0; j < 2; j++)
-         {
-            wTemp = (BYTE) Opl3_CalcVolume(
-               (BYTE) (lpPS -> op[j].bAt40 & (BYTE) 0x3f),
-               m_Voice[i].bChannel, m_Voice[i].bVelocity, 
-               (BYTE) j,            bMode ) ;
-
-            // Write new value.
-            wOffset = gw2OpOffset[ i ][ j ] ;
-            m_Miniport->SoundMidiSendFM(
-               m_PortBase, 0x40 + wOffset,
-               (BYTE) ((lpPS -> op[j].bAt40 & (BYTE)0xc0) | (BYTE) wTemp) ) ;
-         }
-
-         // Do stereo pan, but cut left or right channel if needed.
-         bStereo = Opl3_CalcStereoMask( m_Voice[ i ].bChannel ) ;
-         wOffset = i;
-         if (i >= (NUM2VOICES / 2))
-             wOffset += (0x100 - (NUM2VOICES / 2));
-         m_Miniport->SoundMidiSendFM(m_PortBase, 0xc0 + wOffset, (BYTE)(lpPS -> bAtC0[ 0 ] & bStereo) ) ;
+         bOper = (BYTE) (bHalf * 2 + j) ;
+         wTemp = (BYTE) Opl3_CalcVolume(
+            (BYTE) (lpPS -> op[bOper].bAt40 & (BYTE) 0x3f),
+            m_Voice[i].bChannel, m_Voice[i].bVelocity, 
+            bOper,               bMode ) ;
+
+         // Write new value.
+         wOffset = gw2OpOffset[ i ][ j ] ;
+         m_Miniport->SoundMidiSendFM(
+            m_PortBase, 0x40 + wOffset,
+            (BYTE) ((lpPS -> op[bOper].bAt40 & (BYTE)0xc0) | (BYTE) wTemp) ) ;
       }
+
+      // Do stereo pan, but cut left or right channel if needed.
+      bStereo = Opl3_CalcStereoMask( m_Voice[ i ].bChannel ) ;
+      wOffset = (WORD)i;
+      if (i >= (NUM2VOICES / 2))
+          wOffset += (0x100 - (NUM2VOICES / 2));
+      m_Miniport->SoundMidiSendFM(m_PortBase, 0xc0 + wOffset, (BYTE)(lpPS -> bAtC0[ bHalf ] & bStereo) ) ;
    }
 } // end of Opl3_SetVolume
 
@@ -1744,10 +3129,7 @@ Opl3_SetPan(BYTE bChannel, BYTE bPan)
 //
 //  Parameters:
 //     BYTE bChannel
-//        channel
-//
-//     short iBend
-//        values from -32768 to 32767, being -2 to +2 half steps
+//        channel, its bend and bend range are in m_Chan[]
 //
 //  Return Value:
 //     Nothing.
@@ -1756,30 +3138,31 @@ void
 CMiniportMidiStreamFM::
 Opl3_PitchBend
 (
-    BYTE        bChannel,
-    short        iBend
+    BYTE        bChannel
 )
 {
-   WORD   i, wTemp[ 2 ], wOffset, j ;
-   DWORD  dwNew ;
-
-   // Remember the current bend..
-   m_iBend[ bChannel ] = iBend ;
-
-   // Loop through all the notes looking for 
-   // the correct channel.  Anything with the 
-   // correct channel gets its pitch bent...
-   for (i = 0; i < NUM2VOICES; i++)
-      if (m_Voice[ i ].bChannel == bChannel)
+   ULONG  i ;
+   WORD   wTemp[ 2 ], wOffset, j ;
+   DWORD  dwNew, dwMask ;
+   USHORT wMult ;
+
+   wMult = MidiChan_BendMult( &m_Chan[ bChannel ] ) ;
+
+   // Every voice last used by the channel
+   // gets its pitch bent, but for the second slot of a
+   // 4-operator voice, which plays at the pitch of the first.
+   dwMask = m_dwChanVoices[ bChannel ] & ~PAIR_4OPSECOND( m_bConnection ) ;
+   while (_BitScanForward(&i, dwMask))
       {
+         dwMask &= dwMask - 1 ;
          j = 0 ;
-         dwNew = Opl3_CalcBend( m_Voice[ i ].dwOrigPitch[ j ], iBend ) ;
+         dwNew = Opl3_CalcBend( m_Voice[ i ].dwOrigPitch[ j ], wMult ) ;
          wTemp[ j ] = Opl3_CalcFAndB( dwNew ) ;
          m_Voice[ i ].bBlock[ j ] =
             (m_Voice[ i ].bBlock[ j ] & (BYTE) 0xe0) |
                (BYTE) (wTemp[ j ] >> 8) ;
 
-         wOffset = i;
+         wOffset = (WORD)i;
          if (i >= (NUM2VOICES / 2))
              wOffset += (0x100 - (NUM2VOICES / 2));
 
@@ -1848,53 +3231,75 @@ WORD
 CMiniportMidiStreamFM::
 Opl3_FindEmptySlot(BYTE bPatch)
 {
-   WORD   i, found ;
-   DWORD  dwOldest ;
+   ULONG  i ;
+   DWORD  dwPairs ;
 
-   // First, look for a slot with a time == 0
-   for (i = 0;  i < NUM2VOICES; i++)
-      if (!m_Voice[ i ].dwTime)
-         return ( i ) ;
+   // First, look for a slot with a time == 0.  Try
+   // not to split a pair that is unused as a whole.
+   dwPairs = m_dwUnusedSlots & PAIR_FIRST & (m_dwUnusedSlots >> 3) ;
+   if (_BitScanForward(&i, m_dwUnusedSlots & ~(dwPairs | (dwPairs << 3))))
+      return ( (WORD)i ) ;
+   if (_BitScanForward(&i, m_dwUnusedSlots))
+      return ( (WORD)i ) ;
 
    // Now, look for a slot of the oldest off-note
-   dwOldest = 0xffffffff ;
-   found = 0xffff ;
-
-   for (i = 0; i < NUM2VOICES; i++)
-      if (!m_Voice[ i ].bOn && (m_Voice[ i ].dwTime < dwOldest))
-      {
-         dwOldest = m_Voice[ i ].dwTime ;
-         found = i ;
-      }
-   if (found != 0xffff)
-      return ( found ) ;
+   if (m_OffSlots.bHead != VOICE_NIL)
+      return ( m_OffSlots.bHead ) ;
 
    // Now, look for a slot of the oldest note with
    // the same patch
-   dwOldest = 0xffffffff ;
-   found = 0xffff ;
-   for (i = 0; i < NUM2VOICES; i++)
-      if ((m_Voice[ i ].bPatch == bPatch) && (m_Voice[ i ].dwTime < dwOldest))
-      {
-         dwOldest = m_Voice[ i ].dwTime ;
-         found = i ;
-      }
-   if (found != 0xffff)
-      return ( found ) ;
+   if (m_PatchSlots[ bPatch ].bHead != VOICE_NIL)
+      return ( m_PatchSlots[ bPatch ].bHead ) ;
 
    // Now, just look for the oldest voice
-   found = 0 ;
-   dwOldest = m_Voice[ found ].dwTime ;
-   for (i = (found + 1); i < NUM2VOICES; i++)
-      if (m_Voice[ i ].dwTime < dwOldest)
+   return ( m_OnSlots.bHead ) ;
+
+} // end of Opl3_FindEmptySlot()
+
+#pragma code_seg()
+//------------------------------------------------------------------------
+//  WORD Opl3_FindEmptyPair
+//
+//  Description:
+//     This finds a pair of note-slots for a patch with two voices.
+//     Only pairs with both slots off are taken, the one that has
+//     been off for the longest time.  So a patch like that never
+//     costs the other notes more than a single voice would.
+//
+//  Return Value:
+//     WORD
+//        first note slot of the pair, or 0xFFFF if there is none
+//------------------------------------------------------------------------
+WORD 
+CMiniportMidiStreamFM::
+Opl3_FindEmptyPair(VOID)
+{
+   ULONG  i ;
+   DWORD  dwMask, dwTime, dwBest ;
+   WORD   wBest ;
+
+   wBest = 0xFFFF ;
+   dwBest = 0 ;
+   dwMask = PAIR_FIRST ;
+   while (_BitScanForward(&i, dwMask))
+   {
+      dwMask &= dwMask - 1 ;
+      if (m_Voice[ i ].bOn || m_Voice[ i + 3 ].bOn)
+         continue ;
+
+      dwTime = m_Voice[ i ].dwTime ;
+      if (dwTime < m_Voice[ i + 3 ].dwTime)
+         dwTime = m_Voice[ i + 3 ].dwTime ;
+      if (wBest == 0xFFFF || dwTime < dwBest)
       {
-         dwOldest = m_Voice[ i ].dwTime ;
-         found = i ;
+         wBest = (WORD)i ;
+         dwBest = dwTime ;
       }
+   }
 
-   return ( found ) ;
+   return ( wBest ) ;
 
-} // end of Opl3_FindEmptySlot()
+} // end of Opl3_FindEmptyPair()
 
 // Custom extension to load different patch-set
 #ifdef LOAD_PATCHES
@@ -1927,81 +3332,89 @@ GetRegistrySettings
         ULONG           ResultLength;
         PKEY_VALUE_PARTIAL_INFORMATION PartialInfo;
         
-        // allocate data to hold key info
-        PVOID KeyInfo = ExAllocatePool(PagedPool, sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(WCHAR) * MAX_PATH);
+        // allocate data to hold key info, a DWORD or the steal ranks
+        PVOID KeyInfo = ExAllocatePool(PagedPool, sizeof(KEY_VALUE_PARTIAL_INFORMATION) + NUMCHANNELS);
         if(NULL != KeyInfo)
         {
-            RtlInitUnicodeString( &KeyName, INI_STR_PATCHLIB );
+            RtlInitUnicodeString(&KeyName, INI_STR_COALESCE);
             ResultLength = 0;
 
             // query the value key
-            ntStatus = DriverKey->QueryValueKey( &KeyName,
-                                                   KeyValuePartialInformation,
-                                                   KeyInfo,
-                                                   sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(WCHAR) * MAX_PATH,
-                                                   &ResultLength );
-            if(NT_SUCCESS(ntStatus))
+            ntStatus = DriverKey->QueryValueKey(&KeyName,
+                KeyValuePartialInformation,
+                KeyInfo,
+                sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD),
+                &ResultLength);
+            if (NT_SUCCESS(ntStatus))
             {
                 PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(KeyInfo);
 
-                // If this is a valid bank file with appropriate size, read it and overwrite internal bank data
-                if (PartialInfo->Type == REG_SZ)
+                // 0 sends every bend and volume change to the chip
+                if (PartialInfo->Type == REG_DWORD)
+                    m_fCoalesce = *((PDWORD)PartialInfo->Data) != 0;
+            }
+
+            RtlInitUnicodeString(&KeyName, INI_STR_LOOKAHEAD);
+            ResultLength = 0;
+
+            // query the value key
+            ntStatus = DriverKey->QueryValueKey(&KeyName,
+                KeyValuePartialInformation,
+                KeyInfo,
+                sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD),
+                &ResultLength);
+            if (NT_SUCCESS(ntStatus))
+            {
+                PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(KeyInfo);
+
+                // in ms, more is safer against late events, less follows
+                // a live player more closely
+                if (PartialInfo->Type == REG_DWORD)
                 {
-                    FILE_STANDARD_INFORMATION FileStandardInformationBlock;
-                    OBJECT_ATTRIBUTES ObjectAttributes;
-                    IO_STATUS_BLOCK IoStatusBlock;
-                    UNICODE_STRING UnicodeString;
-                    HANDLE hFile = NULL;
-
-                    NTSTATUS status = STATUS_SUCCESS;
-
-                    RtlInitUnicodeString(&UnicodeString, (PCWSTR)PartialInfo->Data);
-                    InitializeObjectAttributes(&ObjectAttributes,
-                                               &UnicodeString,
-                                               OBJ_CASE_INSENSITIVE,
-                                               NULL,
-                                               NULL);
-
-                    status =    ZwCreateFile(&hFile,
-                                                GENERIC_READ,
-                                                &ObjectAttributes,
-                                                &IoStatusBlock,
-                                                0,
-                                                FILE_ATTRIBUTE_NORMAL,
-                                                FILE_SHARE_READ,
-                                                FILE_OPEN,
-                                                FILE_SYNCHRONOUS_IO_NONALERT,
-                                                NULL,
-                                                0);
-
-                    
-                    if (NT_SUCCESS(status))
-                    {
-                        if (NT_SUCCESS(ZwQueryInformationFile(hFile,
-                            &IoStatusBlock,
-                            &FileStandardInformationBlock,
-                            sizeof(FileStandardInformationBlock),
-                            FileStandardInformation)))
-                        {
-                            ASSERT(FileStandardInformationBlock.EndOfFile.HighPart == 0);
-
-                            if (FileStandardInformationBlock.EndOfFile.LowPart == sizeof(bank))
-                            {
-                                ZwReadFile(hFile,
-                                    NULL,
-                                    NULL,
-                                    NULL,
-                                    &IoStatusBlock,
-                                    bank,
-                                    sizeof(bank),
-                                    NULL,
-                                    NULL);
-                            }
-                        }
-                        ZwClose(hFile);
-                    }
+                    m_ulLookahead = *((PDWORD)PartialInfo->Data);
+                    if (m_ulLookahead > FM_MAXLOOKAHEAD_MS)
+                        m_ulLookahead = FM_MAXLOOKAHEAD_MS;
                 }
-            } 
+            }
+
+            RtlInitUnicodeString(&KeyName, INI_STR_STEALRANKS);
+            ResultLength = 0;
+
+            // query the value key
+            ntStatus = DriverKey->QueryValueKey(&KeyName,
+                KeyValuePartialInformation,
+                KeyInfo,
+                sizeof(KEY_VALUE_PARTIAL_INFORMATION) + NUMCHANNELS,
+                &ResultLength);
+            if (NT_SUCCESS(ntStatus))
+            {
+                PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(KeyInfo);
+
+                // a byte per channel from channel 1 on, channels with a
+                // higher rank lose their voices first; 16 and up, or no
+                // byte for the channel, keeps its default rank
+                if (PartialInfo->Type == REG_BINARY && PartialInfo->DataLength <= NUMCHANNELS)
+                    RtlCopyMemory(m_bStealRank, PartialInfo->Data, PartialInfo->DataLength);
+            }
+
+            RtlInitUnicodeString(&KeyName, INI_STR_DEMOTE2ND);
+            ResultLength = 0;
+
+            // query the value key
+            ntStatus = DriverKey->QueryValueKey(&KeyName,
+                KeyValuePartialInformation,
+                KeyInfo,
+                sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD),
+                &ResultLength);
+            if (NT_SUCCESS(ntStatus))
+            {
+                PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(KeyInfo);
+
+                // 0 lets the second voice of a two voice patch compete
+                // with the other voices of its channel
+                if (PartialInfo->Type == REG_DWORD)
+                    m_fDemote2nd = *((PDWORD)PartialInfo->Data) != 0;
+            }
 
 #if 0  // NB: Not really neaded, StartESFM() puts us in ESFM-mode anyway!
             RtlInitUnicodeString(&KeyName, L"ForceESFM");
@@ -2033,4 +3446,211 @@ GetRegistrySettings
         DriverKey->Release();
     }
 }
+
+/*****************************************************************************
+ * CMiniportMidiFM::LoadPatchLib
+ *****************************************************************************
+ * Loads the banks listed in the Patches value, a REG_SZ or REG_MULTI_SZ
+ * of NT paths to bank files.  A path can be preceded by the bank select
+ * number it is for, "<MSB>=" or "<MSB>.<LSB>=".  Without a number the
+ * bank replaces the built in bank 0.  The files are mapped and attached,
+ * their patches are only decoded when they are first used.
+ */
+VOID
+CMiniportMidiFM::
+LoadPatchLib
+(   void
+)
+{
+    PREGISTRYKEY    DriverKey;
+    NTSTATUS        ntStatus;
+
+    // open the driver registry key
+    ntStatus = m_Port->NewRegistryKey( &DriverKey,               // IRegistryKey
+                                        NULL,                     // OuterUnknown
+                                        DriverRegistryKey,        // Registry key type
+                                        KEY_ALL_ACCESS,           // Access flags
+                                        NULL,                     // ObjectAttributes
+                                        0,                        // Create options
+                                        NULL );                   // Disposition
+    if(NT_SUCCESS(ntStatus))
+    {
+        UNICODE_STRING  KeyName;
+        ULONG           ResultLength;
+        PKEY_VALUE_PARTIAL_INFORMATION PartialInfo;
+
+        // allocate data to hold key info, with room to terminate the strings
+        PVOID KeyInfo = ExAllocatePool(PagedPool, sizeof(KEY_VALUE_PARTIAL_INFORMATION) + PATCHLIB_MAXLEN + 2 * sizeof(WCHAR));
+        if(NULL != KeyInfo)
+        {
+            RtlInitUnicodeString( &KeyName, INI_STR_PATCHLIB );
+            ResultLength = 0;
+
+            // query the value key
+            ntStatus = DriverKey->QueryValueKey( &KeyName,
+                                                   KeyValuePartialInformation,
+                                                   KeyInfo,
+                                                   sizeof(KEY_VALUE_PARTIAL_INFORMATION) + PATCHLIB_MAXLEN,
+                                                   &ResultLength );
+            if(NT_SUCCESS(ntStatus))
+            {
+                PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(KeyInfo);
+
+                if (PartialInfo->Type == REG_SZ || PartialInfo->Type == REG_MULTI_SZ)
+                {
+                    PWSTR pszPath = (PWSTR)PartialInfo->Data;
+                    PWSTR pszEnd = (PWSTR)(PartialInfo->Data + PartialInfo->DataLength);
+
+                    pszEnd[0] = pszEnd[1] = 0;
+                    while (pszPath < pszEnd && *pszPath)
+                    {
+                        LoadBankFile(pszPath);
+                        if (PartialInfo->Type == REG_SZ)
+                            break;
+                        pszPath += wcslen(pszPath) + 1;
+                    }
+                }
+            }
+
+            // free the key info
+            ExFreePool(KeyInfo);
+        }
+        // release the driver key
+        DriverKey->Release();
+    }
+}
+
+/*****************************************************************************
+ * CMiniportMidiFM::LoadBankFile
+ *****************************************************************************
+ * Maps one bank file into system space and attaches it to m_pBank, see
+ * LoadPatchLib().  The view stays mapped until the miniport goes away.
+ * Bank 0 is what the notes of every other bank fall back to, so it is
+ * decoded right away and its view is unmapped again.
+ */
+VOID
+CMiniportMidiFM::
+LoadBankFile
+(   IN  PCWSTR  pszEntry
+)
+{
+    FILE_STANDARD_INFORMATION FileStandardInformationBlock;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK IoStatusBlock;
+    UNICODE_STRING UnicodeString;
+    HANDLE hFile = NULL, hSection = NULL;
+    PCWSTR pszPath = pszEntry;
+    ULONG ulMsb = 0, ulLsb = 0, ulSize, ulPatches = 0;
+    PVOID pSection = NULL, pView = NULL;
+    SIZE_T ViewSize = 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    // optional "<MSB>=" or "<MSB>.<LSB>=" in front of the path
+    while (*pszPath >= L'0' && *pszPath <= L'9')
+        ulMsb = ulMsb * 10 + (*pszPath++ - L'0');
+    if (pszPath != pszEntry && *pszPath == L'.')
+    {
+        pszPath++;
+        while (*pszPath >= L'0' && *pszPath <= L'9')
+            ulLsb = ulLsb * 10 + (*pszPath++ - L'0');
+    }
+    if (pszPath != pszEntry && *pszPath == L'=')
+        pszPath++;
+    else
+    {
+        pszPath = pszEntry;
+        ulMsb = ulLsb = 0;
+    }
+    if (ulMsb > 127 || ulLsb > 127)
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("[LoadBankFile] bad bank number in %ws", pszEntry));
+        return;
+    }
+    if ((ulMsb || ulLsb) && m_ulBankViews == FMBANK_MAXBANKS)
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("[LoadBankFile] too many banks, %ws left out", pszPath));
+        return;
+    }
+
+    RtlInitUnicodeString(&UnicodeString, pszPath);
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &UnicodeString,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status =    ZwCreateFile(&hFile,
+                                GENERIC_READ,
+                                &ObjectAttributes,
+                                &IoStatusBlock,
+                                0,
+                                FILE_ATTRIBUTE_NORMAL,
+                                FILE_SHARE_READ,
+                                FILE_OPEN,
+                                FILE_SYNCHRONOUS_IO_NONALERT,
+                                NULL,
+                                0);
+    if (!NT_SUCCESS(status))
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("[LoadBankFile] cannot open %ws", pszPath));
+        return;
+    }
+
+    if (!NT_SUCCESS(ZwQueryInformationFile(hFile,
+        &IoStatusBlock,
+        &FileStandardInformationBlock,
+        sizeof(FileStandardInformationBlock),
+        FileStandardInformation)) ||
+        FileStandardInformationBlock.EndOfFile.HighPart != 0 ||
+        FileStandardInformationBlock.EndOfFile.LowPart < 2 * NUMPATCHES ||
+        FileStandardInformationBlock.EndOfFile.LowPart > FMBANK_MAXSIZE)
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("[LoadBankFile] %ws is not a bank file", pszPath));
+        ZwClose(hFile);
+        return;
+    }
+    ulSize = FileStandardInformationBlock.EndOfFile.LowPart;
+
+    // map the file, the section object keeps it open
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwCreateSection(&hSection,
+                             SECTION_MAP_READ | SECTION_QUERY,
+                             &ObjectAttributes,
+                             NULL,
+                             PAGE_READONLY,
+                             SEC_COMMIT,
+                             hFile);
+    ZwClose(hFile);
+    if (NT_SUCCESS(status))
+    {
+        status = ObReferenceObjectByHandle(hSection, SECTION_MAP_READ, NULL, KernelMode, &pSection, NULL);
+        ZwClose(hSection);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = MmMapViewInSystemSpace(pSection, &pView, &ViewSize);
+        if (NT_SUCCESS(status))
+        {
+            if (ulMsb || ulLsb)
+                ulPatches = FmBank_Attach(m_pBank, FMBANK_NUMBER(ulMsb, ulLsb), (const BYTE *)pView, ulSize);
+            else
+                ulPatches = FmBank_Load(m_pBank, FMBANK_NUMBER(0, 0), (const BYTE *)pView, ulSize);
+            if (ulPatches && (ulMsb || ulLsb))
+            {
+                m_pBankSection[m_ulBankViews] = pSection;
+                m_pBankView[m_ulBankViews] = pView;
+                m_ulBankViews++;
+                pSection = NULL;
+            }
+            else
+                MmUnmapViewInSystemSpace(pView);
+        }
+        if (pSection)
+            ObDereferenceObject(pSection);
+    }
+    _DbgPrintF(DEBUGLVL_TERSE, ("[LoadBankFile] %ws: %d patches as bank %d.%d, status %X", pszPath, ulPatches, ulMsb, ulLsb, status));
+}
 #endif
\ No newline at end of file
@@ -9,6 +9,16 @@
 
 #include "common.h"
 #include "driver.h"
+#include "fmpace.h"
+#include "voicelst.h"
+#include "fmbank.h"
+#include "fmsched.h"
+#include "midichan.h"
+#include "fmtrace.h"
+#include "natv.h"
+
+DEFINE_GUID(CLSID_MiniportDriverESFMSynth,
+0x7EAEB839, 0xFF5F, 0x11D0, 0xA5, 0x10, 0x00, 0x60, 0x97, 0xC7, 0x9D, 0x21);
 
 enum {
     CHAN_MASTER = (-1),
@@ -23,6 +33,19 @@ enum {
 
 #define NUMOPS      4
 
+/* how long before their presentation time DirectMusic hands events to
+   the stream, see CMiniportMidiFM::NewStream() */
+#define FM_LOOKAHEAD_MS         (10)
+#define FM_MAXLOOKAHEAD_MS      (1000)
+/* queued events this close to their time are played right away */
+#define FM_EARLYPLAY_100NS      (10000)
+
+/* longest SysEx collected by the stream, the patch upload is the longest one understood */
+#define SYSEX_MAXLEN            (SYSEX_PATCHSIZE)
+
+/* longest Patches registry value, see LoadPatchLib() */
+#define PATCHLIB_MAXLEN         (sizeof(WCHAR) * 8 * MAX_PATH)
+
 #pragma pack (1)
 
 typedef struct _operStruct {
@@ -56,11 +79,12 @@ typedef struct _voiceStructOpl3 {
                                            drums patch = drum note + 128 */
         BYTE    bOn;                    /* TRUE if note is on, FALSE if off */
         BYTE    bVelocity;              /* velocity */
-        BYTE    bJunk;                  /* filler */
+        BYTE    bLink;                  /* other slot of a pair, VOICE_NIL if none */
         DWORD   dwTime;                 /* time that was turned on/off;
                                            0 time indicates that its not in use */
-        DWORD   dwOrigPitch[2];         /* original pitch, for pitch bend */
-        BYTE    bBlock[2];              /* value sent to the block */
+        DWORD   dwOrigPitch[2];         /* original pitch, for pitch bend,
+                                           [0] is the one of this slot */
+        BYTE    bBlock[2];              /* value sent to the block, [0] as above */
         BYTE    bSusHeld;               /* turned off, but held on by sustain */
 } voiceStructOpl3;
 
@@ -70,26 +94,44 @@ typedef struct _voiceStructOpl3 {
  * Classes
  */
 
+class CMiniportMidiStreamFM;
+
 /*****************************************************************************
  * CMiniportMidiFM
  *****************************************************************************
  * FM miniport.  This object is associated with the device and is
  * created when the device is started.  The class inherits IMiniportMidi
  * so it can expose this interface and CUnknown so it automatically gets
- * reference counting and aggregation support.
+ * reference counting and aggregation support.  It also inherits
+ * IMiniportDMus, so with PortDMus the stream gets timestamped events it
+ * plays itself, see CMiniportMidiStreamFM::PutMessage().
  */
 class CMiniportMidiFM
 :   public IMiniportMidi,
+    public IMiniportDMus,
     public CUnknown
 {
 private:
-    PPORTMIDI       m_Port;                 // Callback interface.
+    PPORT           m_Port;                 // Callback interface, PortMidi or PortDMus.
     PADAPTERCOMMON  m_pAdapterCommon;       // Adapter
     PUCHAR          m_PortBase;             // Base port address.
+    FMPACE          m_Pace;                 // Settle time of the OPL ports.
     BOOLEAN         m_BoardNotResponsive;   // Indicates dead hardware.
     BOOLEAN         m_bInit;                // true if we have already done init.
     BOOLEAN         m_fStreamExists;        // True if we have a stream.
     BOOLEAN         m_fESFM;
+    BOOLEAN         m_fCoalesce;            // Coalesce bends/volumes per write, ESFM only.
+    BOOLEAN         m_fDemote2nd;           // Steal second voices first, ESFM only.
+    BYTE            m_bStealRank[NUMCHANNELS];  // Voice steal rank per channel, 0xFF keeps the engine's.
+    BOOLEAN         m_fDMus;                // Bound to PortDMus.
+    ULONG           m_ulLookahead;          // DirectMusic schedule prefetch, in ms.
+    FMBANK *        m_pBank;                // Decoded ESFM patches.
+    WORK_QUEUE_ITEM m_BankWork;             // Decodes the patches of attached banks.
+    KEVENT          m_BankIdle;             // Set when no m_BankWork is queued.
+    LONG            m_lBankWork;
+    PVOID           m_pBankSection[FMBANK_MAXBANKS];    // Bank files attached to m_pBank.
+    PVOID           m_pBankView[FMBANK_MAXBANKS];
+    ULONG           m_ulBankViews;
 
     /*************************************************************************
      * CMiniportMidiFM methods
@@ -103,6 +145,21 @@ private:
     (
         IN      PRESOURCELIST   ResourceList
     );
+    NTSTATUS
+    InitMiniport
+    (
+        IN      PUNKNOWN        UnknownAdapter,
+        IN      PRESOURCELIST   ResourceList,
+        IN      PPORT           Port,
+        OUT     PSERVICEGROUP * ServiceGroup
+    );
+    NTSTATUS
+    CreateStream
+    (
+        OUT     CMiniportMidiStreamFM **    Stream,
+        IN      PUNKNOWN                    OuterUnknown    OPTIONAL,
+        IN      POOL_TYPE                   PoolType
+    );
 
     void SoundMidiSendFM(PUCHAR PortBase, ULONG Address, UCHAR Data); // low-level--write registers
 
@@ -110,8 +167,12 @@ private:
     BOOL SoundMidiIsOpl3(VOID);     // returns true if the device is an opl3 and false if not.
     VOID SoundMidiQuiet(VOID);
     VOID Opl3_BoardReset(VOID);
+    static VOID BankWant(PVOID Context);
+    static VOID BankWork(PVOID Context);
 #ifdef LOAD_PATCHES
     VOID GetRegistrySettings(VOID);
+    VOID LoadPatchLib(VOID);
+    VOID LoadBankFile(IN PCWSTR pszEntry);
 #endif
 
 
@@ -186,6 +247,30 @@ public:
     (   void
     );
 
+    /*************************************************************************
+     * IMiniportDMus methods, Service() is the one above
+     */
+    STDMETHODIMP_(NTSTATUS) Init
+    (
+        IN      PUNKNOWN        UnknownAdapter,
+        IN      PRESOURCELIST   ResourceList,
+        IN      PPORTDMUS       Port,
+        OUT     PSERVICEGROUP * ServiceGroup
+    );
+    STDMETHODIMP_(NTSTATUS) NewStream
+    (
+        OUT     PMXF *                  MXF,
+        IN      PUNKNOWN                OuterUnknown    OPTIONAL,
+        IN      POOL_TYPE               PoolType,
+        IN      ULONG                   PinID,
+        IN      DMUS_STREAM_TYPE        StreamType,
+        IN      PKSDATAFORMAT           DataFormat,
+        OUT     PSERVICEGROUP *         ServiceGroup,
+        IN      PAllocatorMXF           AllocatorMXF,
+        IN      PMASTERCLOCK            MasterClock,
+        OUT     PULONGLONG              SchedulePreFetch
+    );
+
     /*************************************************************************
      * IPowerNotify methods
      */
@@ -198,6 +283,22 @@ public:
      * Friends
      */
     friend class CMiniportMidiStreamFM;
+    friend
+    static
+    NTSTATUS
+    PropertyHandler_Synth
+    (
+        IN      PPCPROPERTY_REQUEST PropertyRequest
+    );
+#ifdef FM_TRACE
+    friend
+    static
+    NTSTATUS
+    PropertyHandler_FmTrace
+    (
+        IN      PPCPROPERTY_REQUEST PropertyRequest
+    );
+#endif
 
 };
 
@@ -207,19 +308,34 @@ public:
  * FM miniport stream.  This object is associated with a pin and is created
  * when the pin is instantiated.  The class inherits IMiniportMidiStream
  * so it can expose this interface and CUnknown so it automatically gets
- * reference counting and aggregation support.
+ * reference counting and aggregation support.  IMXF is the interface of
+ * a stream created through IMiniportDMus.
  */
 class CMiniportMidiStreamFM
 :   public IMiniportMidiStream,
+    public IMXF,
     public CUnknown
 {
 private:
     CMiniportMidiFM *   m_Miniport;     // Parent miniport.
     PUCHAR              m_PortBase;     // Base port address.
+    CEsfmEngine         m_Engine;       // Native ESFM synth, if m_fESFM.
 
     // midi stuff
     voiceStructOpl3 m_Voice[NUM2VOICES];  /* info on what voice is where */
+    /* voice index, bit n stands for m_Voice[n] */
+    DWORD m_dwNoteOn[NUMCHANNELS][128];   /* voices on, by channel and note */
+    DWORD m_dwChanVoices[NUMCHANNELS];    /* voices last used by a channel */
+    DWORD m_dwChanHeld[NUMCHANNELS];      /* voices held by sustain, bSusHeld set */
+    /* slot allocation, see Opl3_FindEmptySlot() */
+    DWORD       m_dwUnusedSlots;            /* voices with a dwTime of 0 */
+    VOICELIST   m_OffSlots;                 /* notes off, oldest first */
+    VOICELIST   m_OnSlots;                  /* notes on, oldest first */
+    VOICELINK   m_SlotLink[NUM2VOICES];     /* in m_OffSlots or m_OnSlots */
+    VOICELIST   m_PatchSlots[256];          /* notes on by patch, oldest first */
+    VOICELINK   m_PatchLink[NUM2VOICES];
     DWORD m_dwCurTime;    /* for note on/off */
+    BYTE    m_bConnection;          /* AD_CONNECTION, pairs used as 4-op voice */
     /* volume */
     WORD    m_wSynthAttenL;        /* in 1.5dB steps */
     WORD    m_wSynthAttenR;        /* in 1.5dB steps */
@@ -228,9 +344,26 @@ private:
     BYTE    m_bChanAtten[NUMCHANNELS];       /* attenuation of each channel, in .75 db steps */
     BYTE    m_bStereoMask[NUMCHANNELS];              /* mask for left/right for stereo midi files */
 
-    short   m_iBend[NUMCHANNELS];    /* bend for each channel */
-    BYTE    m_bPatch[NUMCHANNELS];   /* patch number mapped to */
-    BYTE    m_bSustain[NUMCHANNELS];   /* Is sustain in effect on this channel? */
+    MIDICHAN m_Chan[NUMCHANNELS];    /* controllers, see MidiChan_Message() */
+
+    /* MIDI parser, see Write() */
+    BYTE    m_bRunStatus;          /* running status, 0 = none */
+    BYTE    m_bMsgPos;             /* next byte in m_dwMsg, 0 = no message */
+    BYTE    m_bMsgLeft;            /* data bytes missing in m_dwMsg */
+    DWORD   m_dwMsg;               /* message being collected */
+    BOOL    m_fSysEx;              /* inside a SysEx */
+    ULONG   m_ulSysExLen;          /* bytes of it so far, may exceed SYSEX_MAXLEN */
+    BYTE    m_bSysEx[SYSEX_MAXLEN];
+
+    /* DirectMusic events waiting for their time, see PutMessage() */
+    PAllocatorMXF   m_AllocatorMXF;     // Takes the events back, NULL if not DirectMusic.
+    PMASTERCLOCK    m_MasterClock;      // Presentation time base.
+    KSPIN_LOCK      m_EventLock;        // m_Sched and the synth, against EventDpc().
+    KTIMER          m_EventTimer;       // Set for the first event in m_Sched.
+    KDPC            m_EventDpc;
+    BOOLEAN         m_fRunning;         // KSSTATE_RUN, m_EventTimer may be set.
+    BOOLEAN         m_fTimerRes;        // System timer resolution raised.
+    FMSCHED         m_Sched;
 
     /*************************************************************************
      * CMiniportMidiStreamFM methods
@@ -239,24 +372,37 @@ private:
      * MINIPORT.CPP for specific descriptions.
      */
 
+    VOID ParseMidi(PUCHAR pData, ULONG ulLength);
+    VOID SendMidiMessage(DWORD dwData);
+    VOID PlayEvents(VOID);
+    VOID PlayEvent(PDMUS_KERNEL_EVENT pEvent);
+    VOID FreeEvent(PDMUS_KERNEL_EVENT pEvent);
+    VOID FreeEvents(VOID);
+    static VOID EventDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+    VOID SendSysEx(PUCHAR pData, ULONG ulLength);
     VOID WriteMidiData(DWORD dwData);
     // opl3 processing methods.
     VOID Opl3_ChannelVolume(BYTE bChannel, WORD wAtten);
     VOID Opl3_SetPan(BYTE bChannel, BYTE bPan);
-    VOID Opl3_PitchBend(BYTE bChannel, short iBend);
-    VOID Opl3_NoteOn(BYTE bPatch,BYTE bNote, BYTE bChannel, BYTE bVelocity,short iBend);
+    VOID Opl3_PitchBend(BYTE bChannel);
+    VOID Opl3_NoteOn(BYTE bPatch,BYTE bNote, BYTE bChannel, BYTE bVelocity);
     VOID Opl3_NoteOff (BYTE bPatch,BYTE bNote, BYTE bChannel);
     VOID Opl3_AllNotesOff(VOID);
     VOID Opl3_ChannelNotesOff(BYTE bChannel);
+    VOID Opl3_ReleaseSlot(BYTE bSlot);
+    VOID Opl3_SlotsOff(DWORD dwMask);
     WORD Opl3_FindFullSlot(BYTE bNote, BYTE bChannel);
     WORD Opl3_CalcFAndB (DWORD dwPitch);
-    DWORD Opl3_CalcBend (DWORD dwOrig, short iBend);
+    DWORD Opl3_CalcBend (DWORD dwOrig, USHORT wMult);
     BYTE Opl3_CalcVolume (BYTE bOrigAtten, BYTE bChannel,BYTE bVelocity, BYTE bOper, BYTE bMode);
     BYTE Opl3_CalcStereoMask (BYTE bChannel);
     WORD Opl3_FindEmptySlot(BYTE bPatch);
+    WORD Opl3_FindEmptyPair(VOID);
+    VOID Opl3_TakeSlot(BYTE bSlot);
+    VOID Opl3_SlotOff(BYTE bSlot);
+    BYTE Opl3_CalcMode(noteStruct FAR * lpNS, BOOL fPair);
     VOID Opl3_SetVolume(BYTE bChannel);
-    VOID Opl3_FMNote(WORD wNote, noteStruct FAR * lpSN);
-    VOID Opl3_SetSustain(BYTE bChannel, BYTE bSusLevel);
+    VOID Opl3_FMNote(WORD wNote, noteStruct FAR * lpSN, BOOL fPair);
 
     void SetFMAtten(LONG channel, LONG level);
 
@@ -267,6 +413,13 @@ public:
         IN      CMiniportMidiFM *   Miniport,
         IN      PUCHAR              PortBase
     );
+    VOID
+    InitDMus
+    (
+        IN      PAllocatorMXF       AllocatorMXF,
+        IN      PMASTERCLOCK        MasterClock
+    );
+    NTSTATUS GetLatencyClock(OUT PULONGLONG pullTime);
 
     /*************************************************************************
      * The following two macros are from STDUNK.H.  DECLARE_STD_UNKNOWN()
@@ -306,6 +459,22 @@ public:
         OUT     PULONG      BytesWritten
     );
 
+    /*************************************************************************
+     * IMXF methods, SetState() is the one above
+     */
+    STDMETHODIMP_(NTSTATUS) PutMessage
+    (
+        IN      PDMUS_KERNEL_EVENT  pDMKEvt
+    );
+    STDMETHODIMP_(NTSTATUS) ConnectOutput
+    (
+        IN      PMXF        sinkMXF
+    );
+    STDMETHODIMP_(NTSTATUS) DisconnectOutput
+    (
+        IN      PMXF        sinkMXF
+    );
+
 };
 
 NTSTATUS CreateMiniportMidiESFM
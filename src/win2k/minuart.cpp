@@ -30,9 +30,7 @@ typedef struct
     PVOID               BufferAddress;
     ULONG               Length;
     PULONG              BytesRead;
-    PULONG              pMPUInputBufferHead;
-    ULONG               MPUInputBufferTail;
-    PUCHAR              MPUInputBuffer;
+    MPUFIFO *           pMPUInputFifo;
 }
 DEFERREDREADCONTEXT, *PDEFERREDREADCONTEXT;
 
@@ -278,9 +276,7 @@ Init
     m_fMPUInitialized = FALSE;
     m_PowerState  = PowerSystemUnspecified;
     
-    RtlZeroMemory(m_MPUInputBuffer, sizeof(m_MPUInputBuffer));
-    m_MPUInputBufferHead = 0;
-    m_MPUInputBufferTail = 0;
+    MpuFifo_Init(&m_MPUInputFifo);
     m_KSStateInput = KSSTATE_STOP;
     
     m_NumRenderStreams = 0;
@@ -832,6 +828,9 @@ CMiniportMidiStreamUart::~CMiniportMidiStreamUart(void)
         if (m_fCapture)
         {
             m_pMiniport->m_NumCaptureStreams = 0;
+            if (m_pMiniport->m_MPUInputFifo.dwOverflows)
+                _DbgPrintF(DEBUGLVL_TERSE,("%d input bytes dropped so far, FIFO was full",
+                    m_pMiniport->m_MPUInputFifo.dwOverflows));
         }
         else
         {
@@ -905,8 +904,8 @@ SetState
     
     if (NewState == KSSTATE_STOP)   // STOPping
     {
-        m_pMiniport->m_MPUInputBufferHead = 0;   // Previously read bytes are discarded.
-        m_pMiniport->m_MPUInputBufferTail = 0;   // The entire FIFO is available.
+        // Previously read bytes are discarded, the ISR stores no new ones.
+        MpuFifo_Flush(&m_pMiniport->m_MPUInputFifo);
     }
 
     return STATUS_SUCCESS;
@@ -1230,7 +1229,7 @@ Service
         //  we should never get here....
         //  if we do, we must have read some trash,
         //  so just reset the input FIFO
-        m_MPUInputBufferTail = m_MPUInputBufferHead = 0;
+        MpuFifo_Flush(&m_MPUInputFifo);
     }
 }
 
@@ -1259,9 +1258,7 @@ Read
         context.BufferAddress   = BufferAddress;
         context.Length          = Length;
         context.BytesRead       = BytesRead;
-        context.pMPUInputBufferHead = &(m_pMiniport->m_MPUInputBufferHead);
-        context.MPUInputBufferTail = m_pMiniport->m_MPUInputBufferTail;
-        context.MPUInputBuffer     = m_pMiniport->m_MPUInputBuffer;
+        context.pMPUInputFifo   = &(m_pMiniport->m_MPUInputFifo);
 
         return (DeferredLegacyRead(m_pMiniport->m_pInterruptSync,PVOID(&context)));
     }
@@ -1274,8 +1271,11 @@ Read
 /*****************************************************************************
  * DeferredLegacyRead()
  *****************************************************************************
- * Synchronized routine to read incoming MIDI data.
+ * Routine to read incoming MIDI data.
  * We have already read the bytes in, and now the Port wants them.
+ * The ISR is the only other writer of the FIFO, so this needs no
+ * synchronization with the interrupt, see mpufifo.h.  A flush asked
+ * for by SetState() or Service() is carried out here.
  */
 NTSTATUS
 DeferredLegacyRead
@@ -1294,31 +1294,12 @@ DeferredLegacyRead
 
 
     NTSTATUS ntStatus = STATUS_SUCCESS;
-    PUCHAR  pDest = PUCHAR(context->BufferAddress);
-    PULONG  pMPUInputBufferHead = context->pMPUInputBufferHead;
-    ULONG   MPUInputBufferTail = context->MPUInputBufferTail;
-    ULONG   bytesRead = 0;
 
-    ASSERT(pMPUInputBufferHead);
-    ASSERT(context->MPUInputBuffer);
+    ASSERT(context->pMPUInputFifo);
 
-    while  (    (*pMPUInputBufferHead != MPUInputBufferTail)
-            &&  (bytesRead < context->Length) )
-    {
-        *pDest = context->MPUInputBuffer[*pMPUInputBufferHead];
-
-        pDest++;
-        bytesRead++;
-        *pMPUInputBufferHead = *pMPUInputBufferHead + 1;
-        //
-        //  Wrap FIFO position when reaching the buffer size.
-        //
-        if (*pMPUInputBufferHead >= kMPUInputBufferSize)
-        {
-            *pMPUInputBufferHead = 0;
-        }
-    }
-    *context->BytesRead = bytesRead;
+    *context->BytesRead = MpuFifo_Get(context->pMPUInputFifo,
+                                      PUCHAR(context->BufferAddress),
+                                      context->Length);
 
     return ntStatus;
 }
@@ -1368,14 +1349,8 @@ MPUInterruptServiceRoutine
                 UCHAR uDest = READ_PORT_UCHAR(that->m_pPortBase + MPU401_REG_DATA);
                 if (that->m_KSStateInput == KSSTATE_RUN)
                 {
-                    //  ...place the data in our FIFO...
-                    that->m_MPUInputBuffer[that->m_MPUInputBufferTail] = uDest;
-                    
-                    that->m_MPUInputBufferTail++;
-                    if (that->m_MPUInputBufferTail >= kMPUInputBufferSize)
-                    {
-                        that->m_MPUInputBufferTail = 0;
-                    }
+                    //  ...place the data in our FIFO, a full one drops it...
+                    MpuFifo_Put(&that->m_MPUInputFifo, uDest);
                 }
                 //
                 // Look for more MIDI data.
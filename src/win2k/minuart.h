@@ -8,6 +8,7 @@
 #define _MINUART_H_
 
 #include "common.h"
+#include "mpufifo.h"
 
 /*****************************************************************************
  * Prototypes
@@ -23,8 +24,6 @@ NTSTATUS ResetMPUHardware(PUCHAR portBase);
 const BOOLEAN COMMAND   = TRUE;
 const BOOLEAN DATA      = FALSE;
 
-const ULONG kMPUInputBufferSize = 64;
-
 /*****************************************************************************
  * Globals
  */
@@ -56,9 +55,7 @@ private:
     PSERVICEGROUP   m_pServiceGroup;        // Service group for capture.
     USHORT          m_NumRenderStreams;     // Num active render streams.
     USHORT          m_NumCaptureStreams;    // Num active capture streams.
-    UCHAR           m_MPUInputBuffer[kMPUInputBufferSize];  // Internal SW FIFO.
-    ULONG           m_MPUInputBufferHead;   // Index of the newest byte in the FIFO.
-    ULONG           m_MPUInputBufferTail;   // Index of the oldest empty space in the FIFO.  
+    MPUFIFO         m_MPUInputFifo;         // Internal SW FIFO, filled by the ISR.
     KSSTATE         m_KSStateInput;         // Miniport input stream state (RUN/PAUSE/ACQUIRE/STOP)
     SYSTEM_POWER_STATE  m_PowerState;
     BOOLEAN         m_fMPUInitialized;      // Is the MPU HW initialized.
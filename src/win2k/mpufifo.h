@@ -0,0 +1,102 @@
+/*****************************************************************************
+ * mpufifo.h - MIDI input FIFO of the MPU-401 miniport
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * The ISR puts the bytes it reads from the MPU into the FIFO, Read() takes
+ * them out from the port's DPC.  There is one writer and one reader, so
+ * neither needs a lock: only the ISR moves ulTail and only the reader moves
+ * ulHead.  Both count bytes and run freely, the FIFO position is the count
+ * masked by MPUFIFO_SIZE - 1, so MPUFIFO_SIZE has to be a power of two.
+ * A full FIFO drops the new bytes and counts them, the bytes already in it
+ * are kept.  Anyone may flush the FIFO, but that only leaves a request the
+ * reader carries out when it takes bytes next.
+ */
+
+#ifndef _MPUFIFO_H_
+#define _MPUFIFO_H_
+
+/* large enough for the SysEx bank dumps of external synths */
+#ifndef MPUFIFO_SIZE
+#define MPUFIFO_SIZE            (4096)
+#endif
+
+C_ASSERT((MPUFIFO_SIZE & (MPUFIFO_SIZE - 1)) == 0);
+
+typedef struct _MPUFIFO {
+        volatile ULONG  ulHead;         /* bytes taken, reader only */
+        volatile ULONG  ulTail;         /* bytes put, ISR only */
+        volatile ULONG  ulFlushTo;      /* ulTail when a flush was asked for */
+        volatile LONG   lFlush;         /* flush asked for, reset by the reader */
+        ULONG           dwOverflows;    /* bytes dropped, FIFO was full */
+        UCHAR           bData[MPUFIFO_SIZE];
+} MPUFIFO;
+
+__inline VOID MpuFifo_Init(MPUFIFO *pFifo)
+{
+    pFifo->ulHead = 0;
+    pFifo->ulTail = 0;
+    pFifo->ulFlushTo = 0;
+    pFifo->lFlush = 0;
+    pFifo->dwOverflows = 0;
+}
+
+/*
+ * MpuFifo_Put - append a byte, ISR only.
+ *
+ * returns FALSE if the FIFO is full
+ */
+__inline BOOL MpuFifo_Put(MPUFIFO *pFifo, UCHAR bData)
+{
+    ULONG ulTail = pFifo->ulTail;
+
+    if (ulTail - pFifo->ulHead >= MPUFIFO_SIZE)
+    {
+        pFifo->dwOverflows++;
+        return FALSE;
+    }
+    pFifo->bData[ulTail & (MPUFIFO_SIZE - 1)] = bData;
+    /* the byte has to be there before the reader sees it counted */
+    KeMemoryBarrier();
+    pFifo->ulTail = ulTail + 1;
+    return TRUE;
+}
+
+/*
+ * MpuFifo_Get - take up to ulLength bytes, reader only.
+ *
+ * returns the number of bytes copied to pDest
+ */
+__inline ULONG MpuFifo_Get(MPUFIFO *pFifo, PUCHAR pDest, ULONG ulLength)
+{
+    ULONG ulHead = pFifo->ulHead;
+    ULONG ulCount, i;
+
+    /* skip what was there at the last flush, unless it is read already */
+    if (InterlockedExchange(&pFifo->lFlush, 0) && (LONG)(pFifo->ulFlushTo - ulHead) > 0)
+        ulHead = pFifo->ulFlushTo;
+    ulCount = pFifo->ulTail - ulHead;
+    /* no byte may be read before the count that covers it */
+    KeMemoryBarrier();
+    if (ulCount > ulLength)
+        ulCount = ulLength;
+    for (i = 0; i < ulCount; i++)
+        pDest[i] = pFifo->bData[(ulHead + i) & (MPUFIFO_SIZE - 1)];
+    /* and all of them before the ISR may overwrite them */
+    KeMemoryBarrier();
+    pFifo->ulHead = ulHead + ulCount;
+    return ulCount;
+}
+
+/*
+ * MpuFifo_Flush - drop the bytes that are in the FIFO now, any thread.
+ * The reader skips them the next time it calls MpuFifo_Get().
+ */
+__inline VOID MpuFifo_Flush(MPUFIFO *pFifo)
+{
+    pFifo->ulFlushTo = pFifo->ulTail;
+    /* a full barrier, ulFlushTo has to be there when lFlush is seen */
+    InterlockedExchange(&pFifo->lFlush, 1);
+}
+
+#endif
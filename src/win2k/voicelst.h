@@ -0,0 +1,65 @@
+/*****************************************************************************
+ * voicelst.h - intrusive lists of synth voices
+ *****************************************************************************
+ * Copyright (c) 2023 leecher@dose.0wnz.at  All rights reserved.
+ *
+ * The voice allocators keep their voices in lists ordered by age, the
+ * oldest at the head.  The lists are linked through voice numbers, so
+ * they need no memory besides a VOICELINK per voice and list.
+ */
+
+#ifndef _VOICELST_H_
+#define _VOICELST_H_
+
+#define VOICE_NIL       (0xFF)
+
+typedef struct _VOICELIST {
+        BYTE    bHead;
+        BYTE    bTail;
+} VOICELIST;
+
+typedef struct _VOICELINK {
+        BYTE    bNext;
+        BYTE    bPrev;
+} VOICELINK;
+
+__inline VOID VoiceList_Init(VOICELIST *pList)
+{
+    pList->bHead = pList->bTail = VOICE_NIL;
+}
+
+/*
+ * VoiceList_Insert - put bVoice in front of bBefore, or at the tail if
+ * bBefore is VOICE_NIL.
+ */
+__inline VOID VoiceList_Insert(VOICELIST *pList, VOICELINK *pLinks, BYTE bVoice, BYTE bBefore)
+{
+    BYTE bPrev = (bBefore == VOICE_NIL) ? pList->bTail : pLinks[bBefore].bPrev;
+
+    pLinks[bVoice].bNext = bBefore;
+    pLinks[bVoice].bPrev = bPrev;
+    if (bPrev == VOICE_NIL)
+        pList->bHead = bVoice;
+    else
+        pLinks[bPrev].bNext = bVoice;
+    if (bBefore == VOICE_NIL)
+        pList->bTail = bVoice;
+    else
+        pLinks[bBefore].bPrev = bVoice;
+}
+
+__inline VOID VoiceList_Remove(VOICELIST *pList, VOICELINK *pLinks, BYTE bVoice)
+{
+    BYTE bNext = pLinks[bVoice].bNext, bPrev = pLinks[bVoice].bPrev;
+
+    if (bPrev == VOICE_NIL)
+        pList->bHead = bNext;
+    else
+        pLinks[bPrev].bNext = bNext;
+    if (bNext == VOICE_NIL)
+        pList->bTail = bPrev;
+    else
+        pLinks[bNext].bPrev = bPrev;
+}
+
+#endif